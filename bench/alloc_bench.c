@@ -0,0 +1,146 @@
+/**
+ * ls、treeでのアロケータの呼び出し回数を、アリーナを使う場合と使わない場合で比べるベンチマーク
+ *
+ * ビルド:
+ *     cc -O2 -pthread -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc,--wrap=free -o alloc_bench bench/alloc_bench.c
+ *
+ * 使い方:
+ *     alloc_bench IMAGE_FILE [PATH]
+ */
+
+#define main fatMain
+#include "../fat.c"
+#undef main
+
+// 呼び出し回数
+static u64 mallocCount;
+static u64 callocCount;
+static u64 reallocCount;
+static u64 freeCount;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *pointer, size_t size);
+void __real_free(void *pointer);
+
+void *__wrap_malloc(size_t size)
+{
+    __atomic_add_fetch(&mallocCount, 1, __ATOMIC_RELAXED);
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size)
+{
+    __atomic_add_fetch(&callocCount, 1, __ATOMIC_RELAXED);
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *pointer, size_t size)
+{
+    __atomic_add_fetch(&reallocCount, 1, __ATOMIC_RELAXED);
+    return __real_realloc(pointer, size);
+}
+
+void __wrap_free(void *pointer)
+{
+    __atomic_add_fetch(&freeCount, 1, __ATOMIC_RELAXED);
+    __real_free(pointer);
+}
+
+// 呼び出し回数をリセットする
+static void resetCounts()
+{
+    mallocCount = callocCount = reallocCount = freeCount = 0;
+}
+
+// 指定されたコマンドを実行して、アロケータの呼び出し回数と時間を表示する
+static Result runBenchmark(const char *imageFilename, const char *path, const char *command, Boolean useEntryArena)
+{
+    ImageOptions options;
+    getDefaultImageOptions(&options);
+    options.useEntryArena = useEntryArena;
+
+    Image *image;
+    Result result = openImageWithOptions(&image, imageFilename, &options);
+    if (result)
+    {
+        fprintf(stderr, "Failed to open image: %d\n", result);
+        return result;
+    }
+
+    Entry *root;
+    result = openEntry(&root, image, "/");
+    if (result)
+    {
+        closeImage(image);
+        return result;
+    }
+
+    Entry *entry;
+    result = getEntry(&entry, root, path);
+    if (result)
+    {
+        fprintf(stderr, "Failed to find entry: %d\n", result);
+        closeImage(image);
+        return result;
+    }
+
+    // 出力は計測に含めないように捨てる
+    fflush(stdout);
+    s32 savedStdout = dup(STDOUT_FILENO);
+    s32 nullFd = open("/dev/null", O_WRONLY);
+    dup2(nullFd, STDOUT_FILENO);
+    close(nullFd);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    resetCounts();
+
+    if (strcmp(command, "ls") == 0)
+    {
+        printChildren(entry);
+    }
+    else
+    {
+        printTree(entry);
+    }
+
+    u64 counts[4] = {mallocCount, callocCount, reallocCount, freeCount};
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    fflush(stdout);
+    dup2(savedStdout, STDOUT_FILENO);
+    close(savedStdout);
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("%-4s %-8s malloc %8llu  calloc %8llu  realloc %8llu  free %8llu  total %8llu  %.6fs\n",
+           command, useEntryArena ? "arena" : "heap",
+           counts[0], counts[1], counts[2], counts[3],
+           counts[0] + counts[1] + counts[2] + counts[3], seconds);
+
+    closeImage(image);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: %s IMAGE_FILE [PATH]\n", argv[0]);
+        return 1;
+    }
+
+    const char *path = argc > 2 ? argv[2] : "/";
+    const char *commands[] = {"ls", "tree"};
+
+    for (u8 i = 0; i < 2; ++i)
+    {
+        if (runBenchmark(argv[1], path, commands[i], FALSE) ||
+            runBenchmark(argv[1], path, commands[i], TRUE))
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
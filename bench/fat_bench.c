@@ -0,0 +1,480 @@
+/**
+ * FATイメージを開く、パスを解決する、子エントリを列挙する、treeを表示する、ファイルを読み込む時間を計測するベンチマーク
+ * 結果はイメージごとに1つのJSONオブジェクトにして、JSONの配列で書き出す
+ *
+ * ビルド:
+ *     cc -O2 -pthread -o fat_bench bench/fat_bench.c
+ *
+ * 使い方:
+ *     fat_bench [-r REPEAT] [-o OUTPUT_FILE] IMAGE_FILE...
+ *
+ * 計測に使うエントリはイメージを走査して選ぶ
+ *     最も深いエントリと、最も子の多いディレクトリの最後の子のパスを解決する
+ *     最も子の多いディレクトリの子エントリを列挙する
+ *     最も大きいファイルと、すべてのファイルを読み込む
+ */
+
+#define main fatMain
+#include "../fat.c"
+#undef main
+
+// 計測の既定の繰り返し回数
+#define DEFAULT_REPEAT_COUNT 10
+
+// ファイルの読み込みに使うバッファのバイト数
+#define BENCH_BUFFER_SIZE (1024 * 1024)
+
+// パスの最大のバイト数
+#define MAX_BENCH_PATH_SIZE 4096
+
+// 計測に使うエントリを表す
+typedef struct __BenchTargets
+{
+    // 最も深いエントリのパスと深さ
+    char deepestPath[MAX_BENCH_PATH_SIZE];
+    u32 deepestDepth;
+
+    // 最も子の多いディレクトリのパスと子の数、その最後の子のパス
+    char widestPath[MAX_BENCH_PATH_SIZE];
+    u32 widestCount;
+    char widestLastChildPath[MAX_BENCH_PATH_SIZE];
+
+    // 最も大きいファイルのパスと大きさ
+    char largestPath[MAX_BENCH_PATH_SIZE];
+    u32 largestSize;
+
+    // すべてのファイルの数と大きさの合計
+    u64 fileCount;
+    u64 totalSize;
+} BenchTargets;
+
+// 結果の書き出し先と、最初の計測結果かどうか
+typedef struct __BenchOutput
+{
+    FILE *fp;
+    Boolean first;
+} BenchOutput;
+
+// 単調増加する時刻を秒で取得する
+double getSeconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// JSONの文字列として書き出す
+void writeJsonString(FILE *fp, const char *string)
+{
+    fputc('"', fp);
+    for (const u8 *p = (const u8 *)string; *p != '\0'; ++p)
+    {
+        if (*p == '"' || *p == '\\')
+        {
+            fprintf(fp, "\\%c", *p);
+        }
+        else if (*p < 0x20)
+        {
+            fprintf(fp, "\\u%04x", *p);
+        }
+        else
+        {
+            fputc(*p, fp);
+        }
+    }
+    fputc('"', fp);
+}
+
+/**
+ * 計測結果を1つ書き出す
+ * バイト数が0でなければ、1秒あたりのバイト数も書き出す
+ */
+void writeResult(BenchOutput *output, const char *name, const char *target, u32 iterations, double seconds, u64 byteCount)
+{
+    FILE *fp = output->fp;
+    fprintf(fp, "%s\n      {\"name\": ", output->first ? "" : ",");
+    writeJsonString(fp, name);
+    fprintf(fp, ", \"target\": ");
+    writeJsonString(fp, target);
+    fprintf(fp, ", \"iterations\": %u, \"seconds\": %.9f, \"secondsPerIteration\": %.9f", iterations, seconds, seconds / iterations);
+    if (byteCount > 0)
+    {
+        fprintf(fp, ", \"bytes\": %llu, \"bytesPerSecond\": %.1f", byteCount, seconds > 0 ? byteCount / seconds : 0.0);
+    }
+    fprintf(fp, "}");
+    output->first = FALSE;
+
+    fprintf(stderr, "  %-16s %-40.40s %10.6f ms", name, target, seconds * 1000 / iterations);
+    if (byteCount > 0 && seconds > 0)
+    {
+        fprintf(stderr, "  %8.1f MiB/s", byteCount / seconds / (1024 * 1024));
+    }
+    fprintf(stderr, "\n");
+}
+
+// ディレクトリ以下を走査して、計測に使うエントリを探す
+void findTargets(BenchTargets *targets, const Entry *directory, char *path, u32 depth)
+{
+    Directory *iterator;
+    if (openDir(&iterator, directory))
+    {
+        return;
+    }
+
+    u64 length = strlen(path);
+    u32 count = 0;
+    char lastName[MAX_NAME_SIZE] = "";
+    const Entry *child;
+    while (readDir(&child, iterator) == 0 && child != NULL)
+    {
+        if (strcmp(child->name, ".") == 0 || strcmp(child->name, "..") == 0 || hasAttribute(child, VOLUME_ID))
+        {
+            continue;
+        }
+        if (length + strlen(child->name) + 2 > MAX_BENCH_PATH_SIZE)
+        {
+            continue;
+        }
+
+        snprintf(path + length, MAX_BENCH_PATH_SIZE - length, "%s%s", length > 1 ? "/" : "", child->name);
+        strcpy(lastName, child->name);
+        ++count;
+
+        if (depth + 1 > targets->deepestDepth)
+        {
+            targets->deepestDepth = depth + 1;
+            strcpy(targets->deepestPath, path);
+        }
+
+        if (hasAttribute(child, DIRECTORY))
+        {
+            // 子エントリは読み込み中の領域を指すので、コピーしてから降りる
+            Entry *copy;
+            if (copyEntry(&copy, child) == 0)
+            {
+                findTargets(targets, copy, path, depth + 1);
+                closeEntry(copy);
+            }
+        }
+        else if (hasAttribute(child, ARCHIVE))
+        {
+            targets->fileCount++;
+            targets->totalSize += child->size;
+            if (targets->largestPath[0] == '\0' || child->size > targets->largestSize)
+            {
+                targets->largestSize = child->size;
+                strcpy(targets->largestPath, path);
+            }
+        }
+
+        path[length] = '\0';
+    }
+
+    closeDir(iterator);
+
+    if (count > targets->widestCount)
+    {
+        targets->widestCount = count;
+        strcpy(targets->widestPath, path);
+        snprintf(targets->widestLastChildPath, MAX_BENCH_PATH_SIZE, "%s%s%s", path, length > 1 ? "/" : "", lastName);
+    }
+}
+
+// 指定されたパスのファイルを最後まで読み込み、読み込んだバイト数を返す
+u64 readWholeFile(Image *image, const char *path, u8 *buffer)
+{
+    Entry *entry;
+    if (openEntry(&entry, image, path))
+    {
+        return 0;
+    }
+
+    u64 byteCount = 0;
+    File *file;
+    if (openFile(&file, entry) == 0)
+    {
+        u32 size;
+        while ((size = readFile(buffer, BENCH_BUFFER_SIZE, file)) > 0)
+        {
+            byteCount += size;
+        }
+        closeFile(file);
+    }
+
+    closeEntry(entry);
+    return byteCount;
+}
+
+// ディレクトリ以下のすべてのファイルを読み込み、読み込んだバイト数を返す
+u64 readAllFiles(const Entry *directory, u8 *buffer)
+{
+    Entry **children;
+    s32 count = getChildren(&children, directory);
+
+    u64 byteCount = 0;
+    for (s32 i = 0; i < count; ++i)
+    {
+        Entry *child = children[i];
+        if (strcmp(child->name, ".") != 0 && strcmp(child->name, "..") != 0)
+        {
+            if (hasAttribute(child, DIRECTORY))
+            {
+                byteCount += readAllFiles(child, buffer);
+            }
+            else if (hasAttribute(child, ARCHIVE))
+            {
+                File *file;
+                if (openFile(&file, child) == 0)
+                {
+                    u32 size;
+                    while ((size = readFile(buffer, BENCH_BUFFER_SIZE, file)) > 0)
+                    {
+                        byteCount += size;
+                    }
+                    closeFile(file);
+                }
+            }
+        }
+        closeEntry(child);
+    }
+
+    free(children);
+    return byteCount;
+}
+
+// 標準出力を捨てる先に切り替え、元のディスクリプタを返す
+s32 suppressStdout()
+{
+    fflush(stdout);
+    s32 savedStdout = dup(STDOUT_FILENO);
+    s32 nullFd = open("/dev/null", O_WRONLY);
+    dup2(nullFd, STDOUT_FILENO);
+    close(nullFd);
+    return savedStdout;
+}
+
+// 標準出力を元に戻す
+void restoreStdout(s32 savedStdout)
+{
+    fflush(stdout);
+    dup2(savedStdout, STDOUT_FILENO);
+    close(savedStdout);
+}
+
+/**
+ * 1つのFATイメージについて計測し、結果を書き出す
+ * 成功したら0、それ以外の場合は0以外を返す
+ */
+Result runBenchmarks(BenchOutput *output, const char *imageFilename, u32 repeatCount)
+{
+    Image *image;
+    Result result = openImage(&image, imageFilename);
+    if (result)
+    {
+        fprintf(stderr, "Failed to open image: %s (%d)\n", imageFilename, result);
+        return 1;
+    }
+
+    Entry *root;
+    if (openEntry(&root, image, "/"))
+    {
+        closeImage(image);
+        return 2;
+    }
+
+    // 計測に使うエントリを探す
+    BenchTargets *targets = calloc(1, sizeof(BenchTargets));
+    char *path = malloc(MAX_BENCH_PATH_SIZE);
+    u8 *buffer = malloc(BENCH_BUFFER_SIZE);
+    if (targets == NULL || path == NULL || buffer == NULL)
+    {
+        free(targets);
+        free(path);
+        free(buffer);
+        closeEntry(root);
+        closeImage(image);
+        return 3;
+    }
+    strcpy(path, "/");
+    findTargets(targets, root, path, 0);
+
+    fprintf(stderr, "%s\n", imageFilename);
+    fprintf(output->fp, "%s\n  {\"image\": ", output->first ? "" : ",");
+    writeJsonString(output->fp, imageFilename);
+    fprintf(output->fp, ", \"fatType\": \"FAT%s\", \"clusterSize\": %u, \"clusterCount\": %u, \"fileCount\": %llu, \"results\": [",
+            image->fatType == FAT12 ? "12" : image->fatType == FAT16 ? "16" : "32",
+            image->clusterSize,
+            image->clusterCount - CLUSTER_START,
+            targets->fileCount);
+    output->first = TRUE;
+
+    // FATイメージを開いて閉じる
+    double start = getSeconds();
+    for (u32 i = 0; i < repeatCount; ++i)
+    {
+        Image *openedImage;
+        if (openImage(&openedImage, imageFilename) == 0)
+        {
+            closeImage(openedImage);
+        }
+    }
+    writeResult(output, "openImage", imageFilename, repeatCount, getSeconds() - start, 0);
+
+    // パスを解決する
+    // 最初の1回はエントリのキャッシュが空の状態で、以降はキャッシュが効いた状態で計測する
+    const char *paths[] = {targets->deepestPath, targets->widestLastChildPath};
+    for (u32 i = 0; i < 2; ++i)
+    {
+        if (paths[i][0] == '\0')
+        {
+            continue;
+        }
+
+        Image *freshImage;
+        if (openImage(&freshImage, imageFilename))
+        {
+            continue;
+        }
+
+        Entry *entry;
+        start = getSeconds();
+        if (openEntry(&entry, freshImage, paths[i]) == 0)
+        {
+            closeEntry(entry);
+        }
+        writeResult(output, "openEntryCold", paths[i], 1, getSeconds() - start, 0);
+
+        start = getSeconds();
+        for (u32 j = 0; j < repeatCount; ++j)
+        {
+            if (openEntry(&entry, freshImage, paths[i]) == 0)
+            {
+                closeEntry(entry);
+            }
+        }
+        writeResult(output, "openEntryWarm", paths[i], repeatCount, getSeconds() - start, 0);
+
+        closeImage(freshImage);
+    }
+
+    // 最も子の多いディレクトリの子エントリを列挙する
+    Entry *widest;
+    if (targets->widestCount > 0 && openEntry(&widest, image, targets->widestPath) == 0)
+    {
+        start = getSeconds();
+        for (u32 i = 0; i < repeatCount; ++i)
+        {
+            Entry **children;
+            s32 count = getChildren(&children, widest);
+            for (s32 j = 0; j < count; ++j)
+            {
+                closeEntry(children[j]);
+            }
+            if (count >= 0)
+            {
+                free(children);
+            }
+        }
+        writeResult(output, "getChildren", targets->widestPath, repeatCount, getSeconds() - start, 0);
+        closeEntry(widest);
+    }
+
+    // ルート以下のtreeを表示する
+    s32 savedStdout = suppressStdout();
+    start = getSeconds();
+    for (u32 i = 0; i < repeatCount; ++i)
+    {
+        printTree(root);
+    }
+    double seconds = getSeconds() - start;
+    restoreStdout(savedStdout);
+    writeResult(output, "printTree", "/", repeatCount, seconds, 0);
+
+    // 最も大きいファイルを読み込む
+    if (targets->largestPath[0] != '\0')
+    {
+        u64 byteCount = 0;
+        start = getSeconds();
+        for (u32 i = 0; i < repeatCount; ++i)
+        {
+            byteCount += readWholeFile(image, targets->largestPath, buffer);
+        }
+        writeResult(output, "readFile", targets->largestPath, repeatCount, getSeconds() - start, byteCount);
+    }
+
+    // すべてのファイルを読み込む
+    start = getSeconds();
+    u64 byteCount = readAllFiles(root, buffer);
+    writeResult(output, "readAllFiles", "/", 1, getSeconds() - start, byteCount);
+
+    fprintf(output->fp, "\n    ]}");
+    output->first = FALSE;
+
+    free(targets);
+    free(path);
+    free(buffer);
+    closeEntry(root);
+    closeImage(image);
+    return 0;
+}
+
+void printUsage(const char *program)
+{
+    fprintf(stderr, "Usage: %s [-r REPEAT] [-o OUTPUT_FILE] IMAGE_FILE...\n", program);
+}
+
+int main(int argc, char **argv)
+{
+    u32 repeatCount = DEFAULT_REPEAT_COUNT;
+    const char *outputFilename = NULL;
+
+    s32 index = 1;
+    for (; index + 1 < argc && argv[index][0] == '-'; index += 2)
+    {
+        switch (argv[index][1])
+        {
+        case 'r':
+            repeatCount = strtoul(argv[index + 1], NULL, 0);
+            break;
+        case 'o':
+            outputFilename = argv[index + 1];
+            break;
+        default:
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+    if (index >= argc || repeatCount == 0)
+    {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    BenchOutput output = {stdout, TRUE};
+    if (outputFilename != NULL)
+    {
+        output.fp = fopen(outputFilename, "w");
+        if (output.fp == NULL)
+        {
+            fprintf(stderr, "Failed to open: %s\n", outputFilename);
+            return 1;
+        }
+    }
+
+    Result result = 0;
+    fprintf(output.fp, "[");
+    for (; index < argc; ++index)
+    {
+        if (runBenchmarks(&output, argv[index], repeatCount))
+        {
+            result = 1;
+        }
+    }
+    fprintf(output.fp, "\n]\n");
+
+    if (output.fp != stdout)
+    {
+        fclose(output.fp);
+    }
+    return result;
+}
@@ -0,0 +1,913 @@
+/**
+ * ベンチマーク用のFAT12/16/32イメージを生成する
+ * データを書き込まないクラスタは穴のまま残すので、大きなイメージも疎なファイルになる
+ *
+ * ビルド:
+ *     cc -O2 -pthread -o mkimage bench/mkimage.c
+ *
+ * 使い方:
+ *     mkimage [-t 12|16|32] [-c CLUSTER_SIZE] [-n CLUSTER_COUNT] [-w WIDE_COUNT] IMAGE_FILE [SHAPE...]
+ *
+ * 形（省略した場合はすべて）:
+ *     deep     /deep 以下に64階層のディレクトリと、最下層のファイル
+ *     wide     /wide に60000個（-wで変更）の空のファイル
+ *     frag     /frag に1クラスタずつ交互に並べた2つのファイルと、同じ大きさの連続したファイル
+ *     deleted  /deleted に、削除済みのスロットを間に挟んだ2000個のファイル
+ *     names    /names に、長い名前の断片の境目に長さが近い名前のファイル
+ */
+
+#define main fatMain
+#include "../fat.c"
+#undef main
+
+// 1セクタあたりのバイト数
+#define SECTOR_SIZE 512
+
+// FATの数
+#define FAT_COUNT 2
+
+// FAT12/16のルートディレクトリの最大エントリ数
+#define ROOT_ENTRY_COUNT 512
+
+// 終端を表すクラスタ番号
+#define END_OF_CHAIN 0x0fffffff
+
+// 形ごとの大きさ
+#define DEEP_DEPTH 64
+#define DEFAULT_WIDE_COUNT 60000
+#define DELETED_FILE_COUNT 2000
+#define DELETED_SLOTS_PER_FILE 16
+#define MAX_FRAGMENTED_FILE_SIZE (16 * 1024 * 1024)
+
+// データを書き込むときのバッファのバイト数
+#define WRITE_BUFFER_SIZE (1024 * 1024)
+
+// 生成中のイメージを表す
+typedef struct __Generator
+{
+    // 書き込み先のディスクリプタ
+    s32 fd;
+
+    // FATのサブタイプ
+    FATType fatType;
+
+    // 1クラスタあたりのバイト数
+    u32 clusterSize;
+
+    // データ領域のクラスタ数
+    u32 clusterCount;
+
+    // 予約領域のセクタ数
+    u32 reservedSectorCount;
+
+    // FAT領域1つ分のセクタ数
+    u32 fatSectorCount;
+
+    // ルートディレクトリ領域のオフセット（FAT12/16）
+    u64 rootOffset;
+
+    // クラスタ番号2のオフセット
+    u64 dataOffset;
+
+    // イメージ全体のセクタ数
+    u32 totalSectorCount;
+
+    // ルートディレクトリのクラスタ番号（FAT32）
+    u32 rootCluster;
+
+    /**
+     * 生成中のFAT
+     * クラスタ番号を添字として次のクラスタ番号を格納する
+     */
+    u32 *fat;
+
+    // 次に割り当てるクラスタ番号
+    u32 nextCluster;
+
+    // 短い名前を一意にするための番号
+    u32 shortNameCount;
+
+    // ファイルの内容に使う乱数の状態
+    u64 random;
+} Generator;
+
+// 生成中のディレクトリを表す
+typedef struct __DirectoryBuilder
+{
+    // 最初のクラスタ番号、FAT12/16のルートディレクトリの場合は0
+    u32 cluster;
+
+    // ディレクトリエントリのバイト列
+    u8 *bytes;
+
+    // バイト列の長さと確保した領域の大きさ
+    u64 size;
+    u64 capacity;
+} DirectoryBuilder;
+
+// 16ビットをリトルエンディアンで書き込む
+void put16(u8 *bytes, u32 offset, u16 value)
+{
+    bytes[offset] = value;
+    bytes[offset + 1] = value >> 8;
+}
+
+// 32ビットをリトルエンディアンで書き込む
+void put32(u8 *bytes, u32 offset, u32 value)
+{
+    put16(bytes, offset, value);
+    put16(bytes, offset + 2, value >> 16);
+}
+
+// 指定された位置にバイト列をすべて書き込む
+Result writeBytes(const Generator *generator, const u8 *bytes, u64 size, u64 offset)
+{
+    u64 writtenSize = 0;
+    while (writtenSize < size)
+    {
+        ssize_t chunkSize = pwrite(generator->fd, bytes + writtenSize, size - writtenSize, offset + writtenSize);
+        if (chunkSize <= 0)
+        {
+            return 1;
+        }
+        writtenSize += chunkSize;
+    }
+    return 0;
+}
+
+// クラスタ番号からオフセットを計算する
+u64 getClusterOffset(const Generator *generator, u32 cluster)
+{
+    return generator->dataOffset + (u64)generator->clusterSize * (cluster - CLUSTER_START);
+}
+
+/**
+ * 連続したクラスタを割り当ててチェーンにする
+ * 成功したら0、空きが足りない場合は0以外を返す
+ */
+Result allocateClusters(u32 *clusterPointer, Generator *generator, u32 count)
+{
+    if (count > generator->clusterCount + CLUSTER_START - generator->nextCluster)
+    {
+        fprintf(stderr, "Image is full; use a larger cluster size or cluster count\n");
+        return 1;
+    }
+
+    u32 cluster = *clusterPointer = generator->nextCluster;
+    for (u32 i = 0; i < count; ++i)
+    {
+        generator->fat[cluster + i] = i + 1 < count ? cluster + i + 1 : END_OF_CHAIN;
+    }
+    generator->nextCluster += count;
+    return 0;
+}
+
+// 乱数のバイト列でバッファを埋める
+void fillRandom(Generator *generator, u8 *bytes, u64 size)
+{
+    for (u64 i = 0; i < size; i += sizeof(u64))
+    {
+        generator->random ^= generator->random << 13;
+        generator->random ^= generator->random >> 7;
+        generator->random ^= generator->random << 17;
+        u64 chunkSize = size - i < sizeof(u64) ? size - i : sizeof(u64);
+        memcpy(bytes + i, &generator->random, chunkSize);
+    }
+}
+
+/**
+ * 指定されたクラスタから始まる連続した領域に、乱数のバイト列を書き込む
+ * 成功したら0、それ以外の場合は0以外を返す
+ */
+Result writeRandom(Generator *generator, u32 cluster, u64 size)
+{
+    u8 *buffer = malloc(WRITE_BUFFER_SIZE);
+    if (buffer == NULL)
+    {
+        return 1;
+    }
+
+    Result result = 0;
+    u64 offset = getClusterOffset(generator, cluster);
+    for (u64 writtenSize = 0; writtenSize < size && result == 0;)
+    {
+        u64 chunkSize = size - writtenSize < WRITE_BUFFER_SIZE ? size - writtenSize : WRITE_BUFFER_SIZE;
+        fillRandom(generator, buffer, chunkSize);
+        result = writeBytes(generator, buffer, chunkSize, offset + writtenSize);
+        writtenSize += chunkSize;
+    }
+
+    free(buffer);
+    return result;
+}
+
+// 短い名前から長い名前のチェックサムを計算する
+u8 getChecksum(const u8 *shortName)
+{
+    u8 checksum = 0;
+    for (u8 i = 0; i < 11; ++i)
+    {
+        checksum = ((checksum & 1) << 7) + (checksum >> 1) + shortName[i];
+    }
+    return checksum;
+}
+
+// ディレクトリエントリを1つ追加する
+Result addRecord(DirectoryBuilder *builder, const u8 *record)
+{
+    if (builder->size + ENTRY_SIZE > builder->capacity)
+    {
+        u64 capacity = builder->capacity == 0 ? 4096 : builder->capacity * 2;
+        u8 *bytes = realloc(builder->bytes, capacity);
+        if (bytes == NULL)
+        {
+            return 1;
+        }
+        builder->bytes = bytes;
+        builder->capacity = capacity;
+    }
+
+    memcpy(builder->bytes + builder->size, record, ENTRY_SIZE);
+    builder->size += ENTRY_SIZE;
+    return 0;
+}
+
+// 短い名前のディレクトリエントリを作る
+void makeRecord(u8 *record, const u8 *shortName, u8 attribute, u32 cluster, u32 size)
+{
+    // 2024/01/01 12:00:00
+    u16 date = (44 << 9) | (1 << 5) | 1;
+    u16 time = 12 << 11;
+
+    memset(record, 0, ENTRY_SIZE);
+    memcpy(record, shortName, 11);
+    record[11] = attribute;
+    put16(record, 14, time);
+    put16(record, 16, date);
+    put16(record, 18, date);
+    put16(record, 20, cluster >> 16);
+    put16(record, 22, time);
+    put16(record, 24, date);
+    put16(record, 26, cluster);
+    put32(record, 28, size);
+}
+
+/**
+ * ASCIIの名前のエントリを、長い名前の断片とともに追加する
+ * 短い名前は番号から一意に作る
+ * 成功したら0、それ以外の場合は0以外を返す
+ */
+Result addEntry(Generator *generator, DirectoryBuilder *builder, const char *name, u8 attribute, u32 cluster, u32 size)
+{
+    u8 shortName[12];
+    snprintf((char *)shortName, sizeof(shortName), "~%07X%s", ++generator->shortNameCount, attribute & DIRECTORY ? "   " : "DAT");
+    u8 checksum = getChecksum(shortName);
+
+    // 断片は最後のものから順に並べる
+    // 長さが断片の文字数のちょうど倍数の名前には、終端の0を含む断片を付けない
+    u32 length = strlen(name);
+    u32 fragmentCount = length == 0 ? 1 : (length + LONG_NAME_LENGTH_PER_ENTRY - 1) / LONG_NAME_LENGTH_PER_ENTRY;
+    for (u32 i = fragmentCount; i > 0; --i)
+    {
+        u8 record[ENTRY_SIZE];
+        memset(record, 0, ENTRY_SIZE);
+        record[0] = i | (i == fragmentCount ? FIRST_ENTRY_OF_LONG_NAME : 0);
+        record[11] = LONG_NAME;
+        record[13] = checksum;
+
+        static const u8 offsets[LONG_NAME_LENGTH_PER_ENTRY] = {1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30};
+        for (u32 j = 0; j < LONG_NAME_LENGTH_PER_ENTRY; ++j)
+        {
+            u32 index = (i - 1) * LONG_NAME_LENGTH_PER_ENTRY + j;
+            u16 unit = index < length ? (u8)name[index] : index == length ? 0 : 0xffff;
+            put16(record, offsets[j], unit);
+        }
+
+        if (addRecord(builder, record))
+        {
+            return 1;
+        }
+    }
+
+    u8 record[ENTRY_SIZE];
+    makeRecord(record, shortName, attribute, cluster, size);
+    return addRecord(builder, record);
+}
+
+// 削除済みのファイルのスロットを、長い名前の断片と短い名前の組で追加する
+Result addDeletedSlots(DirectoryBuilder *builder, u32 count)
+{
+    for (u32 i = 0; i < count; ++i)
+    {
+        u8 record[ENTRY_SIZE];
+        if (i % 2 == 0)
+        {
+            memset(record, 0, ENTRY_SIZE);
+            record[11] = LONG_NAME;
+        }
+        else
+        {
+            makeRecord(record, (const u8 *)"~DELETEDDAT", ARCHIVE, 0, 0);
+        }
+        record[0] = DELETED;
+
+        if (addRecord(builder, record))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * サブディレクトリの生成を始める
+ * 最初のクラスタを割り当て、自身と親を指すエントリを追加する
+ */
+Result beginDirectory(DirectoryBuilder *builder, Generator *generator, u32 parentCluster)
+{
+    memset(builder, 0, sizeof(DirectoryBuilder));
+    if (allocateClusters(&builder->cluster, generator, 1))
+    {
+        return 1;
+    }
+
+    u8 record[ENTRY_SIZE];
+    makeRecord(record, (const u8 *)".          ", DIRECTORY, builder->cluster, 0);
+    if (addRecord(builder, record))
+    {
+        return 2;
+    }
+    makeRecord(record, (const u8 *)"..         ", DIRECTORY, parentCluster, 0);
+    return addRecord(builder, record) ? 3 : 0;
+}
+
+/**
+ * 生成したディレクトリを書き込む
+ * 最初のクラスタに収まらない分は、続けて割り当てたクラスタに書き込む
+ */
+Result finishDirectory(DirectoryBuilder *builder, Generator *generator)
+{
+    Result result = 0;
+    if (builder->cluster == 0)
+    {
+        // FAT12/16のルートディレクトリは固定の領域に書き込む
+        if (builder->size > ROOT_ENTRY_COUNT * ENTRY_SIZE)
+        {
+            result = 1;
+        }
+        else
+        {
+            result = writeBytes(generator, builder->bytes, builder->size, generator->rootOffset);
+        }
+    }
+    else
+    {
+        u64 firstSize = builder->size < generator->clusterSize ? builder->size : generator->clusterSize;
+        result = writeBytes(generator, builder->bytes, firstSize, getClusterOffset(generator, builder->cluster));
+
+        u64 restSize = builder->size - firstSize;
+        if (result == 0 && restSize > 0)
+        {
+            u32 cluster;
+            result = allocateClusters(&cluster, generator, (restSize + generator->clusterSize - 1) / generator->clusterSize);
+            if (result == 0)
+            {
+                generator->fat[builder->cluster] = cluster;
+                result = writeBytes(generator, builder->bytes + firstSize, restSize, getClusterOffset(generator, cluster));
+            }
+        }
+    }
+
+    free(builder->bytes);
+    builder->bytes = NULL;
+    return result;
+}
+
+// 指定された深さから最下層までのディレクトリを生成し、最初のクラスタ番号を設定する
+Result generateDeepDirectory(u32 *clusterPointer, Generator *generator, u32 parentCluster, u32 depth)
+{
+    DirectoryBuilder builder;
+    if (beginDirectory(&builder, generator, parentCluster))
+    {
+        return 1;
+    }
+    *clusterPointer = builder.cluster;
+
+    Result result;
+    if (depth < DEEP_DEPTH)
+    {
+        char name[16];
+        snprintf(name, sizeof(name), "d%02u", depth + 1);
+        u32 cluster;
+        result = generateDeepDirectory(&cluster, generator, builder.cluster, depth + 1);
+        if (result == 0)
+        {
+            result = addEntry(generator, &builder, name, DIRECTORY, cluster, 0);
+        }
+    }
+    else
+    {
+        u32 cluster;
+        result = allocateClusters(&cluster, generator, 1);
+        if (result == 0)
+        {
+            result = writeRandom(generator, cluster, generator->clusterSize);
+        }
+        if (result == 0)
+        {
+            result = addEntry(generator, &builder, "leaf.bin", ARCHIVE, cluster, generator->clusterSize);
+        }
+    }
+
+    if (result)
+    {
+        free(builder.bytes);
+        return result;
+    }
+    return finishDirectory(&builder, generator);
+}
+
+// /wide に指定された数の空のファイルを生成する
+Result generateWideDirectory(u32 *clusterPointer, Generator *generator, u32 count)
+{
+    DirectoryBuilder builder;
+    if (beginDirectory(&builder, generator, 0))
+    {
+        return 1;
+    }
+    *clusterPointer = builder.cluster;
+
+    for (u32 i = 0; i < count; ++i)
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "entry_%05u.txt", i);
+        if (addEntry(generator, &builder, name, ARCHIVE, 0, 0))
+        {
+            free(builder.bytes);
+            return 2;
+        }
+    }
+    return finishDirectory(&builder, generator);
+}
+
+// /deleted に、削除済みのスロットを間に挟んだファイルを生成する
+Result generateDeletedDirectory(u32 *clusterPointer, Generator *generator)
+{
+    DirectoryBuilder builder;
+    if (beginDirectory(&builder, generator, 0))
+    {
+        return 1;
+    }
+    *clusterPointer = builder.cluster;
+
+    for (u32 i = 0; i < DELETED_FILE_COUNT; ++i)
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "file_%04u.txt", i);
+        if (addDeletedSlots(&builder, DELETED_SLOTS_PER_FILE) || addEntry(generator, &builder, name, ARCHIVE, 0, 0))
+        {
+            free(builder.bytes);
+            return 2;
+        }
+    }
+    return finishDirectory(&builder, generator);
+}
+
+/**
+ * /names に、長い名前の断片の境目に長さが近い名前のファイルを生成する
+ * 長い名前の後に短い名前を並べ、前の名前の残りが混ざらないことを確かめられるようにする
+ */
+Result generateNamesDirectory(u32 *clusterPointer, Generator *generator)
+{
+    DirectoryBuilder builder;
+    if (beginDirectory(&builder, generator, 0))
+    {
+        return 1;
+    }
+    *clusterPointer = builder.cluster;
+
+    static const char *names[] = {
+        "abcdefghijklmnopqrstuvwxyz",
+        "ABCDEFGHIJKLM",
+        "abcdefghijklmnopqrstuvwxyz0",
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZ",
+        "abcdefghijkl",
+        "ABCDEFGHIJKLMN",
+    };
+    for (u32 i = 0; i < sizeof(names) / sizeof(names[0]); ++i)
+    {
+        if (addEntry(generator, &builder, names[i], ARCHIVE, 0, 0))
+        {
+            free(builder.bytes);
+            return 2;
+        }
+    }
+    return finishDirectory(&builder, generator);
+}
+
+/**
+ * /frag に1クラスタずつ交互に並べた2つのファイルと、同じ大きさの連続したファイルを生成する
+ * ファイルの大きさはデータ領域の1/8か16MiBの小さい方にする
+ */
+Result generateFragmentedDirectory(u32 *clusterPointer, Generator *generator)
+{
+    DirectoryBuilder builder;
+    if (beginDirectory(&builder, generator, 0))
+    {
+        return 1;
+    }
+    *clusterPointer = builder.cluster;
+
+    u64 size = (u64)generator->clusterSize * generator->clusterCount / 8;
+    if (size > MAX_FRAGMENTED_FILE_SIZE)
+    {
+        size = MAX_FRAGMENTED_FILE_SIZE;
+    }
+    u32 clusterCount = size / generator->clusterSize;
+    if (clusterCount == 0)
+    {
+        clusterCount = 1;
+    }
+    size = (u64)clusterCount * generator->clusterSize;
+
+    // 2つのファイルに、連続したクラスタを交互に割り当てる
+    u32 cluster;
+    Result result = allocateClusters(&cluster, generator, clusterCount * 2);
+    for (u32 i = 0; i < clusterCount * 2 && result == 0; ++i)
+    {
+        generator->fat[cluster + i] = i + 2 < clusterCount * 2 ? cluster + i + 2 : END_OF_CHAIN;
+        result = writeRandom(generator, cluster + i, generator->clusterSize);
+    }
+    if (result == 0)
+    {
+        result = addEntry(generator, &builder, "interleaved_a.bin", ARCHIVE, cluster, size) ||
+                 addEntry(generator, &builder, "interleaved_b.bin", ARCHIVE, cluster + 1, size);
+    }
+
+    u32 contiguousCluster;
+    if (result == 0)
+    {
+        result = allocateClusters(&contiguousCluster, generator, clusterCount);
+    }
+    if (result == 0)
+    {
+        result = writeRandom(generator, contiguousCluster, size);
+    }
+    if (result == 0)
+    {
+        result = addEntry(generator, &builder, "contiguous.bin", ARCHIVE, contiguousCluster, size);
+    }
+
+    if (result)
+    {
+        free(builder.bytes);
+        return result;
+    }
+    return finishDirectory(&builder, generator);
+}
+
+/**
+ * 生成したFATを、サブタイプに合わせた形式ですべてのFAT領域に書き込む
+ * 成功したら0、それ以外の場合は0以外を返す
+ */
+Result writeFat(const Generator *generator)
+{
+    u64 size = (u64)generator->fatSectorCount * SECTOR_SIZE;
+    u8 *bytes = calloc(size, 1);
+    if (bytes == NULL)
+    {
+        return 1;
+    }
+
+    for (u32 i = 0; i < generator->clusterCount + CLUSTER_START; ++i)
+    {
+        u32 value = generator->fat[i];
+        switch (generator->fatType)
+        {
+        case FAT12:
+            value &= 0xfff;
+            if (i % 2 == 0)
+            {
+                bytes[i * 3 / 2] = value;
+                bytes[i * 3 / 2 + 1] = (bytes[i * 3 / 2 + 1] & 0xf0) | (value >> 8);
+            }
+            else
+            {
+                bytes[i * 3 / 2] = (bytes[i * 3 / 2] & 0x0f) | (value << 4);
+                bytes[i * 3 / 2 + 1] = value >> 4;
+            }
+            break;
+        case FAT16:
+            put16(bytes, i * 2, value);
+            break;
+        default:
+            put32(bytes, i * 4, value);
+            break;
+        }
+    }
+
+    Result result = 0;
+    for (u32 i = 0; i < FAT_COUNT && result == 0; ++i)
+    {
+        u64 offset = ((u64)generator->reservedSectorCount + (u64)generator->fatSectorCount * i) * SECTOR_SIZE;
+        result = writeBytes(generator, bytes, size, offset);
+    }
+
+    free(bytes);
+    return result;
+}
+
+/**
+ * ブートセクタを書き込む
+ * FAT32の場合は、FSInfoとブートセクタのバックアップも書き込む
+ */
+Result writeBootSector(const Generator *generator)
+{
+    u8 bytes[SECTOR_SIZE];
+    memset(bytes, 0, sizeof(bytes));
+    memcpy(bytes, "\xeb\x58\x90MSWIN4.1", 11);
+    put16(bytes, 11, SECTOR_SIZE);
+    bytes[13] = generator->clusterSize / SECTOR_SIZE;
+    put16(bytes, 14, generator->reservedSectorCount);
+    bytes[16] = FAT_COUNT;
+    put16(bytes, 17, generator->fatType == FAT32 ? 0 : ROOT_ENTRY_COUNT);
+    if (generator->totalSectorCount < 0x10000)
+    {
+        put16(bytes, 19, generator->totalSectorCount);
+    }
+    else
+    {
+        put32(bytes, 32, generator->totalSectorCount);
+    }
+    bytes[21] = 0xf8;
+    put16(bytes, 24, 63);
+    put16(bytes, 26, 255);
+
+    if (generator->fatType == FAT32)
+    {
+        put32(bytes, 36, generator->fatSectorCount);
+        put32(bytes, 44, generator->rootCluster);
+        put16(bytes, 48, 1);
+        put16(bytes, 50, 6);
+        bytes[66] = 0x29;
+        memcpy(bytes + 71, "BENCH      FAT32   ", 19);
+    }
+    else
+    {
+        put16(bytes, 22, generator->fatSectorCount);
+        bytes[38] = 0x29;
+        memcpy(bytes + 43, generator->fatType == FAT12 ? "BENCH      FAT12   " : "BENCH      FAT16   ", 19);
+    }
+    bytes[510] = 0x55;
+    bytes[511] = 0xaa;
+
+    if (writeBytes(generator, bytes, SECTOR_SIZE, 0))
+    {
+        return 1;
+    }
+    if (generator->fatType != FAT32)
+    {
+        return 0;
+    }
+
+    u8 info[SECTOR_SIZE];
+    memset(info, 0, sizeof(info));
+    put32(info, 0, 0x41615252);
+    put32(info, 484, 0x61417272);
+    put32(info, 488, generator->clusterCount + CLUSTER_START - generator->nextCluster);
+    put32(info, 492, generator->nextCluster);
+    info[510] = 0x55;
+    info[511] = 0xaa;
+
+    if (writeBytes(generator, info, SECTOR_SIZE, SECTOR_SIZE) ||
+        writeBytes(generator, bytes, SECTOR_SIZE, 6 * SECTOR_SIZE) ||
+        writeBytes(generator, info, SECTOR_SIZE, 7 * SECTOR_SIZE))
+    {
+        return 2;
+    }
+    return 0;
+}
+
+/**
+ * FATのサブタイプとクラスタ数から、領域の配置を決める
+ * サブタイプとクラスタ数が合わない場合は0以外を返す
+ */
+Result layoutImage(Generator *generator)
+{
+    u32 count = generator->clusterCount;
+    u64 fatSize;
+    switch (generator->fatType)
+    {
+    case FAT12:
+        if (count >= FAT12_16_BORDER - 1)
+        {
+            return 1;
+        }
+        fatSize = ((u64)count + CLUSTER_START) * 3 / 2 + 1;
+        break;
+    case FAT16:
+        if (count < FAT12_16_BORDER || count >= FAT16_32_BORDER - 1)
+        {
+            return 1;
+        }
+        fatSize = ((u64)count + CLUSTER_START) * 2;
+        break;
+    default:
+        if (count < FAT16_32_BORDER)
+        {
+            return 1;
+        }
+        fatSize = ((u64)count + CLUSTER_START) * 4;
+        break;
+    }
+
+    generator->reservedSectorCount = generator->fatType == FAT32 ? 32 : 1;
+    generator->fatSectorCount = (fatSize + SECTOR_SIZE - 1) / SECTOR_SIZE;
+
+    u32 rootSectorCount = generator->fatType == FAT32 ? 0 : ROOT_ENTRY_COUNT * ENTRY_SIZE / SECTOR_SIZE;
+    u32 dataSector = generator->reservedSectorCount + generator->fatSectorCount * FAT_COUNT;
+    generator->rootOffset = (u64)dataSector * SECTOR_SIZE;
+    dataSector += rootSectorCount;
+    generator->dataOffset = (u64)dataSector * SECTOR_SIZE;
+
+    u64 totalSectorCount = dataSector + (u64)count * (generator->clusterSize / SECTOR_SIZE);
+    if (totalSectorCount > 0xffffffff)
+    {
+        return 2;
+    }
+    generator->totalSectorCount = totalSectorCount;
+    return 0;
+}
+
+void printUsage(const char *program)
+{
+    fprintf(stderr, "Usage: %s [-t 12|16|32] [-c CLUSTER_SIZE] [-n CLUSTER_COUNT] [-w WIDE_COUNT] IMAGE_FILE [deep|wide|frag|deleted|names...]\n", program);
+}
+
+int main(int argc, char **argv)
+{
+    Generator generator;
+    memset(&generator, 0, sizeof(generator));
+    generator.fatType = FAT32;
+    generator.clusterSize = 4096;
+    generator.random = 0x9e3779b97f4a7c15ULL;
+
+    u32 wideCount = DEFAULT_WIDE_COUNT;
+    s32 index = 1;
+    for (; index + 1 < argc && argv[index][0] == '-'; index += 2)
+    {
+        u32 value = strtoul(argv[index + 1], NULL, 0);
+        switch (argv[index][1])
+        {
+        case 't':
+            generator.fatType = value == 12 ? FAT12 : value == 16 ? FAT16 : FAT32;
+            break;
+        case 'c':
+            generator.clusterSize = value;
+            break;
+        case 'n':
+            generator.clusterCount = value;
+            break;
+        case 'w':
+            wideCount = value;
+            break;
+        default:
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+    if (index >= argc)
+    {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    u32 sectorPerCluster = generator.clusterSize / SECTOR_SIZE;
+    if (generator.clusterSize % SECTOR_SIZE != 0 || sectorPerCluster == 0 || sectorPerCluster > 128 ||
+        (sectorPerCluster & (sectorPerCluster - 1)) != 0)
+    {
+        fprintf(stderr, "Cluster size must be a power of two from 512 to 65536\n");
+        return 1;
+    }
+
+    // クラスタ数を指定しない場合は、サブタイプごとの既定の数にする
+    if (generator.clusterCount == 0)
+    {
+        generator.clusterCount = generator.fatType == FAT12 ? 4000 : generator.fatType == FAT16 ? 60000 : 70000;
+    }
+    if (layoutImage(&generator))
+    {
+        fprintf(stderr, "Cluster count %u does not fit the FAT type\n", generator.clusterCount);
+        return 1;
+    }
+
+    const char *path = argv[index++];
+    generator.fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (generator.fd < 0)
+    {
+        fprintf(stderr, "Failed to open: %s\n", path);
+        return 1;
+    }
+
+    // 書き込まない領域は穴のまま残す
+    Result result = ftruncate(generator.fd, (u64)generator.totalSectorCount * SECTOR_SIZE);
+
+    generator.fat = calloc(generator.clusterCount + CLUSTER_START, sizeof(u32));
+    if (generator.fat == NULL)
+    {
+        result = 2;
+    }
+    else
+    {
+        generator.fat[0] = 0x0ffffff8;
+        generator.fat[1] = END_OF_CHAIN;
+        generator.nextCluster = CLUSTER_START;
+    }
+
+    DirectoryBuilder root;
+    memset(&root, 0, sizeof(root));
+    if (result == 0 && generator.fatType == FAT32)
+    {
+        result = allocateClusters(&generator.rootCluster, &generator, 1);
+        root.cluster = generator.rootCluster;
+    }
+
+    static const char *shapes[] = {"deep", "wide", "frag", "deleted", "names"};
+    for (u32 i = 0; i < 5 && result == 0; ++i)
+    {
+        // 形を指定した場合は、指定された形だけを生成する
+        Boolean selected = index >= argc;
+        for (s32 j = index; j < argc; ++j)
+        {
+            selected |= strcmp(argv[j], shapes[i]) == 0;
+        }
+        if (!selected)
+        {
+            continue;
+        }
+
+        u32 cluster;
+        switch (i)
+        {
+        case 0:
+            result = generateDeepDirectory(&cluster, &generator, 0, 0);
+            break;
+        case 1:
+            result = generateWideDirectory(&cluster, &generator, wideCount);
+            break;
+        case 2:
+            result = generateFragmentedDirectory(&cluster, &generator);
+            break;
+        case 3:
+            result = generateDeletedDirectory(&cluster, &generator);
+            break;
+        default:
+            result = generateNamesDirectory(&cluster, &generator);
+            break;
+        }
+
+        if (result == 0)
+        {
+            result = addEntry(&generator, &root, shapes[i], DIRECTORY, cluster, 0);
+        }
+    }
+
+    if (result == 0)
+    {
+        result = finishDirectory(&root, &generator);
+    }
+    else
+    {
+        free(root.bytes);
+    }
+
+    if (result == 0)
+    {
+        result = writeFat(&generator);
+    }
+    if (result == 0)
+    {
+        result = writeBootSector(&generator);
+    }
+
+    free(generator.fat);
+    if (close(generator.fd) != 0 && result == 0)
+    {
+        result = 3;
+    }
+
+    if (result)
+    {
+        fprintf(stderr, "Failed to generate: %s (%d)\n", path, result);
+        unlink(path);
+        return 1;
+    }
+
+    printf("%s: FAT%s, %u clusters of %u bytes, %u used\n",
+           path,
+           generator.fatType == FAT12 ? "12" : generator.fatType == FAT16 ? "16" : "32",
+           generator.clusterCount,
+           generator.clusterSize,
+           generator.nextCluster - CLUSTER_START);
+    return 0;
+}
@@ -0,0 +1,35 @@
+#!/bin/sh
+# ベンチマーク用のイメージを生成し、すべてのイメージで計測した結果をJSONで書き出す
+#
+# 使い方:
+#     bench/run_bench.sh [OUTPUT_FILE]
+#
+# 環境変数:
+#     CC         コンパイラ（既定はcc）
+#     BENCH_DIR  イメージと実行ファイルを置くディレクトリ（既定はbench-images）
+#     REPEAT     計測の繰り返し回数（既定は10）
+set -e
+
+OUTPUT=${1:-bench-results.json}
+DIR=${BENCH_DIR:-bench-images}
+CC=${CC:-cc}
+ROOT=$(dirname "$0")
+
+mkdir -p "$DIR"
+$CC -O2 -pthread -o "$DIR/mkimage" "$ROOT/mkimage.c"
+$CC -O2 -pthread -o "$DIR/fat_bench" "$ROOT/fat_bench.c"
+
+# FATのサブタイプと、小さいクラスタと大きいクラスタの組み合わせ
+# 生成済みのイメージは再利用する
+IMAGES=""
+for SPEC in "12 4096" "16 512" "16 32768" "32 512" "32 32768"; do
+    set -- $SPEC
+    IMAGE="$DIR/fat$1-$2.img"
+    if [ ! -f "$IMAGE" ]; then
+        "$DIR/mkimage" -t "$1" -c "$2" "$IMAGE"
+    fi
+    IMAGES="$IMAGES $IMAGE"
+done
+
+"$DIR/fat_bench" -r "${REPEAT:-10}" -o "$OUTPUT" $IMAGES
+echo "Results: $OUTPUT"
@@ -1,8 +1,57 @@
-#include <malloc.h>
+#ifdef __linux__
+// splice、copy_file_rangeなどを使えるようにする
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <wchar.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// SSSE3を指定してコンパイルしていなくても、関数ごとに有効にして実行時に選ぶ
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <tmmintrin.h>
+#define HAS_SSSE3
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#define HAS_POSIX_IO
+#endif
+
+// macOSにはposix_fallocateがない
+#if defined(HAS_POSIX_IO) && !defined(__APPLE__)
+#define HAS_FALLOCATE
+#endif
+
+#ifdef __linux__
+#include <sys/sendfile.h>
+#define HAS_KERNEL_COPY
+#endif
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define HAS_IO_URING
+#endif
+#endif
+#endif
+
+// 共有ライブラリとしてビルドする場合は、公開する関数を書き出す
+#define FAT_BUILDING
+#include "fat.h"
 
 #pragma region Constants
 #define TRUE 1
@@ -18,7 +67,54 @@
 #define FAT16_CLUSTER_END 0xFFF6
 #define FAT32_CLUSTER_END 0x0FFFFFF6
 
-#define MAX_NAME_LENGTH 256
+// 長い名前の断片の最大数と、1つの断片に含まれるUTF-16の文字数
+#define MAX_LONG_NAME_ENTRY_COUNT 20
+#define LONG_NAME_LENGTH_PER_ENTRY 13
+
+// 名前のUTF-16での最大の長さと、UTF-8で格納するバイト数
+#define MAX_NAME_LENGTH (MAX_LONG_NAME_ENTRY_COUNT * LONG_NAME_LENGTH_PER_ENTRY)
+#define MAX_NAME_SIZE (MAX_NAME_LENGTH * 3 + 1)
+
+// FATを展開したテーブルに使うメモリの既定の上限
+#define DEFAULT_FAT_TABLE_LIMIT (64 * 1024 * 1024)
+
+// アリーナのブロックのバイト数
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+// 連続した読み込みで先読みする範囲の最初と既定の上限のバイト数
+#define MIN_READ_AHEAD_SIZE (128 * 1024)
+#define DEFAULT_MAX_READ_AHEAD_SIZE (8 * 1024 * 1024)
+
+// 先読みで1つにまとめるクラスタの並びの間隔のバイト数
+#define READ_AHEAD_MERGE_GAP (64 * 1024)
+
+// カーネルの中でコピーできない場合に、書き出しに使うバッファのバイト数
+#define COPY_BUFFER_SIZE (64 * 1024)
+
+// 読み込みのキューで同時に読み込ませる既定の断片の数
+#define DEFAULT_READ_QUEUE_DEPTH 32
+
+// マッピングしていないFATイメージの読み込みに使うブロックのキャッシュの既定のバイト数
+#define DEFAULT_BLOCK_CACHE_SIZE (4 * 1024 * 1024)
+
+// FATの走査で一度に読み込むエントリ数と、スレッドに分けて走査するエントリ数の下限
+#define FAT_SCAN_CHUNK_COUNT (64 * 1024)
+#define FAT_SCAN_PARALLEL_COUNT (4 * 1024 * 1024)
+
+// FSInfoの署名と、空きクラスタ数などが不明であることを表す値
+#define FSINFO_LEAD_SIGNATURE 0x41615252
+#define FSINFO_STRUCT_SIGNATURE 0x61417272
+#define FSINFO_TRAIL_SIGNATURE 0xaa550000
+#define FSINFO_UNKNOWN 0xffffffff
+
+// エントリのキャッシュに保持する既定のエントリ数
+#define DEFAULT_DENTRY_CACHE_CAPACITY 4096
+
+// カタログに含まれないエントリの番号
+#define NO_CATALOG_INDEX 0xffffffff
+
+// headとtailで表示する既定のバイト数
+#define DEFAULT_PEEK_SIZE 512
 
 // エントリの先頭のバイト
 #define SKIPPED 0
@@ -27,16 +123,16 @@
 #define FIRST_ENTRY_OF_LONG_NAME 0x40
 
 // 属性ビット
-#define READ_ONLY 0x01
-#define HIDDEN 0x02
-#define SYSTEM 0x04
-#define VOLUME_ID 0x08
-#define DIRECTORY 0x10
-#define ARCHIVE 0x20
+#define READ_ONLY FAT_READ_ONLY
+#define HIDDEN FAT_HIDDEN
+#define SYSTEM FAT_SYSTEM
+#define VOLUME_ID FAT_VOLUME_ID
+#define DIRECTORY FAT_DIRECTORY
+#define ARCHIVE FAT_ARCHIVE
 #define LONG_NAME 0x0f
 
 // パスの区切り文字
-#define PATH_DELIMITER L"/"
+#define PATH_DELIMITER "/"
 #pragma endregion
 
 #pragma region Integer types
@@ -67,127 +163,95 @@ typedef unsigned long long u64;
 
 #pragma region Alias types
 // ブール値
-typedef int Boolean;
+typedef FatBoolean Boolean;
 
 // 処理の結果
-typedef int Result;
+typedef FatResult Result;
 #pragma endregion
 
 #pragma region String utilities
-/**
- * char[]をwchar_t[]に変換する
- * 変換後の文字列の長さを返す
- */
-s32 toWide(wchar_t **dist, const char *src)
-{
-    *dist = NULL;
-
-    // 必要なバッファサイズを計算する
-    s32 bufferSize = mbstowcs(NULL, src, 0);
-    if (bufferSize < 0)
-    {
-        return -1;
-    }
-
-    // バッファを確保する
-    *dist = malloc((bufferSize + 1) * sizeof(wchar_t));
-    if (*dist == NULL)
-    {
-        return -2;
-    }
-
-    // 変換する
-    s32 size = mbstowcs(*dist, src, bufferSize + 1);
-    if (size < 0)
-    {
-        free(*dist);
-        return -3;
-    }
-
-    (*dist)[bufferSize] = '\0';
-
-    return size;
-}
-
 /**
  * 文字列をコピーする
  * 成功したら0、それ以外の場合は0以外を返す
  */
-Result coptString(wchar_t **copyPointer, const wchar_t *base)
+Result coptString(char **copyPointer, const char *base)
 {
-    s32 length = wcslen(base);
-    wchar_t *copy = *copyPointer = calloc((length + 1), sizeof(wchar_t));
+    size_t size = strlen(base) + 1;
+    char *copy = *copyPointer = malloc(size);
     if (copy == NULL)
     {
-        return 1;
+        return FAT_ERROR_NO_MEMORY;
     }
-    wcscpy(copy, base);
+    memcpy(copy, base, size);
     return 0;
 }
 
 /**
- * 文字列を実際の長さに切り詰める
- * 切り詰めた後の文字列の長さを返す
+ * コードポイントをUTF-8で書き込む
+ * 書き込んだバイト数を返す
  */
-s32 shortenString(wchar_t **string)
+u32 encodeUtf8(char *string, u32 codePoint)
 {
-    s32 length = wcslen(*string);
-    wchar_t *newString = realloc(*string, (length + 1) * sizeof(wchar_t));
-    if (newString == NULL)
+    u8 *bytes = (u8 *)string;
+    if (codePoint < 0x80)
     {
-        return -1;
+        bytes[0] = codePoint;
+        return 1;
     }
-    *string = newString;
-    return length;
-}
-
-// 文字列の順番を反転する
-void reverseString(wchar_t *string, s32 length)
-{
-    for (s32 i = 0, j = length - 1; i < j; ++i, --j)
+    if (codePoint < 0x800)
     {
-        // 文字を交換する
-        wchar_t temp = string[i];
-        string[i] = string[j];
-        string[j] = temp;
+        bytes[0] = 0xc0 | (codePoint >> 6);
+        bytes[1] = 0x80 | (codePoint & 0x3f);
+        return 2;
     }
-}
-
-// 文字列から末尾の空白を除外する
-void trimEnd(wchar_t *string, s32 length)
-{
-    if (length <= 0)
+    if (codePoint < 0x10000)
     {
-        return;
+        bytes[0] = 0xe0 | (codePoint >> 12);
+        bytes[1] = 0x80 | ((codePoint >> 6) & 0x3f);
+        bytes[2] = 0x80 | (codePoint & 0x3f);
+        return 3;
     }
+    bytes[0] = 0xf0 | (codePoint >> 18);
+    bytes[1] = 0x80 | ((codePoint >> 12) & 0x3f);
+    bytes[2] = 0x80 | ((codePoint >> 6) & 0x3f);
+    bytes[3] = 0x80 | (codePoint & 0x3f);
+    return 4;
+}
 
-    // 末尾から空白と空白以外の文字の境目を探す
-    s32 index = length - 1;
-    for (; index >= 0; --index)
+/**
+ * パスを区切り文字で分割し、次の部分を返す
+ * 最初の呼び出しではパスを、以降はNULLを渡す
+ * 部分がなくなったらNULLを返す
+ */
+char *splitPath(char *path, char **savePointer)
+{
+    char *string = path != NULL ? path : *savePointer;
+    string += strspn(string, PATH_DELIMITER);
+    if (*string == '\0')
     {
-        if (string[index] != ' ')
-        {
-            break;
-        }
+        *savePointer = string;
+        return NULL;
     }
 
-    // 境目以降の空白を切り捨てる
-    if (index + 1 < length)
+    char *end = string + strcspn(string, PATH_DELIMITER);
+    if (*end != '\0')
     {
-        string[index + 1] = '\0';
+        *end++ = '\0';
     }
+    *savePointer = end;
+    return string;
 }
 
 // 指定された文字列が、指定された接頭辞で始まるかどうかを判定する
-Boolean startsWith(const wchar_t *string, const wchar_t *prefix)
+Boolean startsWith(const char *string, const char *prefix)
 {
-    return wcsncmp(string, prefix, wcslen(prefix)) == 0;
+    return strncmp(string, prefix, strlen(prefix)) == 0;
 }
 
 // ファイル名を表す文字列から拡張子を除いたファイル名と拡張子を取り出す
-void getBasenameAndExtension(const wchar_t *string, wchar_t *basename, wchar_t *extension)
+void getBasenameAndExtension(const char *string, char *basename, char *extension)
 {
-    s32 length = wcslen(string);
+    s32 length = strlen(string);
     s32 index = length - 1;
 
     // 末尾からドットを探す
@@ -200,12 +264,14 @@ void getBasenameAndExtension(const wchar_t *string, wchar_t *basename, wchar_t *
     }
 
     // ファイル名から拡張子を除いた部分をコピーする
-    wcsncpy(basename, string, index);
+    if (index > 0)
+    {
+        memcpy(basename, string, index);
+    }
     basename[index < 0 ? 0 : index] = '\0';
 
     // 拡張子の部分をコピーする
-    wcscpy(extension, string + index + 1);
-    extension[length - index - 1] = '\0';
+    strcpy(extension, string + index + 1);
 }
 #pragma endregion
 
@@ -235,18 +301,9 @@ typedef struct __Datetime
     u16 millisecond;
 } Datetime;
 
-/**
- * 日時を表す整数でDatetimeを作成する
- * 成功したら0、それ以外の場合は0以外を返す
- */
-Result createDatetime(Datetime **datetimePointer, u16 date, u16 time, u8 tenth)
+// 日時を表す整数でDatetimeを初期化する
+void initDatetime(Datetime *datetime, u16 date, u16 time, u8 tenth)
 {
-    Datetime *datetime = *datetimePointer = malloc(sizeof(Datetime));
-    if (datetime == NULL)
-    {
-        return 1;
-    }
-
     datetime->year = ((date & 0xfe00) >> 9) + 1980;
     datetime->month = (date & 0x1e0) >> 5;
     datetime->dayOfMonth = date & 0x1f;
@@ -254,32 +311,168 @@ Result createDatetime(Datetime **datetimePointer, u16 date, u16 time, u8 tenth)
     datetime->minute = (time & 0x7e0) >> 5;
     datetime->second = (time & 0x1f) << 1 + tenth / 100;
     datetime->millisecond = tenth * 100 % 10000;
+}
 
-    return 0;
+#pragma endregion
+
+#pragma region Arena
+typedef struct __ArenaBlock ArenaBlock;
+
+// アリーナから切り出す領域のブロック
+typedef struct __ArenaBlock
+{
+    // 次のブロック
+    ArenaBlock *next;
+
+    // ブロックのうち、切り出せる領域のバイト数
+    u64 size;
+
+    // 切り出し済みのバイト数
+    u64 used;
+} ArenaBlock;
+
+/**
+ * まとめて解放される小さな領域を切り出すアリーナ
+ * 参照がすべてなくなったときに、すべてのブロックを一度に解放する
+ */
+typedef struct __Arena
+{
+    // 最後に確保したブロック
+    ArenaBlock *block;
+
+    // アリーナを参照している数
+    u32 referenceCount;
+} Arena;
+
+// ブロックの切り出せる領域の先頭
+u8 *getArenaBlockData(ArenaBlock *block)
+{
+    return (u8 *)(block + 1);
 }
 
 /**
- * Datetimeをコピーする
+ * アリーナを作成する
+ * 作成したアリーナの参照の数は1から始まる
  * 成功したら0、それ以外の場合は0以外を返す
  */
-Result copyDatetime(Datetime **copyPointer, Datetime *base)
+Result createArena(Arena **arenaPointer)
 {
-    Datetime *copy = *copyPointer = malloc(sizeof(Datetime));
-    if (copy == NULL)
+    // アリーナ自身を最初のブロックから切り出す
+    ArenaBlock *block = malloc(ARENA_BLOCK_SIZE);
+    if (block == NULL)
     {
+        *arenaPointer = NULL;
         return 1;
     }
+    block->next = NULL;
+    block->size = ARENA_BLOCK_SIZE - sizeof(ArenaBlock);
+    block->used = sizeof(Arena);
 
-    memcpy(copy, base, sizeof(Datetime));
+    Arena *arena = *arenaPointer = (Arena *)getArenaBlockData(block);
+    arena->block = block;
+    arena->referenceCount = 1;
 
     return 0;
 }
+
+/**
+ * アリーナから指定されたバイト数の領域を切り出す
+ * 切り出せなかった場合はNULLを返す
+ */
+void *allocateArena(Arena *arena, u64 size)
+{
+    // 8バイト境界にそろえる
+    size = (size + 7) & ~(u64)7;
+
+    ArenaBlock *block = arena->block;
+    if (block->used + size > block->size)
+    {
+        // 新たなブロックを確保する
+        u64 blockSize = ARENA_BLOCK_SIZE - sizeof(ArenaBlock);
+        if (blockSize < size)
+        {
+            blockSize = size;
+        }
+
+        ArenaBlock *newBlock = malloc(sizeof(ArenaBlock) + blockSize);
+        if (newBlock == NULL)
+        {
+            return NULL;
+        }
+        newBlock->next = block;
+        newBlock->size = blockSize;
+        newBlock->used = 0;
+
+        arena->block = block = newBlock;
+    }
+
+    void *pointer = getArenaBlockData(block) + block->used;
+    block->used += size;
+    return pointer;
+}
+
+// アリーナの参照の数を増やす
+void retainArena(Arena *arena)
+{
+    __atomic_add_fetch(&arena->referenceCount, 1, __ATOMIC_RELAXED);
+}
+
+// アリーナの参照の数を減らし、なくなったらすべてのブロックを解放する
+void releaseArena(Arena *arena)
+{
+    if (__atomic_sub_fetch(&arena->referenceCount, 1, __ATOMIC_ACQ_REL) > 0)
+    {
+        return;
+    }
+
+    // アリーナ自身を含む最初のブロックは最後に解放される
+    ArenaBlock *block = arena->block;
+    while (block != NULL)
+    {
+        ArenaBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+}
+
+/**
+ * アリーナが指定されていればアリーナから、それ以外の場合はヒープから領域を確保する
+ * 確保できなかった場合はNULLを返す
+ */
+void *allocateFrom(Arena *arena, u64 size)
+{
+    return arena != NULL ? allocateArena(arena, size) : malloc(size);
+}
 #pragma endregion
 
 #pragma region Image
 typedef struct __Image Image;
 typedef struct __Entry Entry;
 typedef struct __File File;
+typedef struct __Extent Extent;
+typedef struct __DentryCache DentryCache;
+typedef struct __Catalog Catalog;
+typedef struct __Directory Directory;
+typedef struct __BlockCache BlockCache;
+
+/**
+ * FATイメージからディスクリプタに書き出す方法を表す
+ * 使えなかった場合は、後ろの方法に切り替える
+ */
+typedef enum __CopyMethod
+{
+    // 通常のファイルに、ファイルシステムの中でコピーする
+    COPY_FILE_RANGE,
+
+    // パイプに、ページキャッシュから直接つなぐ
+    COPY_SPLICE,
+
+    // 任意のディスクリプタに、カーネルの中でコピーする
+    COPY_SENDFILE,
+
+    // バイト列を書き込む
+    COPY_WRITE,
+} CopyMethod;
 
 // FATのサブタイプを表す
 typedef enum __FATType
@@ -289,12 +482,143 @@ typedef enum __FATType
     FAT32,
 } FATType;
 
+/**
+ * FATイメージの読み込みと、よく通る処理の統計
+ * 複数のスレッドから加算されるので、addStatで不可分に加算する
+ */
+typedef struct __ImageStats
+{
+    // ポインタの位置を移動した回数と、位置を指定して読み込めない環境でFATイメージの位置を移動した回数
+    u64 seekCount;
+
+    // FATイメージから読み込んだ回数とバイト数（マッピングの参照とカーネルの中でのコピーを含む）
+    u64 readCount;
+    u64 readByteCount;
+
+    // 先読みをOSに伝えた回数
+    u64 prefetchCount;
+
+    // FATのサブタイプごとの、FATから次のクラスタ番号を求めた回数
+    u64 fatLookupCounts[3];
+
+    // ディレクトリを読み取るときに走査したエントリのスロット数
+    u64 slotCount;
+
+    // 確保したエントリの数
+    u64 entryCount;
+
+    // エントリのキャッシュが当たった回数と外れた回数
+    u64 dentryHitCount;
+    u64 dentryMissCount;
+
+    // ブロックのキャッシュが当たった回数、外れた回数、ブロックを追い出した回数
+    u64 blockHitCount;
+    u64 blockMissCount;
+    u64 blockEvictionCount;
+
+    // 子エントリの取得、ファイルの読み込み、パスの解決の回数と、かかったナノ秒数
+    u64 getChildrenCount;
+    u64 getChildrenNanoseconds;
+    u64 readFileCount;
+    u64 readFileNanoseconds;
+    u64 resolveCount;
+    u64 resolveNanoseconds;
+} ImageStats;
+
+// ブロックのキャッシュに保持される1クラスタ分のバイト列
+typedef struct __CacheBlock CacheBlock;
+typedef struct __CacheBlock
+{
+    // ブロック番号
+    u64 number;
+
+    // FATイメージの中でブロックが始まるオフセット
+    u64 offset;
+
+    // ブロックのバイト列
+    u8 *bytes;
+
+    // 読み込めたバイト数（FATイメージの先頭と末尾のブロックはブロックの大きさより小さい）
+    u32 size;
+
+    // ブロックを直接参照している数、0より大きい間は追い出さない
+    u32 pinCount;
+
+    // 前回の追い出し候補の検査から参照されたかどうか
+    Boolean referenced;
+
+    // 有効なバイト列を保持しているかどうか
+    Boolean used;
+
+    // ハッシュ表の同じバケットの次のブロック
+    CacheBlock *nextInBucket;
+} CacheBlock;
+
+/**
+ * FATイメージをクラスタの大きさのブロックに区切ってキャッシュする
+ * ブロックの境界をデータ領域のクラスタの境界に合わせるので、1クラスタは常に1ブロックに収まる
+ * 上限に達したらCLOCK方式で、しばらく参照されていないブロックを追い出す
+ */
+typedef struct __BlockCache
+{
+    // ハッシュ表のバケット
+    CacheBlock **buckets;
+
+    // バケットの数から1を引いた値
+    u32 bucketMask;
+
+    // 保持するブロックの数
+    u32 capacity;
+
+    // ブロックのバイト数
+    u32 blockSize;
+
+    /**
+     * ブロック番号を求めるときにオフセットに加える値
+     * ブロック1がデータ領域のクラスタの境界から始まるようにする
+     */
+    u64 shift;
+
+    // 次に追い出す候補として検査するブロックの添字
+    u32 hand;
+
+    // すべてのブロック
+    CacheBlock *blocks;
+
+    // すべてのブロックのバイト列を並べた領域
+    u8 *data;
+
+#ifdef HAS_POSIX_IO
+    pthread_mutex_t lock;
+#endif
+} BlockCache;
+
 // FATイメージを表す
 typedef struct __Image
 {
     // FATイメージを表すファイルのポインタ
     FILE *fp;
 
+#ifdef HAS_POSIX_IO
+    /**
+     * FATイメージを表すファイルのディスクリプタ
+     * 位置を指定して読み込むので、複数のスレッドから同時に読み込める
+     */
+    s32 fd;
+
+    // 開いているエントリとポインタの一覧を操作するときのロック
+    pthread_mutex_t lock;
+#endif
+
+    /**
+     * FATイメージをメモリにマッピングした領域
+     * マッピングしていない場合はNULL
+     */
+    const u8 *map;
+
+    // マッピングした領域のバイト数
+    u64 mapSize;
+
     /**
      * FATイメージの中で開いているエントリ
      * エントリを要素として連結リストで管理する
@@ -328,63 +652,164 @@ typedef struct __Image
     // FATのサブタイプ
     FATType fatType;
 
+    // 子エントリの列挙ごとにアリーナを使うかどうか
+    Boolean useEntryArena;
+
+    // 先読みする範囲の上限のバイト数、0なら先読みしない
+    u32 maxReadAheadSize;
+
+    // 読み込みのキューで同時に読み込ませる断片の数、0ならキューは同期的に読み込む
+    u32 readQueueDepth;
+
     // 使用中のクラスタ番号のうち最大のもの
     u32 clusterEnd;
 
+    // FAT領域1つ分のバイト数
+    u64 fatSize;
+
+    // FAT領域の数（最初のFATと、その複製の数の和）
+    u8 fatCount;
+
+    // FATのエントリ数（データ領域のクラスタ数 + 2）
+    u32 clusterCount;
+
+    /**
+     * FAT32のFSInfoに記録された空きクラスタ数と、次に割り当てる候補のクラスタ番号
+     * FSInfoがない場合や記録されていない場合はFSINFO_UNKNOWN
+     */
+    u32 fsInfoFreeCount;
+    u32 fsInfoNextFree;
+
+    /**
+     * FATを展開したテーブル
+     * クラスタ番号を添字として次のクラスタ番号を格納する
+     * 展開していない場合はNULL
+     */
+    u32 *fatTable;
+
+    /**
+     * パスの解決に使うエントリのキャッシュ
+     * キャッシュしない場合はNULL
+     */
+    DentryCache *dentryCache;
+
+    /**
+     * FATイメージの読み込みに使うブロックのキャッシュ
+     * マッピングしている場合やキャッシュしない場合はNULL
+     */
+    BlockCache *blockCache;
+
+    /**
+     * すべてのエントリの情報
+     * 作成していない場合はNULL
+     */
+    Catalog *catalog;
+
     // FATから次のクラスタ番号を取得する
     u32 (*getNextCluster)(const Image *image, u32 cluster);
+
+    /**
+     * 読み込みと処理の統計
+     * FATイメージを読み込むだけの処理からも加算できるように、別の領域に確保する
+     */
+    ImageStats *stats;
 } Image;
 
-// FATイメージに含まれるエントリを表す
-typedef struct __Entry
+// FATイメージを開くときのオプション
+typedef struct __ImageOptions
 {
-    // エントリが含まれるFATイメージ
-    Image *image;
+    /**
+     * FATを展開したテーブルに使うメモリの上限（バイト数）
+     * 上限を超える場合や0の場合は展開せず、参照のたびにFATイメージから読み込む
+     */
+    u64 fatTableLimit;
 
-    // 次の開いているエントリ
-    Entry *nextOpenedEntry;
+    /**
+     * FATイメージをメモリにマッピングするかどうか
+     * マッピングできなかった場合はファイルポインタから読み込む
+     */
+    Boolean useMap;
 
     /**
-     * エントリを指すファイルのポインタ
-     * ポインタを要素として連結リストで管理する
+     * エントリのキャッシュに保持するエントリ数の上限
+     * 0の場合はキャッシュしない
      */
-    File *openedFile;
+    u32 dentryCacheCapacity;
 
-    // エントリの名前
-    wchar_t *name;
+    /**
+     * マッピングしていないFATイメージの読み込みに使う、ブロックのキャッシュのバイト数の上限
+     * ブロックは1クラスタ分の大きさで、1ブロックに満たない場合や0の場合はキャッシュしない
+     */
+    u64 blockCacheSize;
 
-    // 読み取り専用かどうか
-    Boolean readonly;
+    /**
+     * 開くときにすべてのディレクトリを読み込み、エントリの情報のカタログを作成するかどうか
+     * 作成した場合、エントリの取得と列挙にFATイメージを読み込まなくなる
+     */
+    Boolean buildCatalog;
 
-    // 非表示かどうか
-    Boolean hidden;
+    /**
+     * 子エントリの列挙ごとにアリーナを使い、エントリと名前をまとめて確保するかどうか
+     * 使わない場合はそれぞれヒープに確保する
+     */
+    Boolean useEntryArena;
 
-    // システム関連のエントリかどうか
-    Boolean system;
+    /**
+     * ファイルを連続して読み込んでいるときに先読みする範囲の上限のバイト数
+     * 連続している間、範囲を最初の大きさから上限まで倍々に広げる
+     * 0なら先読みしない
+     */
+    u32 maxReadAheadSize;
 
-    // ボリュームかどうか
-    Boolean volume;
+    /**
+     * 読み込みのキューで同時に読み込ませる断片の数
+     * io_uringを使えない環境や0の場合は、要求を受け付けたときに読み込む
+     */
+    u32 readQueueDepth;
+} ImageOptions;
 
-    // ディレクトリかどうか
-    Boolean directory;
+// FATイメージに含まれるエントリを表す
+typedef struct __Entry
+{
+    // エントリが含まれるFATイメージ
+    Image *image;
 
-    // ファイルかどうか
-    Boolean file;
+    /**
+     * 前後の開いているエントリ
+     * 途中のエントリを辿らずに除外できるように、双方向に連結する
+     */
+    Entry *prevOpenedEntry;
+    Entry *nextOpenedEntry;
 
-    // 作成日時
-    Datetime *createdAt;
+    /**
+     * エントリを指すファイルのポインタ
+     * ポインタを要素として双方向の連結リストで管理する
+     */
+    File *openedFile;
 
-    // 更新日時
-    Datetime *modifiedAt;
+    // エントリの名前（UTF-8）
+    char *name;
 
-    // アクセス日時
-    Datetime *accessedAt;
+    /**
+     * エントリと名前の領域を切り出したアリーナ
+     * ヒープに確保した場合はNULL
+     */
+    Arena *arena;
 
     // エントリのサイズ
     u32 size;
 
     // エントリの最初のクラスタ番号
     u32 cluster;
+
+    // カタログの中のエントリの番号
+    u32 catalogIndex;
+
+    /**
+     * ディレクトリエントリのバイト列
+     * 属性や日時は必要になったときにここから読み取る
+     */
+    u8 record[ENTRY_SIZE];
 } Entry;
 
 // FATイメージのファイルのエントリのポインタを表す
@@ -393,16 +818,48 @@ typedef struct __File
     // ポインタが指すエントリ
     Entry *entry;
 
-    // 次の開いているポインタ
+    // 前後の開いているポインタ
+    File *prevOpenedFile;
     File *nextOpenedFile;
 
     // ファイルの中の位置
     u32 position;
 
-    // 現在のクラスタ番号
-    u32 cluster;
+    /**
+     * ファイルのデータが格納されているクラスタの並び
+     * ファイルの先頭から順に格納する
+     */
+    Extent *extents;
+
+    // クラスタの並びの数
+    u32 extentCount;
+
+    // 現在の位置を含むクラスタの並びの添字
+    u32 extentIndex;
+
+    // 直前の読み込みが終わった位置
+    u32 lastReadEnd;
+
+    // 先読みを済ませた範囲の終わりの位置
+    u32 readAheadPosition;
+
+    // 先読みする範囲のバイト数、0なら連続した読み込みとみなしていない
+    u32 readAheadSize;
 } File;
 
+// データ領域上で連続したクラスタの並びを表す
+typedef struct __Extent
+{
+    // 最初のクラスタ番号
+    u32 cluster;
+
+    // クラスタの数
+    u32 length;
+
+    // 最初のクラスタが、チェーンの先頭から何番目のクラスタか
+    u32 index;
+} Extent;
+
 // バイト列から指定したオフセットの8ビットを取得する
 u8 get8(const u8 *bytes, u8 offset)
 {
@@ -428,40 +885,142 @@ u32 get32(const u8 *bytes, u8 offset)
     return v0 | (v1 << 8) | (v2 << 16) | (v3 << 24);
 }
 
+// 統計のカウンタに不可分に加算する
+void addStat(u64 *counter, u64 value)
+{
+    __atomic_add_fetch(counter, value, __ATOMIC_RELAXED);
+}
+
+// FATから次のクラスタ番号を求めた回数を記録する
+void addFatLookupStat(const Image *image, u64 count)
+{
+    addStat(&image->stats->fatLookupCounts[image->fatType], count);
+}
+
+// 経過時間の計測に使う、単調増加する時刻をナノ秒で取得する
+u64 getNanoseconds()
+{
+#ifdef HAS_POSIX_IO
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (u64)now.tv_sec * 1000000000 + now.tv_nsec;
+#else
+    return 0;
+#endif
+}
+
 void closeEntry(Entry *entry);
 void closeFile(File *file);
 
 u32 getNextCluster12(const Image *image, u32 cluster);
 u32 getNextCluster16(const Image *image, u32 cluster);
 u32 getNextCluster32(const Image *image, u32 cluster);
+u32 getNextClusterFromTable(const Image *image, u32 cluster);
+
+Result loadFatTable(Image *image);
+void mapImage(Image *image);
+Result createBlockCache(BlockCache **cachePointer, const Image *image, u64 size);
+void destroyBlockCache(BlockCache *cache);
+Result createDentryCache(DentryCache **cachePointer, u32 capacity);
+void destroyDentryCache(DentryCache *cache);
+Result closeImage(Image *image);
+Result openEntry(Entry **entryPointer, Image *image, const char *path);
+Result buildCatalog(Catalog **catalogPointer, Entry *root);
+void destroyCatalog(Catalog *catalog);
+u64 readImage(const Image *image, u8 *bytes, u64 offset, u64 size);
+
+// オプションを既定値で初期化する
+void getDefaultImageOptions(ImageOptions *options)
+{
+    options->fatTableLimit = DEFAULT_FAT_TABLE_LIMIT;
+    options->useMap = TRUE;
+    options->dentryCacheCapacity = DEFAULT_DENTRY_CACHE_CAPACITY;
+    options->blockCacheSize = DEFAULT_BLOCK_CACHE_SIZE;
+    options->buildCatalog = FALSE;
+    options->useEntryArena = TRUE;
+    options->maxReadAheadSize = DEFAULT_MAX_READ_AHEAD_SIZE;
+    options->readQueueDepth = DEFAULT_READ_QUEUE_DEPTH;
+}
 
 /**
- * FATイメージを指定されたパスから開く
- * 成功したら0、それ以外の場合は0以外を返す
+ * ブートセクタから求めたFATイメージの配置が、FATとして矛盾していないかどうかを返す
+ * 矛盾している場合は、ゼロ除算や範囲外の読み込みを避けるために開かない
  */
-Result openImage(Image **imagePointer, const char *path)
+Boolean isValidLayout(u16 bytePerSector, u8 sectorPerCluster, u16 reservedSectorCount, u8 fatCount, u32 totalSectorCount)
+{
+    // セクタとクラスタの大きさは2の累乗
+    if (bytePerSector < 512 || bytePerSector > 4096 || (bytePerSector & (bytePerSector - 1)) != 0)
+    {
+        return FALSE;
+    }
+    if (sectorPerCluster == 0 || (sectorPerCluster & (sectorPerCluster - 1)) != 0)
+    {
+        return FALSE;
+    }
+    return reservedSectorCount > 0 && fatCount > 0 && totalSectorCount > reservedSectorCount;
+}
+
+/**
+ * FATイメージを指定されたパス、オプションで開く
+ * 成功したら0、それ以外の場合はエラーコードを返す
+ */
+Result openImageWithOptions(Image **imagePointer, const char *path, const ImageOptions *options)
 {
     // FATイメージの領域を確保する
     Image *image = *imagePointer = malloc(sizeof(Image));
     if (image == NULL)
     {
-        return 1;
+        return FAT_ERROR_NO_MEMORY;
+    }
+
+    image->stats = calloc(1, sizeof(ImageStats));
+    if (image->stats == NULL)
+    {
+        free(image);
+        *imagePointer = NULL;
+        return FAT_ERROR_NO_MEMORY;
     }
 
     // FATイメージを表すファイルを開く
     FILE *fp = fopen(path, "rb");
     if (fp == NULL)
     {
-        return 2;
+        free(image->stats);
+        free(image);
+        *imagePointer = NULL;
+        return FAT_ERROR_IO;
     }
 
-    // MBRを読み込む
-    u8 bytes[64];
-    fread(bytes, sizeof(u8), sizeof(bytes), fp);
-
     // メンバを初期化する
     image->fp = fp;
+#ifdef HAS_POSIX_IO
+    image->fd = fileno(fp);
+    pthread_mutex_init(&image->lock, NULL);
+#endif
+    image->map = NULL;
+    image->mapSize = 0;
     image->openedEntry = NULL;
+    image->fatTable = NULL;
+    image->dentryCache = NULL;
+    image->blockCache = NULL;
+    image->catalog = NULL;
+    image->useEntryArena = options->useEntryArena;
+    image->maxReadAheadSize = options->maxReadAheadSize;
+    image->readQueueDepth = options->readQueueDepth;
+
+    if (options->useMap)
+    {
+        mapImage(image);
+    }
+
+    // MBRを読み込む
+    u8 bytes[64] = {0};
+    if (readImage(image, bytes, 0, sizeof(bytes)) != sizeof(bytes))
+    {
+        closeImage(image);
+        *imagePointer = NULL;
+        return FAT_ERROR_INVALID_IMAGE;
+    }
 
     u16 bytePerSector = get16(bytes, 11);
     image->sectorSize = bytePerSector;
@@ -473,6 +1032,7 @@ Result openImage(Image **imagePointer, const char *path)
     image->fatOffset = bytePerSector * reservedSectorCount;
 
     u8 fatCount = get8(bytes, 16);
+    image->fatCount = fatCount;
     u32 fatSectorCount = get16(bytes, 22);
     image->rootOffset = image->fatOffset + bytePerSector * fatSectorCount * fatCount;
 
@@ -491,8 +1051,18 @@ Result openImage(Image **imagePointer, const char *path)
         totalSectorCount = get32(bytes, 32);
     }
 
+    // FATのブートセクタでなければ開かない
+    if (!isValidLayout(bytePerSector, sectorPerCluster, reservedSectorCount, fatCount, totalSectorCount) ||
+        dataOffset / bytePerSector >= totalSectorCount)
+    {
+        closeImage(image);
+        *imagePointer = NULL;
+        return FAT_ERROR_INVALID_IMAGE;
+    }
+
     u32 dataSectorCount = totalSectorCount - dataOffset / bytePerSector;
     u32 dataClusterCount = dataSectorCount / sectorPerCluster;
+    image->clusterCount = dataClusterCount + CLUSTER_START;
 
     if (dataClusterCount < FAT12_16_BORDER)
     {
@@ -519,6 +1089,10 @@ Result openImage(Image **imagePointer, const char *path)
         dataOffset = image->fatOffset + bytePerSector * fatSectorCount * fatCount;
         image->dataOffset = dataOffset - 2 * image->clusterSize;
 
+        // FAT領域の大きさが分かったので、データ領域のクラスタ数を求め直す
+        dataSectorCount = totalSectorCount - dataOffset / bytePerSector;
+        image->clusterCount = dataSectorCount / sectorPerCluster + CLUSTER_START;
+
         u32 rootCluster = get32(bytes, 44);
         image->rootCluster = rootCluster;
         image->rootOffset = image->dataOffset + image->clusterSize * rootCluster;
@@ -526,16 +1100,134 @@ Result openImage(Image **imagePointer, const char *path)
         image->maxRootEntryCount = image->maxSubEntryCount;
     }
 
+    // FAT領域がないか、ルートディレクトリのクラスタがデータ領域の外にあれば開かない
+    if (fatSectorCount == 0 || dataOffset / bytePerSector >= totalSectorCount ||
+        (image->fatType == FAT32 && (image->rootCluster < CLUSTER_START || image->rootCluster >= image->clusterCount)))
+    {
+        closeImage(image);
+        *imagePointer = NULL;
+        return FAT_ERROR_INVALID_IMAGE;
+    }
+
+    // FSInfoの署名が正しければ、空きクラスタ数の記録を読み込む
+    image->fsInfoFreeCount = FSINFO_UNKNOWN;
+    image->fsInfoNextFree = FSINFO_UNKNOWN;
+    if (image->fatType == FAT32)
+    {
+        u16 fsInfoSector = get16(bytes, 48);
+        u8 fsInfo[512];
+        if (fsInfoSector != 0 && fsInfoSector != 0xffff &&
+            readImage(image, fsInfo, (u64)fsInfoSector * bytePerSector, sizeof(fsInfo)) == sizeof(fsInfo) &&
+            get32(fsInfo, 0) == FSINFO_LEAD_SIGNATURE &&
+            get32(fsInfo + 484, 0) == FSINFO_STRUCT_SIGNATURE &&
+            get32(fsInfo + 508, 0) == FSINFO_TRAIL_SIGNATURE)
+        {
+            image->fsInfoFreeCount = get32(fsInfo + 488, 0);
+            image->fsInfoNextFree = get32(fsInfo + 492, 0);
+        }
+    }
+
+    image->fatSize = (u64)bytePerSector * fatSectorCount;
+
+    // FAT領域に収まるエントリ数を超えないようにする
+    u64 fatEntryCount;
+    switch (image->fatType)
+    {
+    case FAT12:
+        fatEntryCount = image->fatSize * 2 / 3;
+        break;
+    case FAT16:
+        fatEntryCount = image->fatSize / 2;
+        break;
+    default:
+        fatEntryCount = image->fatSize / 4;
+        break;
+    }
+    if (image->clusterCount > fatEntryCount)
+    {
+        image->clusterCount = fatEntryCount;
+    }
+
+    // マッピングしていなければ、何度も読み込むFATやディレクトリのクラスタをキャッシュする
+    // キャッシュを作成できなかった場合は、毎回FATイメージから読み込む
+    if (image->map == NULL && options->blockCacheSize > 0)
+    {
+        createBlockCache(&image->blockCache, image, options->blockCacheSize);
+    }
+
+    // FATを展開したテーブルが上限に収まる場合は、FAT全体を一度に読み込んで展開する
+    u64 fatTableSize = (u64)image->clusterCount * sizeof(u32);
+    if (fatTableSize <= options->fatTableLimit)
+    {
+        // 展開に失敗した場合は、参照のたびにFATイメージから読み込む
+        if (loadFatTable(image) == 0)
+        {
+            image->getNextCluster = &getNextClusterFromTable;
+        }
+    }
+
+    // キャッシュを作成できなかった場合は、キャッシュせずに毎回ディレクトリを読み込む
+    if (options->dentryCacheCapacity > 0)
+    {
+        createDentryCache(&image->dentryCache, options->dentryCacheCapacity);
+    }
+
+    // カタログを作成できなかった場合は、毎回ディレクトリを読み込む
+    if (options->buildCatalog)
+    {
+        Entry *root;
+        if (openEntry(&root, image, "/") == 0)
+        {
+            Catalog *catalog;
+            if (buildCatalog(&catalog, root) == 0)
+            {
+                image->catalog = catalog;
+            }
+            closeEntry(root);
+        }
+    }
+
     return 0;
 }
 
+/**
+ * FATイメージを指定されたパスから既定のオプションで開く
+ * 成功したら0、それ以外の場合はエラーコードを返す
+ */
+Result openImage(Image **imagePointer, const char *path)
+{
+    ImageOptions options;
+    getDefaultImageOptions(&options);
+    return openImageWithOptions(imagePointer, path, &options);
+}
+
+/**
+ * FATイメージの開いているエントリとポインタの一覧を操作するためにロックする
+ * 一覧の操作を終えたらunlockImageでロックを解除する
+ */
+void lockImage(Image *image)
+{
+#ifdef HAS_POSIX_IO
+    pthread_mutex_lock(&image->lock);
+#endif
+}
+
+// lockImageによるロックを解除する
+void unlockImage(Image *image)
+{
+#ifdef HAS_POSIX_IO
+    pthread_mutex_unlock(&image->lock);
+#endif
+}
+
 /**
  * FATイメージを閉じる
- * 成功したら0、それ以外の場合は0以外を返す
+ * 他のスレッドがFATイメージを使っていない状態で呼び出す
+ * 成功したら0、それ以外の場合はエラーコードを返す
  */
 Result closeImage(Image *image)
 {
-    Result result = fclose(image->fp);
+    Result result = fclose(image->fp) == 0 ? FAT_OK : FAT_ERROR_IO;
 
     // 開いているエントリをすべて閉じる
     Entry *openedEntry = image->openedEntry;
@@ -546,6 +1238,31 @@ Result closeImage(Image *image)
         openedEntry = nextOpenedEntry;
     }
 
+#ifdef HAS_POSIX_IO
+    if (image->map != NULL)
+    {
+        munmap((void *)image->map, image->mapSize);
+    }
+    pthread_mutex_destroy(&image->lock);
+#endif
+
+    if (image->dentryCache != NULL)
+    {
+        destroyDentryCache(image->dentryCache);
+    }
+
+    if (image->blockCache != NULL)
+    {
+        destroyBlockCache(image->blockCache);
+    }
+
+    if (image->catalog != NULL)
+    {
+        destroyCatalog(image->catalog);
+    }
+
+    free(image->fatTable);
+    free(image->stats);
     free(image);
     return result;
 }
@@ -553,849 +1270,7317 @@ Result closeImage(Image *image)
 // クラスタ番号からデータ領域のオフセットを計算する
 u64 getDataOffset(const Image *image, u32 cluster)
 {
-    return image->dataOffset + image->clusterSize * cluster;
+    return image->dataOffset + (u64)image->clusterSize * cluster;
 }
 
 /**
- * 指定されたクラスタの領域の先頭まで、FATイメージのファイルポインタを移動させる
- * 成功したら0、それ以外の場合は0以外を返す
+ * FATイメージ全体を読み込み専用でメモリにマッピングする
+ * マッピングできなかった場合は何もしない
  */
-Result seekTo(const Image *image, u32 cluster)
-{
-    u64 offset = getDataOffset(image, cluster);
-    return fseek(image->fp, offset, SEEK_SET);
-}
-
-// 12ビットのFATから次のクラスタ番号を取得する
-u32 getNextCluster12(const Image *image, u32 cluster)
+void mapImage(Image *image)
 {
-    // FAT領域のクラスタ番号が表す部分の値を3バイト分取得する
-    u32 offset = image->fatOffset + cluster / 2 * 3;
-    fseek(image->fp, offset, SEEK_SET);
-    u32 v0 = fgetc(image->fp);
-    u32 v1 = fgetc(image->fp);
-    u32 v2 = fgetc(image->fp);
-
-    u16 v;
-    if (cluster % 2 == 0)
+#ifdef HAS_POSIX_IO
+    s32 fd = image->fd;
+    struct stat status;
+    if (fstat(fd, &status) != 0 || status.st_size <= 0)
     {
-        // クラスタ番号が偶数の場合は下位12ビットを取得する
-        v = (v0 | (v1 << 8));
+        return;
     }
-    else
+
+    void *map = mmap(NULL, status.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
     {
-        // クラスタ番号が奇数の場合は上位12ビットを取得する
-        v = ((v1 >> 4) | (v2 << 4));
+        return;
     }
-    return v & 0xfff;
-}
 
-// 16ビットのFATから次のクラスタ番号を取得する
-u32 getNextCluster16(const Image *image, u32 cluster)
-{
-    u32 offset = image->fatOffset + cluster * 2;
-    fseek(image->fp, offset, SEEK_SET);
-    u32 v0 = fgetc(image->fp);
-    u32 v1 = fgetc(image->fp);
-    return v0 | (v1 << 8);
+    image->map = map;
+    image->mapSize = status.st_size;
+#endif
 }
 
-// 32ビットのFATから次のクラスタ番号を取得する
-u32 getNextCluster32(const Image *image, u32 cluster)
+/**
+ * FATイメージの指定されたオフセットから、指定された長さのバイト列をキャッシュを通さずに読み込む
+ * 実際に読み込まれたバイト列の長さを返す
+ */
+u64 __readImage(const Image *image, u8 *bytes, u64 offset, u64 size)
 {
-    u32 offset = image->fatOffset + cluster * 4;
-    fseek(image->fp, offset, SEEK_SET);
-    u32 v0 = fgetc(image->fp);
-    u32 v1 = fgetc(image->fp);
-    u32 v2 = fgetc(image->fp);
-    u32 v3 = fgetc(image->fp);
-    u32 v = v0 | (v1 << 8) | (v2 << 16) | (v3 << 24);
-    return v & 0x0FFFFFFF;
-}
-#pragma endregion
+    addStat(&image->stats->readCount, 1);
 
-#pragma region Entry
-u16 getChildren(Entry **children[], const Entry *parent);
+    if (image->map != NULL)
+    {
+        // マッピングからコピーする
+        if (offset >= image->mapSize)
+        {
+            return 0;
+        }
+        if (size > image->mapSize - offset)
+        {
+            size = image->mapSize - offset;
+        }
+        memcpy(bytes, image->map + offset, size);
+        addStat(&image->stats->readByteCount, size);
+        return size;
+    }
+
+#ifdef HAS_POSIX_IO
+    // ファイルの位置を共有しないように、位置を指定して読み込む
+    u64 readSize = 0;
+    while (readSize < size)
+    {
+        ssize_t chunkReadSize = pread(image->fd, bytes + readSize, size - readSize, offset + readSize);
+        if (chunkReadSize <= 0)
+        {
+            break;
+        }
+        readSize += chunkReadSize;
+    }
+    addStat(&image->stats->readByteCount, readSize);
+    return readSize;
+#else
+    addStat(&image->stats->seekCount, 1);
+    if (fseek(image->fp, offset, SEEK_SET) != 0)
+    {
+        return 0;
+    }
+    u64 readSize = fread(bytes, sizeof(u8), size, image->fp);
+    addStat(&image->stats->readByteCount, readSize);
+    return readSize;
+#endif
+}
 
 /**
- * 指定されたイメージ、名前、バイト列でエントリを作成する
+ * FATイメージの大きさとクラスタの大きさに合わせて、指定されたバイト数を上限とするブロックのキャッシュを作成する
  * 成功したら0、それ以外の場合は0以外を返す
  */
-Result __openEntry(Entry **entryPointer, Image *image, wchar_t *name, const u8 *bytes)
+Result createBlockCache(BlockCache **cachePointer, const Image *image, u64 size)
 {
-    // エントリの領域を確保する
-    Entry *entry = *entryPointer = malloc(sizeof(Entry));
-    if (entry == NULL)
+    *cachePointer = NULL;
+
+    u32 blockSize = image->clusterSize;
+    if (blockSize == 0 || size / blockSize == 0)
     {
         return 1;
     }
+    u64 capacity = size / blockSize;
+    if (capacity > 0x10000000u)
+    {
+        capacity = 0x10000000u;
+    }
 
-    // メンバを初期化する
-    entry->image = image;
-    entry->nextOpenedEntry = image->openedEntry;
-    image->openedEntry = entry;
-
-    entry->openedFile = NULL;
+    BlockCache *cache = malloc(sizeof(BlockCache));
+    if (cache == NULL)
+    {
+        return 2;
+    }
 
-    entry->name = name;
+    // バケットの数を上限以上の2の冪にする
+    u32 bucketCount = 16;
+    while (bucketCount < capacity)
+    {
+        bucketCount *= 2;
+    }
 
-    entry->readonly = (get8(bytes, 11) & READ_ONLY) != 0;
-    entry->hidden = (get8(bytes, 11) & HIDDEN) != 0;
-    entry->system = (get8(bytes, 11) & SYSTEM) != 0;
-    entry->volume = (get8(bytes, 11) & VOLUME_ID) != 0;
-    entry->directory = (get8(bytes, 11) & DIRECTORY) != 0;
-    entry->file = (get8(bytes, 11) & ARCHIVE) != 0;
+    cache->buckets = calloc(bucketCount, sizeof(CacheBlock *));
+    cache->blocks = calloc(capacity, sizeof(CacheBlock));
+    cache->data = malloc(capacity * blockSize);
+    if (cache->buckets == NULL || cache->blocks == NULL || cache->data == NULL)
+    {
+        free(cache->buckets);
+        free(cache->blocks);
+        free(cache->data);
+        free(cache);
+        return 3;
+    }
 
-    createDatetime(&entry->createdAt, get16(bytes, 16), get16(bytes, 14), get8(bytes, 13));
-    createDatetime(&entry->modifiedAt, get16(bytes, 24), get16(bytes, 22), 0);
-    createDatetime(&entry->accessedAt, get16(bytes, 18), 0, 0);
+    for (u32 i = 0; i < capacity; ++i)
+    {
+        cache->blocks[i].bytes = cache->data + (u64)i * blockSize;
+    }
 
-    entry->size = get32(bytes, 28);
+    // データ領域の先頭からの距離がクラスタの大きさの倍数になるオフセットで、ブロックを区切る
+    u64 dataStart = image->dataOffset + (u64)CLUSTER_START * blockSize;
+    cache->shift = blockSize - dataStart % blockSize;
 
-    u32 higherCluster = get16(bytes, 20);
-    u32 lowerCluster = get16(bytes, 26);
-    entry->cluster = (higherCluster << 16) | lowerCluster;
+    cache->bucketMask = bucketCount - 1;
+    cache->capacity = capacity;
+    cache->blockSize = blockSize;
+    cache->hand = 0;
+#ifdef HAS_POSIX_IO
+    pthread_mutex_init(&cache->lock, NULL);
+#endif
 
+    *cachePointer = cache;
     return 0;
 }
 
+// ブロックのキャッシュを破棄する
+void destroyBlockCache(BlockCache *cache)
+{
+#ifdef HAS_POSIX_IO
+    pthread_mutex_destroy(&cache->lock);
+#endif
+    free(cache->buckets);
+    free(cache->blocks);
+    free(cache->data);
+    free(cache);
+}
+
+// 指定されたオフセットを含むブロックの番号を計算する
+u64 getBlockNumber(const BlockCache *cache, u64 offset)
+{
+    return (offset + cache->shift) / cache->blockSize;
+}
+
 /**
- * 指定されたエントリをコピーする
- * 成功したら0、それ以外の場合は0以外を返す
+ * しばらく参照されていないブロックを追い出し、空いたブロックを返す
+ * すべてのブロックが直接参照されている場合はNULLを返す
+ * キャッシュをロックした状態で呼び出す
  */
-Result copyEntry(Entry **copyPointer, const Entry *base)
+CacheBlock *evictBlock(const Image *image, BlockCache *cache)
 {
-    // エントリの領域を確保する
-    Entry *copy = *copyPointer = malloc(sizeof(Entry));
-    if (copy == NULL)
+    // 参照されたブロックは印を消して一周だけ猶予を与えるので、二周すれば必ず候補が見つかる
+    for (u64 i = 0; i < (u64)cache->capacity * 2; ++i)
     {
-        return 1;
+        CacheBlock *block = &cache->blocks[cache->hand];
+        cache->hand = cache->hand + 1 < cache->capacity ? cache->hand + 1 : 0;
+
+        if (block->pinCount > 0)
+        {
+            continue;
+        }
+        if (block->referenced)
+        {
+            block->referenced = FALSE;
+            continue;
+        }
+
+        if (block->used)
+        {
+            CacheBlock **link = &cache->buckets[block->number & cache->bucketMask];
+            while (*link != block)
+            {
+                link = &(*link)->nextInBucket;
+            }
+            *link = block->nextInBucket;
+            block->used = FALSE;
+            addStat(&image->stats->blockEvictionCount, 1);
+        }
+        return block;
+    }
+    return NULL;
+}
+
+// 指定された番号のブロックをキャッシュから探す、なければNULLを返す
+CacheBlock *findBlock(const BlockCache *cache, u64 number)
+{
+    CacheBlock *block = cache->buckets[number & cache->bucketMask];
+    for (; block != NULL; block = block->nextInBucket)
+    {
+        if (block->number == number)
+        {
+            return block;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * 指定された番号のブロックをキャッシュから取得し、なければFATイメージから読み込んでキャッシュに加える
+ * 空けられるブロックがない場合はNULLを返す
+ * キャッシュをロックした状態で呼び出す
+ * 読み込む間はロックを外し、他のスレッドの読み込みを待たせない
+ */
+CacheBlock *loadBlock(const Image *image, BlockCache *cache, u64 number)
+{
+    CacheBlock *block = findBlock(cache, number);
+    if (block != NULL)
+    {
+        block->referenced = TRUE;
+        addStat(&image->stats->blockHitCount, 1);
+        return block;
     }
 
-    memcpy(copy, base, sizeof(Entry));
+    addStat(&image->stats->blockMissCount, 1);
+    block = evictBlock(image, cache);
+    if (block == NULL)
+    {
+        return NULL;
+    }
 
-    copy->nextOpenedEntry = base->image->openedEntry;
-    base->image->openedEntry = copy;
+    // 読み込む間に追い出されないように、ハッシュ表に加えないまま固定しておく
+    block->pinCount++;
 
-    copy->openedFile = NULL;
+    // 先頭のブロックは、FATイメージの先頭からデータ領域のクラスタの境界までの短いブロックになる
+    u64 end = (number + 1) * cache->blockSize - cache->shift;
+    u64 offset = number * cache->blockSize > cache->shift ? number * cache->blockSize - cache->shift : 0;
 
-    coptString(&copy->name, base->name);
+#ifdef HAS_POSIX_IO
+    pthread_mutex_unlock(&cache->lock);
+#endif
+    u64 size = __readImage(image, block->bytes, offset, end - offset);
+#ifdef HAS_POSIX_IO
+    pthread_mutex_lock(&cache->lock);
+#endif
 
-    copyDatetime(&copy->createdAt, base->createdAt);
-    copyDatetime(&copy->modifiedAt, base->modifiedAt);
-    copyDatetime(&copy->accessedAt, base->accessedAt);
+    block->pinCount--;
 
-    return 0;
+    // 読み込む間に他のスレッドが同じブロックを加えていたら、そちらを使う
+    CacheBlock *loadedBlock = findBlock(cache, number);
+    if (loadedBlock != NULL)
+    {
+        loadedBlock->referenced = TRUE;
+        return loadedBlock;
+    }
+
+    block->number = number;
+    block->offset = offset;
+    block->size = size;
+    block->referenced = TRUE;
+    block->used = TRUE;
+
+    CacheBlock **bucket = &cache->buckets[number & cache->bucketMask];
+    block->nextInBucket = *bucket;
+    *bucket = block;
+    return block;
 }
 
 /**
- * 指定された名前の子エントリを取得する
- * 成功したら0、それ以外の場合は0以外を返す
+ * FATイメージの指定されたオフセットから、指定された長さのバイト列を読み込む
+ * ブロックのキャッシュがあれば、キャッシュしたブロックからコピーする
+ * FATとディレクトリの読み込みに使い、ファイルの中身は__readImageでキャッシュを通さずに読み込む
+ * キャッシュの4分の1を超える読み込みは、他のブロックを追い出さないようにキャッシュを通さない
+ * 実際に読み込まれたバイト列の長さを返す
  */
-Result getChildEntry(Entry **childPointer, const Entry *parent, const wchar_t *name)
+u64 readImage(const Image *image, u8 *bytes, u64 offset, u64 size)
 {
-    *childPointer = NULL;
-
-    Entry **children;
-    u16 count = getChildren(&children, parent);
-    if (count < 0)
+    BlockCache *cache = image->blockCache;
+    if (cache == NULL || size > (u64)cache->capacity * cache->blockSize / 4)
     {
-        return 1;
+        return __readImage(image, bytes, offset, size);
     }
 
-    Entry *child = NULL;
+    u64 readSize = 0;
+
+#ifdef HAS_POSIX_IO
+    pthread_mutex_lock(&cache->lock);
+#endif
 
-    // 子エントリのうち、パスの一部と名前が一致するエントリを探す
-    for (u16 i = 0; i < count; ++i)
+    while (readSize < size)
     {
-        if (wcscmp(name, children[i]->name) == 0)
+        CacheBlock *block = loadBlock(image, cache, getBlockNumber(cache, offset + readSize));
+        if (block == NULL)
         {
-            child = children[i];
             break;
         }
-    }
 
-    // 見つけたエントリ以外を閉じる
-    for (s32 i = count - 1; i >= 0; --i)
-    {
-        if (children[i] != child)
+        // FATイメージの末尾を超えていたら終わる
+        u64 blockOffset = offset + readSize - block->offset;
+        if (blockOffset >= block->size)
         {
-            closeEntry(children[i]);
+            size = readSize;
+            break;
         }
+
+        u64 chunkSize = block->size - blockOffset < size - readSize ? block->size - blockOffset : size - readSize;
+        memcpy(bytes + readSize, block->bytes + blockOffset, chunkSize);
+        readSize += chunkSize;
     }
 
-    free(children);
+#ifdef HAS_POSIX_IO
+    pthread_mutex_unlock(&cache->lock);
+#endif
 
-    // 名前が一致するエントリが見つからなかったら
-    if (child == NULL)
+    // すべてのブロックが直接参照されていたら、残りはキャッシュを通さずに読み込む
+    if (readSize < size)
     {
-        return 127;
+        readSize += __readImage(image, bytes + readSize, offset + readSize, size - readSize);
     }
-
-    *childPointer = child;
-    return 0;
+    return readSize;
 }
 
 /**
- * 指定されたパスの子孫エントリを取得する
- * 成功したら0、それ以外の場合は0以外を返す
+ * FATイメージの指定されたオフセットにある、指定された長さのバイト列を、キャッシュしたブロックの中で直接参照する
+ * 参照している間はブロックを追い出さないように固定し、参照し終えたらunpinBlockで固定を解除する
+ * 範囲が1つのブロックに収まらない場合や、キャッシュがない場合はNULLを返す
  */
-Result getDescendantEntry(Entry **descendantPointer, const Entry *parent, const wchar_t *path)
+const u8 *pinBlock(CacheBlock **blockPointer, const Image *image, u64 offset, u64 size)
 {
-    *descendantPointer = NULL;
+    *blockPointer = NULL;
 
-    // 親のエントリをコピーする
-    Entry *descendant;
-    Result result = copyEntry(&descendant, parent);
-    if (result)
+    BlockCache *cache = image->blockCache;
+    if (cache == NULL || size == 0 || getBlockNumber(cache, offset) != getBlockNumber(cache, offset + size - 1))
     {
-        return result;
+        return NULL;
     }
 
-    // パスをコピーする
-    wchar_t *pathCopy;
-    result = coptString(&pathCopy, path);
-    if (result)
+    const u8 *bytes = NULL;
+
+#ifdef HAS_POSIX_IO
+    pthread_mutex_lock(&cache->lock);
+#endif
+
+    CacheBlock *block = loadBlock(image, cache, getBlockNumber(cache, offset));
+    if (block != NULL && offset + size <= block->offset + block->size)
     {
-        return result;
+        block->pinCount++;
+        bytes = block->bytes + (offset - block->offset);
+        *blockPointer = block;
     }
 
-    // パスを区切り文字で分割してエントリを探していく
-    wchar_t *savePointer;
-    wchar_t *token = wcstok(pathCopy, PATH_DELIMITER, &savePointer);
+#ifdef HAS_POSIX_IO
+    pthread_mutex_unlock(&cache->lock);
+#endif
 
-    while (token != NULL)
-    {
-        Entry *child;
-        result = getChildEntry(&child, descendant, token);
-        closeEntry(descendant);
+    return bytes;
+}
 
-        if (result)
+// pinBlockによるブロックの固定を解除する
+void unpinBlock(const Image *image, CacheBlock *block)
+{
+    BlockCache *cache = image->blockCache;
+
+#ifdef HAS_POSIX_IO
+    pthread_mutex_lock(&cache->lock);
+#endif
+
+    block->pinCount--;
+
+#ifdef HAS_POSIX_IO
+    pthread_mutex_unlock(&cache->lock);
+#endif
+}
+
+/**
+ * FATイメージの指定されたオフセットにある、指定された長さのバイト列を参照する
+ * マッピングされている場合はマッピングを直接指し、それ以外の場合は指定されたバッファに読み込んで指す
+ * 範囲の全体を参照できなかった場合はNULLを返す
+ */
+const u8 *viewImage(const Image *image, u8 *buffer, u64 offset, u64 size)
+{
+    if (image->map != NULL)
+    {
+        if (offset > image->mapSize || size > image->mapSize - offset)
         {
-            break;
+            return NULL;
         }
-
-        token = wcstok(NULL, PATH_DELIMITER, &savePointer);
-        descendant = child;
+        addStat(&image->stats->readCount, 1);
+        addStat(&image->stats->readByteCount, size);
+        return image->map + offset;
     }
 
-    if (result == 0)
+    if (readImage(image, buffer, offset, size) != size)
     {
-        *descendantPointer = descendant;
+        return NULL;
     }
-
-    free(pathCopy);
-    return result;
+    return buffer;
 }
 
 /**
- * 指定されたFATイメージ、パスのエントリを開く
- * 成功したら0、それ以外の場合は0以外を返す
+ * 指定された範囲をまもなく読み込むことをOSに伝え、前もって読み込ませておく
+ * 伝えられない環境では何もしない
  */
-Result openEntry(Entry **entryPointer, Image *image, const wchar_t *path)
+void prefetchImage(const Image *image, u64 offset, u64 size)
 {
-    *entryPointer = NULL;
+    addStat(&image->stats->prefetchCount, 1);
 
-    // ルートのエントリを作成する
-    Entry *root;
-    wchar_t *name = malloc(sizeof(wchar_t));
-    wcscpy(name, L"");
-    u8 bytes[ENTRY_SIZE] = {0};
-    bytes[11] = DIRECTORY;
-    bytes[20] = (image->rootCluster >> 16) & 0xff;
-    bytes[21] = (image->rootCluster >> 24) & 0xff;
-    bytes[26] = image->rootCluster & 0xff;
-    bytes[27] = (image->rootCluster >> 8) & 0xff;
-    Result result = __openEntry(&root, image, name, bytes);
-    if (result)
+#ifdef HAS_POSIX_IO
+    if (image->map != NULL)
     {
-        return result;
+        if (offset >= image->mapSize)
+        {
+            return;
+        }
+        if (size > image->mapSize - offset)
+        {
+            size = image->mapSize - offset;
+        }
+
+        // madviseにはページの境界から始まる範囲を渡す
+        u64 pageSize = sysconf(_SC_PAGESIZE);
+        u64 start = offset / pageSize * pageSize;
+        madvise((void *)(image->map + start), offset + size - start, MADV_WILLNEED);
+        return;
     }
 
-    return getDescendantEntry(entryPointer, root, path);
+#ifdef POSIX_FADV_WILLNEED
+    posix_fadvise(image->fd, offset, size, POSIX_FADV_WILLNEED);
+#endif
+#endif
 }
 
-// エントリを閉じる
-void closeEntry(Entry *entry)
+#ifdef HAS_POSIX_IO
+// 指定されたディスクリプタへの書き出しに最初に試す方法を取得する
+CopyMethod getCopyMethod(s32 fd)
 {
-    // FATイメージの開いているエントリからエントリを除外する
-    if (entry->image->openedEntry == entry)
+#ifdef HAS_KERNEL_COPY
+    struct stat status;
+    if (fstat(fd, &status) == 0)
     {
-        entry->image->openedEntry = entry->nextOpenedEntry;
-    }
-    else
-    {
-        Entry *prevOpenedEntry = entry->image->openedEntry;
-        while (prevOpenedEntry->nextOpenedEntry != entry)
+        if (S_ISREG(status.st_mode))
         {
-            prevOpenedEntry = prevOpenedEntry->nextOpenedEntry;
+            return COPY_FILE_RANGE;
+        }
+        if (S_ISFIFO(status.st_mode))
+        {
+            return COPY_SPLICE;
+        }
+        if (S_ISSOCK(status.st_mode))
+        {
+            return COPY_SENDFILE;
         }
-        prevOpenedEntry->nextOpenedEntry = entry->nextOpenedEntry;
-    }
-
-    // 開いているポインタをすべて閉じる
-    File *openedFile = entry->openedFile;
-    while (openedFile != NULL)
-    {
-        File *nextOpenedFile = openedFile->nextOpenedFile;
-        closeFile(openedFile);
-        openedFile = nextOpenedFile;
     }
-
-    free(entry->name);
-    free(entry->createdAt);
-    free(entry->modifiedAt);
-    free(entry->accessedAt);
-
-    free(entry);
-}
-
-// 指定されたエントリがルートかどうかを返す
-Boolean getIsRoot(const Entry *entry)
-{
-    return entry->cluster == entry->image->rootCluster;
+#endif
+    return COPY_WRITE;
 }
 
 /**
- * 指定されたディレクトリのエントリの子エントリを取得する
- * 実際に取得された子エントリの数を返す
+ * FATイメージの指定されたオフセットから、指定された長さのバイト列をディスクリプタに書き出す
+ * できるだけユーザ空間を経由せずにカーネルの中でコピーし、できなければバイト列を書き込む
+ * 使えなかった方法は以降使わないように、書き出す方法を更新する
+ * 実際に書き出されたバイト列の長さを返す
  */
-u16 getChildren(Entry **childrenPointer[], const Entry *parent)
+u64 copyImage(const Image *image, s32 fd, u64 offset, u64 size, CopyMethod *methodPointer)
 {
-    *childrenPointer = NULL;
+    u64 copiedSize = 0;
 
-    if (!parent->directory)
+#ifdef HAS_KERNEL_COPY
+    while (copiedSize < size && *methodPointer != COPY_WRITE)
     {
-        return -1;
-    }
+        loff_t inOffset = offset + copiedSize;
+        size_t chunkSize = size - copiedSize < 0x40000000 ? size - copiedSize : 0x40000000;
+        ssize_t chunkCopiedSize;
+        switch (*methodPointer)
+        {
+        case COPY_FILE_RANGE:
+            chunkCopiedSize = copy_file_range(image->fd, &inOffset, fd, NULL, chunkSize, 0);
+            break;
+        case COPY_SPLICE:
+            chunkCopiedSize = splice(image->fd, &inOffset, fd, NULL, chunkSize, SPLICE_F_MOVE);
+            break;
+        default:
+            chunkCopiedSize = sendfile(fd, image->fd, &inOffset, chunkSize);
+            break;
+        }
 
-    u32 cluster = parent->cluster;
-    u32 maxEntryCount;
+        if (chunkCopiedSize > 0)
+        {
+            copiedSize += chunkCopiedSize;
+            continue;
+        }
+        if (chunkCopiedSize < 0 && errno == EINTR)
+        {
+            continue;
+        }
 
-    if (getIsRoot(parent))
-    {
-        fseek(parent->image->fp, parent->image->rootOffset, SEEK_SET);
-        maxEntryCount = parent->image->maxRootEntryCount;
-    }
-    else
-    {
-        seekTo(parent->image, cluster);
-        maxEntryCount = parent->image->maxSubEntryCount;
+        // この方法で書き出せなかったら、次の方法に切り替えて続きを書き出す
+        *methodPointer = *methodPointer == COPY_SENDFILE ? COPY_WRITE : COPY_SENDFILE;
     }
+#endif
 
-    // 読み込んだバイト列
-    u8 bytes[ENTRY_SIZE];
-
-    // エントリの名前
-    wchar_t *name = calloc(MAX_NAME_LENGTH, sizeof(wchar_t));
-
-    // 列挙されたエントリの個数
-    u16 count = 0;
-
-    while (TRUE)
+    // マッピングから、またはバッファに読み込んでから書き込む
+    u8 *buffer = NULL;
+    u64 bufferedSize = 0;
+    while (copiedSize < size)
     {
-        for (u32 i = 0; i < maxEntryCount; ++i)
+        const u8 *bytes;
+        u64 chunkSize = size - copiedSize;
+        if (image->map != NULL)
         {
-            // バイト列を読み込む
-            fread(bytes, sizeof(u8), ENTRY_SIZE, parent->image->fp);
-
-            if (bytes[0] == SKIPPED)
+            if (offset + copiedSize >= image->mapSize)
             {
                 break;
             }
-
-            if (bytes[0] == DELETED)
+            if (chunkSize > image->mapSize - offset - copiedSize)
             {
-                continue;
+                chunkSize = image->mapSize - offset - copiedSize;
             }
-
-            if (bytes[0] == ESCAPE_DELETED)
+            bytes = image->map + offset + copiedSize;
+        }
+        else
+        {
+            if (buffer == NULL && (buffer = malloc(COPY_BUFFER_SIZE)) == NULL)
             {
-                bytes[0] = DELETED;
+                break;
             }
-
-            if (bytes[11] == LONG_NAME)
+            chunkSize = __readImage(image, buffer, offset + copiedSize, chunkSize < COPY_BUFFER_SIZE ? chunkSize : COPY_BUFFER_SIZE);
+            if (chunkSize == 0)
             {
-                // 読み込んだバイト列が長い名前の一部であれば、それが表す名前をエントリの名前に逆順で追加する
-                wchar_t subName[14];
-                subName[13] = '\0';
-
-                for (u8 j = 0; j < 2; ++j)
-                {
-                    subName[j] = get16(bytes, 30 - j * 2);
-                }
-
-                for (u8 j = 0; j < 6; ++j)
-                {
-                    subName[2 + j] = get16(bytes, 24 - j * 2);
-                }
-
-                for (u8 j = 0; j < 5; ++j)
-                {
-                    subName[8 + j] = get16(bytes, 9 - j * 2);
-                }
-
-                // 長い名前の最初のエントリの場合、末尾まで空白で埋める
-                if ((bytes[0] & FIRST_ENTRY_OF_LONG_NAME) != 0)
-                {
-                    u8 index = 0;
-                    for (; subName[index] != '\0'; ++index)
-                    {
-                        subName[index] = ' ';
-                    }
-                    subName[index] = ' ';
-                }
+                break;
+            }
+            bytes = buffer;
+        }
 
-                wcscat(name, subName);
+        u64 writtenSize = 0;
+        while (writtenSize < chunkSize)
+        {
+            ssize_t chunkWrittenSize = write(fd, bytes + writtenSize, chunkSize - writtenSize);
+            if (chunkWrittenSize < 0 && errno == EINTR)
+            {
+                continue;
             }
-            else
+            if (chunkWrittenSize <= 0)
             {
-                if (wcslen(name) == 0)
-                {
-                    // エントリが短い名前だったら
-
-                    // 拡張子を除いた名前を取得する
-                    wchar_t basename[9];
-                    basename[8] = '\0';
-                    for (u8 j = 0; j < 8; ++j)
-                    {
-                        basename[j] = bytes[j];
-                    }
-                    trimEnd(basename, 8);
-                    wcscat(name, basename);
-
-                    if ((bytes[11] & ARCHIVE) != 0)
-                    {
-                        wcscat(name, L".");
-                    }
-
-                    // 拡張子を取得する
-                    wchar_t extension[4];
-                    extension[3] = '\0';
-                    for (u8 j = 0; j < 3; ++j)
-                    {
-                        extension[j] = bytes[8 + j];
-                    }
-                    trimEnd(extension, 3);
-                    wcscat(name, extension);
-
-                    // エントリの名前を実際の長さに切り詰める
-                    s32 length = shortenString(&name);
-                    if (length < 0)
-                    {
-                        break;
-                    }
-                }
-                else
-                {
-                    // エントリが長い名前だったら
-
-                    // エントリの名前を実際の長さに切り詰める
-                    s32 length = shortenString(&name);
-                    if (length < 0)
-                    {
-                        break;
-                    }
-
-                    // 逆順でつなげたエントリの名前の順番を反転する
-                    reverseString(name, length);
-                    trimEnd(name, length);
-                }
-
-                Entry *child;
-                Result result = __openEntry(&child, parent->image, name, bytes);
-                if (result)
-                {
-                    break;
-                }
-
-                count++;
-
-                // 新たなエントリの名前の領域を確保する
-                name = calloc(MAX_NAME_LENGTH, sizeof(wchar_t));
+                break;
             }
+            writtenSize += chunkWrittenSize;
+        }
+        copiedSize += writtenSize;
+        if (bytes == buffer)
+        {
+            bufferedSize += writtenSize;
         }
 
-        // 最後のクラスタに到達していたらループを抜け出す
-        if (cluster < CLUSTER_START || cluster > parent->image->clusterEnd)
+        if (writtenSize < chunkSize)
         {
             break;
         }
+    }
+
+    free(buffer);
+
+    // バッファに読み込んだ分は、読み込んだときに数えている
+    addStat(&image->stats->readCount, 1);
+    addStat(&image->stats->readByteCount, copiedSize - bufferedSize);
+    return copiedSize;
+}
+#endif
+
+/**
+ * 指定されたクラスタから始まる、データ領域上で連続したクラスタの並びを直接参照する
+ * 並びの先頭を指すポインタを設定し、並びのバイト数を返す
+ * FATイメージがマッピングされていない場合は0を返す
+ */
+u64 getClusterRun(const u8 **bytesPointer, const Image *image, u32 cluster)
+{
+    *bytesPointer = NULL;
 
-        cluster = parent->image->getNextCluster(parent->image, cluster);
-        seekTo(parent->image, cluster);
+    if (image->map == NULL || cluster < CLUSTER_START || cluster > image->clusterEnd)
+    {
+        return 0;
     }
 
-    free(name);
+    // 次のクラスタが隣接している限り並びを伸ばす
+    u32 count = 1;
+    u32 nextCluster = image->getNextCluster(image, cluster);
+    while (nextCluster == cluster + count)
+    {
+        ++count;
+        nextCluster = image->getNextCluster(image, nextCluster);
+    }
+    addFatLookupStat(image, count);
 
-    // FATイメージの開いているエントリのリストから子エントリを取得する。
-    Entry **children = *childrenPointer = malloc(count * sizeof(Entry *));
-    Entry *child = parent->image->openedEntry;
-    for (s32 i = count - 1; i >= 0; --i)
+    // マッピングの範囲に収める
+    u64 offset = getDataOffset(image, cluster);
+    if (offset >= image->mapSize)
+    {
+        return 0;
+    }
+    u64 size = (u64)image->clusterSize * count;
+    if (size > image->mapSize - offset)
     {
-        children[i] = child;
-        child = child->nextOpenedEntry;
+        size = image->mapSize - offset;
     }
 
-    return count;
+    *bytesPointer = image->map + offset;
+    return size;
 }
-#pragma endregion
 
-#pragma region File
 /**
- * 指定されたエントリのポインタを開く
+ * 指定されたクラスタから始まるチェーンを、連続したクラスタの並びに分割する
+ * チェーンの終端か、指定されたクラスタ数に達するまでたどる
  * 成功したら0、それ以外の場合は0以外を返す
  */
-Result openFile(File **filePointer, Entry *entry)
+Result getExtents(Extent **extentsPointer, u32 *countPointer, const Image *image, u32 cluster, u32 maxClusterCount)
 {
-    *filePointer = NULL;
+    *extentsPointer = NULL;
+    *countPointer = 0;
 
-    if (!entry->file)
-    {
-        return 1;
-    }
+    Extent *extents = NULL;
+    u32 count = 0;
+    u32 capacity = 0;
 
-    // ポインタの領域を確保する
-    File *file = *filePointer = malloc(sizeof(File));
-    if (file == NULL)
+    u32 clusterCount = 0;
+    while (clusterCount < maxClusterCount && cluster >= CLUSTER_START && cluster <= image->clusterEnd)
     {
-        return 2;
-    }
+        if (count > 0 && extents[count - 1].cluster + extents[count - 1].length == cluster)
+        {
+            // 直前の並びに隣接していたら並びを伸ばす
+            extents[count - 1].length++;
+        }
+        else
+        {
+            // 隣接していなければ新たな並びを追加する
+            if (count == capacity)
+            {
+                capacity = capacity == 0 ? 4 : capacity * 2;
+                Extent *newExtents = realloc(extents, capacity * sizeof(Extent));
+                if (newExtents == NULL)
+                {
+                    free(extents);
+                    return FAT_ERROR_NO_MEMORY;
+                }
+                extents = newExtents;
+            }
 
-    // メンバを初期化する
-    file->entry = entry;
-    file->nextOpenedFile = entry->openedFile;
-    entry->openedFile = file;
+            extents[count].cluster = cluster;
+            extents[count].length = 1;
+            extents[count].index = clusterCount;
+            count++;
+        }
 
-    file->position = 0;
-    file->cluster = entry->cluster;
+        clusterCount++;
+        cluster = image->getNextCluster(image, cluster);
+    }
+    addFatLookupStat(image, clusterCount);
 
+    *extentsPointer = extents;
+    *countPointer = count;
     return 0;
 }
 
-// ポインタを閉じる
-void closeFile(File *file)
+// 12ビットのFATから次のクラスタ番号を取得する
+u32 getNextCluster12(const Image *image, u32 cluster)
 {
-    // エントリの開いているポインタからポインタを除外する
-    if (file->entry->openedFile == file)
+    // FAT領域のクラスタ番号が表す部分の値を3バイト分取得する
+    u32 offset = image->fatOffset + cluster / 2 * 3;
+    u8 bytes[3] = {0};
+    readImage(image, bytes, offset, sizeof(bytes));
+    u32 v0 = bytes[0];
+    u32 v1 = bytes[1];
+    u32 v2 = bytes[2];
+
+    u16 v;
+    if (cluster % 2 == 0)
     {
-        file->entry->openedFile = file->nextOpenedFile;
+        // クラスタ番号が偶数の場合は下位12ビットを取得する
+        v = (v0 | (v1 << 8));
     }
     else
     {
-        File *prevOpenedFile = file->entry->openedFile;
-        while (prevOpenedFile->nextOpenedFile != file)
-        {
-            prevOpenedFile = prevOpenedFile->nextOpenedFile;
-        }
-        prevOpenedFile->nextOpenedFile = file->nextOpenedFile;
+        // クラスタ番号が奇数の場合は上位12ビットを取得する
+        v = ((v1 >> 4) | (v2 << 4));
     }
+    return v & 0xfff;
+}
 
-    free(file);
+// 16ビットのFATから次のクラスタ番号を取得する
+u32 getNextCluster16(const Image *image, u32 cluster)
+{
+    u32 offset = image->fatOffset + cluster * 2;
+    u8 bytes[2] = {0};
+    readImage(image, bytes, offset, sizeof(bytes));
+    return get16(bytes, 0);
 }
 
-/**
- * 指定されたポインタから、指定された長さのバイト列を読み込む
- * 実際に読み込まれたバイト列の長さを返す
- */
-u32 readFile(u8 *bytes, u32 size, File *file)
+// 32ビットのFATから次のクラスタ番号を取得する
+u32 getNextCluster32(const Image *image, u32 cluster)
 {
-    if (size == 0)
-    {
-        return 0;
-    }
+    u32 offset = image->fatOffset + cluster * 4;
+    u8 bytes[4] = {0};
+    readImage(image, bytes, offset, sizeof(bytes));
+    return get32(bytes, 0) & 0x0FFFFFFF;
+}
 
-    // ポインタがファイルの終端に達していたら
-    if (file->position == file->entry->size)
+// 展開したテーブルから次のクラスタ番号を取得する
+u32 getNextClusterFromTable(const Image *image, u32 cluster)
+{
+    // FATの範囲外のクラスタはチェーンの終端として扱う
+    if (cluster >= image->clusterCount)
     {
-        return 0;
+        return image->clusterEnd + 1;
     }
+    return image->fatTable[cluster];
+}
+
+#ifdef HAS_SSSE3
+/**
+ * 12ビットのFATのバイト列から、SSSE3で8エントリずつ取り出す
+ * 取り出したエントリ数を返す
+ */
+__attribute__((target("ssse3"))) u32 unpackFat12Ssse3(u32 *table, const u8 *bytes, u64 size, u32 count)
+{
+    u32 i = 0;
+
+    // 12バイトから8エントリを取り出す（読み込みは16バイト単位なので余裕を残す）
+    const __m128i shuffle = _mm_setr_epi8(0, 1, 1, 2, 3, 4, 4, 5, 6, 7, 7, 8, 9, 10, 10, 11);
+    const __m128i lowMask = _mm_setr_epi16(0x0fff, 0, 0x0fff, 0, 0x0fff, 0, 0x0fff, 0);
+    const __m128i highMask = _mm_setr_epi16(0, 0x0fff, 0, 0x0fff, 0, 0x0fff, 0, 0x0fff);
+    const __m128i zero = _mm_setzero_si128();
 
-    // FATイメージのファイルポインタの位置をポインタに合わせる
-    u64 dataOffset = getDataOffset(file->entry->image, file->cluster);
-    u32 positionOffset = file->position % file->entry->image->clusterSize;
-    u64 fileOffset = dataOffset + positionOffset;
-    if (ftell(file->entry->image->fp) != fileOffset)
+    for (; i + 8 <= count && i / 2 * 3 + 16 <= size; i += 8)
     {
-        fseek(file->entry->image->fp, fileOffset, SEEK_SET);
+        __m128i packed = _mm_loadu_si128((const __m128i *)(bytes + i / 2 * 3));
+        __m128i pairs = _mm_shuffle_epi8(packed, shuffle);
+
+        // 偶数番目は下位12ビット、奇数番目は上位12ビットを取り出す
+        __m128i even = _mm_and_si128(pairs, lowMask);
+        __m128i odd = _mm_and_si128(_mm_srli_epi16(pairs, 4), highMask);
+        __m128i values = _mm_or_si128(even, odd);
+
+        _mm_storeu_si128((__m128i *)(table + i), _mm_unpacklo_epi16(values, zero));
+        _mm_storeu_si128((__m128i *)(table + i + 4), _mm_unpackhi_epi16(values, zero));
     }
+    return i;
+}
+#endif
+
+/**
+ * 12ビットのFATを展開する
+ * 3バイトに2つのエントリが詰め込まれているので、まとめて取り出す
+ */
+void unpackFat12(u32 *table, const u8 *bytes, u64 size, u32 count)
+{
+    u32 i = 0;
 
-    // 指定されたバイト列の長さがポインタの読み込める範囲を超えていたら、範囲に収まるようにする
-    s64 surplus = (s64)(file->position + size) - file->entry->size;
-    if (surplus > 0)
+#ifdef HAS_SSSE3
+    if (__builtin_cpu_supports("ssse3"))
     {
-        size -= surplus;
+        i = unpackFat12Ssse3(table, bytes, size, count);
     }
+#else
+    (void)size;
+#endif
 
-    // クラスタごとにバイト列を読み込む
-    u32 newPositionOffset = positionOffset + size;
-    u32 clusterCount = newPositionOffset / file->entry->image->clusterSize;
-    if (clusterCount == 0)
+    // 残りのエントリを1つずつ取り出す
+    for (; i < count; ++i)
     {
-        // 読み込む範囲が現在のクラスタに収まっている場合
-        fread(bytes, sizeof(u8), size, file->entry->image->fp);
+        const u8 *v = bytes + i / 2 * 3;
+        if (i % 2 == 0)
+        {
+            table[i] = (v[0] | (v[1] << 8)) & 0xfff;
+        }
+        else
+        {
+            table[i] = ((v[1] >> 4) | (v[2] << 4)) & 0xfff;
+        }
     }
-    else
-    {
-        // 読み込む範囲が複数のクラスタにまたがっている場合
-
-        // 現在のクラスタの残りのバイト列を読み込む
-        u32 readSize = file->entry->image->clusterSize - positionOffset;
-        fread(bytes, sizeof(u8), readSize, file->entry->image->fp);
-        bytes += readSize;
+}
 
-        // 読み込む範囲に完全に含まれているクラスタからバイト列を読み込む
-        readSize = file->entry->image->clusterSize;
-        for (u32 i = 1; i < clusterCount; ++i)
+/**
+ * FAT領域を一度に読み込み、次のクラスタ番号のテーブルに展開する
+ * 成功したら0、それ以外の場合は0以外を返す
+ */
+Result loadFatTable(Image *image)
+{
+    // マッピングされていない場合は、FAT領域を読み込むバッファを確保する
+    u8 *buffer = NULL;
+    if (image->map == NULL)
+    {
+        buffer = malloc(image->fatSize);
+        if (buffer == NULL)
         {
-            file->cluster = file->entry->image->getNextCluster(file->entry->image, file->cluster);
-            seekTo(file->entry->image, file->cluster);
-            fread(bytes, sizeof(u8), readSize, file->entry->image->fp);
-            bytes += readSize;
+            return 1;
         }
+    }
 
-        // 読み込むべきクラスタのうち、最後のクラスタからバイト列を読み込む
-        file->cluster = file->entry->image->getNextCluster(file->entry->image, file->cluster);
-        seekTo(file->entry->image, file->cluster);
-        readSize = newPositionOffset % file->entry->image->clusterSize;
-        fread(bytes, sizeof(u8), readSize, file->entry->image->fp);
+    u32 *table = malloc((u64)image->clusterCount * sizeof(u32));
+    if (table == NULL)
+    {
+        free(buffer);
+        return 2;
     }
 
-    file->position += size;
+    // FAT領域を一度に読み込む
+    const u8 *bytes = viewImage(image, buffer, image->fatOffset, image->fatSize);
+    if (bytes == NULL)
+    {
+        free(table);
+        free(buffer);
+        return 3;
+    }
 
-    if (file->position % file->entry->image->clusterSize == 0)
+    u32 count = image->clusterCount;
+    switch (image->fatType)
     {
-        // 現在のクラスタの終端に達していたら、次のクラスタに移る
-        file->cluster = file->entry->image->getNextCluster(file->entry->image, file->cluster);
+    case FAT12:
+        unpackFat12(table, bytes, image->fatSize, count);
+        break;
+    case FAT16:
+        for (u32 i = 0; i < count; ++i)
+        {
+            table[i] = bytes[i * 2] | (bytes[i * 2 + 1] << 8);
+        }
+        break;
+    default:
+        for (u32 i = 0; i < count; ++i)
+        {
+            table[i] = get32(bytes + i * 4, 0) & 0x0FFFFFFF;
+        }
+        break;
     }
 
-    return size;
+    free(buffer);
+    image->fatTable = table;
+    return 0;
 }
 #pragma endregion
 
-#pragma region Main utilities
-// ヘルプを表示する
-void printHelp()
+#pragma region Volume usage
+// データ領域のクラスタの使用状況
+typedef struct __VolumeUsage
 {
-    printf("Available commands:\n");
-    printf("  cd PATH\tChange current directory\n");
-    printf("  ls [PATH]\tList child entries\n");
-    printf("  tree [PATH]\tList descendant entries\n");
-    printf("  info [PATH]\tShow entry information\n");
-    printf("  cat [PATH]\tShow entry data\n");
-    printf("  help\tShow this help\n");
-    printf("  exit\tStop program\n");
-}
+    // データ領域のクラスタ数
+    u32 clusterCount;
+
+    // 空き、使用中、不良、予約済みのクラスタ数
+    u32 freeCount;
+    u32 usedCount;
+    u32 badCount;
+    u32 reservedCount;
+
+    /**
+     * FSInfoの記録から求めたかどうか
+     * 求めた場合は不良と予約済みを区別せず、空いていないクラスタをすべて使用中として数える
+     */
+    Boolean fromFsInfo;
+} VolumeUsage;
+
+/**
+ * FSInfoの空きクラスタ数の記録が、FATの大きさと矛盾していないかどうか
+ * FATを走査せずに確かめられる範囲でのみ判定する
+ */
+Boolean hasConsistentFsInfo(const Image *image)
+{
+    if (image->fsInfoFreeCount == FSINFO_UNKNOWN || image->clusterCount < CLUSTER_START ||
+        image->fsInfoFreeCount > image->clusterCount - CLUSTER_START)
+    {
+        return FALSE;
+    }
+    return image->fsInfoNextFree == FSINFO_UNKNOWN ||
+           (image->fsInfoNextFree >= CLUSTER_START && image->fsInfoNextFree < image->clusterCount);
+}
+
+/**
+ * FATのエントリの値を空き、不良、予約済み、使用中に分けて数え、使用状況に加える
+ * FAT12とFAT16の値も32ビットに広げて渡す
+ */
+void countClusterValues(VolumeUsage *usage, const u32 *values, u32 count, u32 clusterEnd)
+{
+    // 予約済みの値は1と、クラスタ番号の上限の直前の7つ、不良の値は上限の次
+    u32 badValue = clusterEnd + 1;
+    u32 reservedStart = clusterEnd - 6;
+
+    u32 freeCount = 0;
+    u32 badCount = 0;
+    u32 reservedCount = 0;
+    u32 i = 0;
+
+#ifdef __SSE2__
+    const __m128i mask = _mm_set1_epi32(0x0FFFFFFF);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi32(1);
+    const __m128i bad = _mm_set1_epi32(badValue);
+
+    // 符号なしの範囲の判定を符号付きの比較で行うため、符号ビットを反転させる
+    const __m128i bias = _mm_set1_epi32(0x80000000);
+    const __m128i reservedLow = _mm_set1_epi32((reservedStart - 1) ^ 0x80000000);
+    const __m128i reservedHigh = _mm_set1_epi32(badValue ^ 0x80000000);
+
+    // 一致したレーンは-1になるので、引くことでレーンごとに数える
+    __m128i frees = zero;
+    __m128i bads = zero;
+    __m128i reserveds = zero;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i v = _mm_and_si128(_mm_loadu_si128((const __m128i *)(values + i)), mask);
+        frees = _mm_sub_epi32(frees, _mm_cmpeq_epi32(v, zero));
+        bads = _mm_sub_epi32(bads, _mm_cmpeq_epi32(v, bad));
+
+        __m128i biased = _mm_xor_si128(v, bias);
+        __m128i inRange = _mm_and_si128(_mm_cmpgt_epi32(biased, reservedLow), _mm_cmplt_epi32(biased, reservedHigh));
+        reserveds = _mm_sub_epi32(reserveds, _mm_or_si128(inRange, _mm_cmpeq_epi32(v, one)));
+    }
+
+    u32 lanes[3][4];
+    _mm_storeu_si128((__m128i *)lanes[0], frees);
+    _mm_storeu_si128((__m128i *)lanes[1], bads);
+    _mm_storeu_si128((__m128i *)lanes[2], reserveds);
+    for (u8 j = 0; j < 4; ++j)
+    {
+        freeCount += lanes[0][j];
+        badCount += lanes[1][j];
+        reservedCount += lanes[2][j];
+    }
+#endif
+
+    // 残りの値を1つずつ数える
+    for (; i < count; ++i)
+    {
+        u32 v = values[i] & 0x0FFFFFFF;
+        if (v == 0)
+        {
+            freeCount++;
+        }
+        else if (v == badValue)
+        {
+            badCount++;
+        }
+        else if (v == 1 || (v >= reservedStart && v <= clusterEnd))
+        {
+            reservedCount++;
+        }
+    }
+
+    usage->freeCount += freeCount;
+    usage->badCount += badCount;
+    usage->reservedCount += reservedCount;
+    usage->usedCount += count - freeCount - badCount - reservedCount;
+}
+
+/**
+ * 指定された番号のFATの、指定された範囲のエントリを読み込み、32ビットの値の並びとして参照する
+ * 最初のFATを展開したテーブルがあればテーブルを直接指し、それ以外の場合は指定されたバッファに展開して指す
+ * FAT12の場合は開始位置を偶数にする
+ * 読み込めなかった場合はNULLを返す
+ */
+const u32 *viewFatValues(const Image *image, u32 *values, u8 *buffer, u8 fatIndex, u32 start, u32 count)
+{
+    if (image->fatTable != NULL && fatIndex == 0)
+    {
+        return image->fatTable + start;
+    }
+
+    u64 offset;
+    u64 size;
+    switch (image->fatType)
+    {
+    case FAT12:
+        offset = (u64)start / 2 * 3;
+        size = ((u64)count + 1) / 2 * 3;
+        break;
+    case FAT16:
+        offset = (u64)start * 2;
+        size = (u64)count * 2;
+        break;
+    default:
+        offset = (u64)start * 4;
+        size = (u64)count * 4;
+        break;
+    }
+    if (offset + size > image->fatSize)
+    {
+        size = image->fatSize - offset;
+    }
+    offset += image->fatOffset + image->fatSize * fatIndex;
+
+    // FATを一度だけ走査するので、ブロックのキャッシュを通さずに読み込む
+    const u8 *bytes;
+    if (image->map != NULL)
+    {
+        if (offset > image->mapSize || size > image->mapSize - offset)
+        {
+            return NULL;
+        }
+        bytes = image->map + offset;
+    }
+    else
+    {
+        if (__readImage(image, buffer, offset, size) != size)
+        {
+            return NULL;
+        }
+        bytes = buffer;
+    }
+
+    switch (image->fatType)
+    {
+    case FAT12:
+        unpackFat12(values, bytes, size, count);
+        break;
+    case FAT16:
+        for (u32 i = 0; i < count; ++i)
+        {
+            values[i] = bytes[i * 2] | (bytes[i * 2 + 1] << 8);
+        }
+        break;
+    default:
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        // リトルエンディアンの環境では、FAT32のエントリをそのまま32ビットの値として参照できる
+        if ((u64)bytes % sizeof(u32) == 0)
+        {
+            return (const u32 *)bytes;
+        }
+#endif
+        for (u32 i = 0; i < count; ++i)
+        {
+            values[i] = get32(bytes + (u64)i * 4, 0);
+        }
+        break;
+    }
+    return values;
+}
+
+typedef struct __FatScanTask FatScanTask;
+
+// FATのチャンクを走査する関数、チャンクの開始位置とエントリ数を受け取る
+typedef void (*FatScanFunction)(FatScanTask *task, u32 start, u32 count);
+
+// FATの一部の範囲を走査する作業
+typedef struct __FatScanTask
+{
+    // 走査するFATイメージ
+    const Image *image;
+
+    // 走査するエントリの範囲
+    u32 start;
+    u32 end;
+
+    // チャンクごとに呼び出す関数と、関数に渡す値
+    FatScanFunction scan;
+    void *context;
+
+    // チャンクを展開する作業用のバッファ（2つのFATを比べられるように2組用意する）
+    u32 *values[2];
+    u8 *buffers[2];
+
+    // 範囲の使用状況
+    VolumeUsage usage;
+
+    // 範囲で見つかった数
+    u64 count;
+
+    // 走査の結果
+    Result result;
+
+#ifdef HAS_POSIX_IO
+    // 走査するスレッドと、スレッドを作成できたかどうか
+    pthread_t thread;
+    Boolean started;
+#endif
+} FatScanTask;
+
+/**
+ * 作業に指定された範囲のFATを、チャンクごとに関数に渡して走査する
+ * スレッドの開始関数としても使う
+ */
+void *runFatScan(void *argument)
+{
+    FatScanTask *task = argument;
+
+    for (u8 i = 0; i < 2; ++i)
+    {
+        task->values[i] = malloc(FAT_SCAN_CHUNK_COUNT * sizeof(u32));
+        task->buffers[i] = malloc(FAT_SCAN_CHUNK_COUNT * sizeof(u32));
+    }
+
+    if (task->values[0] == NULL || task->values[1] == NULL || task->buffers[0] == NULL || task->buffers[1] == NULL)
+    {
+        task->result = 1;
+    }
+
+    for (u32 start = task->start; start < task->end && task->result == 0; start += FAT_SCAN_CHUNK_COUNT)
+    {
+        u32 count = task->end - start < FAT_SCAN_CHUNK_COUNT ? task->end - start : FAT_SCAN_CHUNK_COUNT;
+        task->scan(task, start, count);
+    }
+
+    for (u8 i = 0; i < 2; ++i)
+    {
+        free(task->values[i]);
+        free(task->buffers[i]);
+    }
+    return NULL;
+}
+
+/**
+ * データ領域のクラスタに対応するFATのエントリを、チャンクごとに指定された関数に渡して走査する
+ * 指定された数以上のクラスタがあれば複数のスレッドに分けて走査し、作業ごとの結果を作業の配列として返す
+ * 作業の配列は呼び出し元がfreeで解放する
+ * 成功したら0、それ以外の場合は0以外を返す
+ */
+Result scanFat(FatScanTask **tasksPointer, u32 *countPointer, const Image *image, u32 parallelCount, FatScanFunction scan, void *context)
+{
+    *tasksPointer = NULL;
+    *countPointer = 0;
+
+    u32 clusterCount = image->clusterCount > CLUSTER_START ? image->clusterCount - CLUSTER_START : 0;
+
+    u32 taskCount = 1;
+#ifdef HAS_POSIX_IO
+    if (clusterCount >= parallelCount)
+    {
+        long processorCount = sysconf(_SC_NPROCESSORS_ONLN);
+        u32 maxTaskCount = clusterCount / (parallelCount / 4);
+        taskCount = processorCount > 1 ? processorCount : 1;
+        taskCount = taskCount < maxTaskCount ? taskCount : maxTaskCount;
+    }
+#endif
+
+    FatScanTask *tasks = calloc(taskCount, sizeof(FatScanTask));
+    if (tasks == NULL)
+    {
+        return 1;
+    }
+
+    // 作業の範囲の境界は、FAT12の3バイトの区切りとチャンクに合わせる
+    u32 chunkCount = (clusterCount + FAT_SCAN_CHUNK_COUNT - 1) / FAT_SCAN_CHUNK_COUNT;
+    for (u32 i = 0; i < taskCount; ++i)
+    {
+        tasks[i].image = image;
+        tasks[i].scan = scan;
+        tasks[i].context = context;
+        tasks[i].start = CLUSTER_START + (u64)chunkCount * i / taskCount * FAT_SCAN_CHUNK_COUNT;
+        tasks[i].end = CLUSTER_START + (u64)chunkCount * (i + 1) / taskCount * FAT_SCAN_CHUNK_COUNT;
+        if (tasks[i].end > CLUSTER_START + clusterCount || i == taskCount - 1)
+        {
+            tasks[i].end = CLUSTER_START + clusterCount;
+        }
+    }
+
+#ifdef HAS_POSIX_IO
+    // 最初の作業は呼び出したスレッドで走査し、スレッドを作成できなかった作業も同様に走査する
+    for (u32 i = 1; i < taskCount; ++i)
+    {
+        tasks[i].started = pthread_create(&tasks[i].thread, NULL, runFatScan, &tasks[i]) == 0;
+    }
+    runFatScan(&tasks[0]);
+    for (u32 i = 1; i < taskCount; ++i)
+    {
+        if (tasks[i].started)
+        {
+            pthread_join(tasks[i].thread, NULL);
+        }
+        else
+        {
+            runFatScan(&tasks[i]);
+        }
+    }
+#else
+    runFatScan(&tasks[0]);
+#endif
+
+    *tasksPointer = tasks;
+    *countPointer = taskCount;
+    return 0;
+}
+
+// FATのチャンクに含まれるクラスタを、空き、不良、予約済み、使用中に分けて数える
+void countFatChunk(FatScanTask *task, u32 start, u32 count)
+{
+    const u32 *values = viewFatValues(task->image, task->values[0], task->buffers[0], 0, start, count);
+    if (values == NULL)
+    {
+        task->result = 2;
+        return;
+    }
+    countClusterValues(&task->usage, values, count, task->image->clusterEnd);
+}
+
+/**
+ * FATの走査を関数に渡して行い、作業ごとに見つかった数の和を返す
+ * 読み込めなかった範囲があれば、結果を0以外に設定する
+ */
+u64 countFatScan(Result *resultPointer, const Image *image, u32 parallelCount, FatScanFunction scan, void *context)
+{
+    FatScanTask *tasks;
+    u32 taskCount;
+    if (scanFat(&tasks, &taskCount, image, parallelCount, scan, context))
+    {
+        *resultPointer = 1;
+        return 0;
+    }
+
+    u64 count = 0;
+    for (u32 i = 0; i < taskCount; ++i)
+    {
+        count += tasks[i].count;
+        if (tasks[i].result != 0)
+        {
+            *resultPointer = 2;
+        }
+    }
+
+    free(tasks);
+    return count;
+}
+
+/**
+ * データ領域のクラスタの使用状況を求める
+ * FSInfoを使う場合、記録が矛盾していなければFATを走査せずに記録から求める
+ * それ以外の場合はFAT全体を走査し、大きなFATは複数のスレッドに分けて走査する
+ * 成功したら0、それ以外の場合は0以外を返す
+ */
+Result getVolumeUsage(VolumeUsage *usage, const Image *image, Boolean useFsInfo)
+{
+    memset(usage, 0, sizeof(VolumeUsage));
+    if (image->clusterCount <= CLUSTER_START)
+    {
+        return 0;
+    }
+    usage->clusterCount = image->clusterCount - CLUSTER_START;
+
+    if (useFsInfo && hasConsistentFsInfo(image))
+    {
+        usage->freeCount = image->fsInfoFreeCount;
+        usage->usedCount = usage->clusterCount - usage->freeCount;
+        usage->fromFsInfo = TRUE;
+        return 0;
+    }
+
+    FatScanTask *tasks;
+    u32 taskCount;
+    if (scanFat(&tasks, &taskCount, image, FAT_SCAN_PARALLEL_COUNT, countFatChunk, NULL))
+    {
+        return 1;
+    }
+
+    Result result = 0;
+    for (u32 i = 0; i < taskCount; ++i)
+    {
+        usage->freeCount += tasks[i].usage.freeCount;
+        usage->usedCount += tasks[i].usage.usedCount;
+        usage->badCount += tasks[i].usage.badCount;
+        usage->reservedCount += tasks[i].usage.reservedCount;
+        if (tasks[i].result != 0)
+        {
+            result = 2;
+        }
+    }
+
+    free(tasks);
+    addFatLookupStat(image, usage->clusterCount);
+    return result;
+}
+#pragma endregion
+
+#pragma region Entry
+s32 getChildren(Entry **children[], const Entry *parent);
+Result openDir(Directory **directoryPointer, const Entry *parent);
+Result readDir(const Entry **entryPointer, Directory *directory);
+void closeDir(Directory *directory);
+u32 findCatalogPath(const Catalog *catalog, u32 base, const char *path);
+Result openCatalogEntry(Entry **entryPointer, Image *image, u32 index, Arena *arena);
+
+// ディレクトリエントリのバイト列から最初のクラスタ番号を読み取る
+u32 getRecordCluster(const u8 *bytes)
+{
+    u32 higherCluster = get16(bytes, 20);
+    u32 lowerCluster = get16(bytes, 26);
+    return (higherCluster << 16) | lowerCluster;
+}
+
+// エントリにディレクトリエントリのバイト列を設定する
+void setEntryRecord(Entry *entry, const u8 *bytes)
+{
+    memcpy(entry->record, bytes, ENTRY_SIZE);
+    entry->size = get32(bytes, 28);
+    entry->cluster = getRecordCluster(bytes);
+}
+
+// エントリが指定された属性ビットを持つかどうか
+Boolean hasAttribute(const Entry *entry, u8 attribute)
+{
+    return (get8(entry->record, 11) & attribute) != 0;
+}
+
+// エントリの作成日時を読み取る
+void getCreatedAt(Datetime *datetime, const Entry *entry)
+{
+    initDatetime(datetime, get16(entry->record, 16), get16(entry->record, 14), get8(entry->record, 13));
+}
+
+// エントリの更新日時を読み取る
+void getModifiedAt(Datetime *datetime, const Entry *entry)
+{
+    initDatetime(datetime, get16(entry->record, 24), get16(entry->record, 22), 0);
+}
+
+// エントリのアクセス日時を読み取る
+void getAccessedAt(Datetime *datetime, const Entry *entry)
+{
+    initDatetime(datetime, get16(entry->record, 18), 0, 0);
+}
+
+// エントリをFATイメージの開いているエントリの先頭に加える
+void linkOpenedEntry(Image *image, Entry *entry)
+{
+    lockImage(image);
+    entry->prevOpenedEntry = NULL;
+    entry->nextOpenedEntry = image->openedEntry;
+    if (image->openedEntry != NULL)
+    {
+        image->openedEntry->prevOpenedEntry = entry;
+    }
+    image->openedEntry = entry;
+    unlockImage(image);
+}
+
+// エントリをFATイメージの開いているエントリから除外する
+void unlinkOpenedEntry(Image *image, Entry *entry)
+{
+    lockImage(image);
+    if (entry->prevOpenedEntry == NULL)
+    {
+        image->openedEntry = entry->nextOpenedEntry;
+    }
+    else
+    {
+        entry->prevOpenedEntry->nextOpenedEntry = entry->nextOpenedEntry;
+    }
+    if (entry->nextOpenedEntry != NULL)
+    {
+        entry->nextOpenedEntry->prevOpenedEntry = entry->prevOpenedEntry;
+    }
+    unlockImage(image);
+}
+
+/**
+ * エントリと名前の領域を確保する
+ * アリーナが指定されていれば、アリーナから切り出す
+ * 成功したら0、それ以外の場合は0以外を返す
+ */
+Result allocateEntry(Entry **entryPointer, const char *name, Arena *arena)
+{
+    Entry *entry = *entryPointer = allocateFrom(arena, sizeof(Entry));
+    char *nameCopy = entry == NULL ? NULL : allocateFrom(arena, strlen(name) + 1);
+    if (nameCopy == NULL)
+    {
+        if (arena == NULL)
+        {
+            free(entry);
+        }
+        *entryPointer = NULL;
+        return FAT_ERROR_NO_MEMORY;
+    }
+
+    strcpy(nameCopy, name);
+    entry->name = nameCopy;
+    entry->arena = arena;
+    if (arena != NULL)
+    {
+        retainArena(arena);
+    }
+
+    return 0;
+}
+
+/**
+ * 指定されたイメージ、名前、バイト列でエントリを作成する
+ * アリーナが指定されていれば、エントリと名前をアリーナから切り出す
+ * 成功したら0、それ以外の場合は0以外を返す
+ */
+Result __openEntry(Entry **entryPointer, Image *image, const char *name, const u8 *bytes, Arena *arena)
+{
+    // エントリと名前の領域を確保する
+    Result result = allocateEntry(entryPointer, name, arena);
+    if (result)
+    {
+        return result;
+    }
+    Entry *entry = *entryPointer;
+
+    // メンバを初期化する
+    entry->image = image;
+    entry->openedFile = NULL;
+    entry->catalogIndex = NO_CATALOG_INDEX;
+
+    setEntryRecord(entry, bytes);
+
+    linkOpenedEntry(image, entry);
+
+    addStat(&image->stats->entryCount, 1);
+    return 0;
+}
+
+/**
+ * 指定されたエントリを、FATイメージの開いているエントリに加えずにコピーする
+ * アリーナが指定されていれば、エントリと名前をアリーナから切り出す
+ * 成功したら0、それ以外の場合は0以外を返す
+ */
+Result __copyEntry(Entry **copyPointer, const Entry *base, Arena *arena)
+{
+    // エントリと名前の領域を確保する
+    Result result = allocateEntry(copyPointer, base->name, arena);
+    if (result)
+    {
+        return result;
+    }
+    Entry *copy = *copyPointer;
+
+    // 開いているエントリの連結は他のスレッドから書き換えられるので、連結以外のメンバだけをコピーする
+    copy->image = base->image;
+    copy->prevOpenedEntry = NULL;
+    copy->nextOpenedEntry = NULL;
+    copy->openedFile = NULL;
+    copy->size = base->size;
+    copy->cluster = base->cluster;
+    copy->catalogIndex = base->catalogIndex;
+    memcpy(copy->record, base->record, ENTRY_SIZE);
+
+    addStat(&base->image->stats->entryCount, 1);
+    return 0;
+}
+
+// エントリの領域を解放する
+void __freeEntry(Entry *entry)
+{
+    // アリーナから切り出した領域は、アリーナの参照がなくなったときにまとめて解放する
+    if (entry->arena != NULL)
+    {
+        releaseArena(entry->arena);
+        return;
+    }
+
+    free(entry->name);
+    free(entry);
+}
+
+/**
+ * 指定されたエントリをコピーする
+ * 成功したら0、それ以外の場合は0以外を返す
+ */
+Result copyEntry(Entry **copyPointer, const Entry *base)
+{
+    Result result = __copyEntry(copyPointer, base, NULL);
+    if (result)
+    {
+        return result;
+    }
+
+    linkOpenedEntry(base->image, *copyPointer);
+
+    return 0;
+}
+
+// キャッシュされたエントリを表す
+typedef struct __Dentry Dentry;
+typedef struct __Dentry
+{
+    // 親ディレクトリの最初のクラスタ番号
+    u32 parentCluster;
+
+    // 名前のハッシュ値
+    u32 hash;
+
+    /**
+     * エントリの情報
+     * FATイメージの開いているエントリには加えない
+     */
+    Entry *entry;
+
+    // ハッシュ表の同じバケットの次のエントリ
+    Dentry *nextInBucket;
+
+    // より最近使われたエントリ
+    Dentry *prev;
+
+    // より以前に使われたエントリ
+    Dentry *next;
+} Dentry;
+
+/**
+ * 親ディレクトリと名前からエントリを引くキャッシュ
+ * 上限を超えたら最も以前に使われたエントリから捨てる
+ */
+typedef struct __DentryCache
+{
+    // ハッシュ表のバケット
+    Dentry **buckets;
+
+    // バケットの数から1を引いた値
+    u32 bucketMask;
+
+    // 保持するエントリ数の上限
+    u32 capacity;
+
+    // 保持しているエントリ数
+    u32 count;
+
+    // 最も最近使われたエントリ
+    Dentry *head;
+
+    // 最も以前に使われたエントリ
+    Dentry *tail;
+
+#ifdef HAS_POSIX_IO
+    pthread_mutex_t lock;
+#endif
+} DentryCache;
+
+// 親ディレクトリのクラスタ番号と名前からハッシュ値を計算する
+u32 hashDentry(u32 parentCluster, const char *name)
+{
+    u32 hash = 2166136261u ^ parentCluster;
+    for (; *name != '\0'; ++name)
+    {
+        hash ^= (u8)*name;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * 指定された上限のエントリのキャッシュを作成する
+ * 成功したら0、それ以外の場合は0以外を返す
+ */
+Result createDentryCache(DentryCache **cachePointer, u32 capacity)
+{
+    DentryCache *cache = *cachePointer = malloc(sizeof(DentryCache));
+    if (cache == NULL)
+    {
+        return 1;
+    }
+
+    // バケットの数を上限以上の2の冪にする
+    u32 bucketCount = 16;
+    while (bucketCount < capacity && bucketCount < 0x80000000u)
+    {
+        bucketCount *= 2;
+    }
+
+    cache->buckets = calloc(bucketCount, sizeof(Dentry *));
+    if (cache->buckets == NULL)
+    {
+        free(cache);
+        *cachePointer = NULL;
+        return 2;
+    }
+
+    cache->bucketMask = bucketCount - 1;
+    cache->capacity = capacity;
+    cache->count = 0;
+    cache->head = NULL;
+    cache->tail = NULL;
+#ifdef HAS_POSIX_IO
+    pthread_mutex_init(&cache->lock, NULL);
+#endif
+
+    return 0;
+}
+
+// エントリのキャッシュを破棄する
+void destroyDentryCache(DentryCache *cache)
+{
+    Dentry *dentry = cache->head;
+    while (dentry != NULL)
+    {
+        Dentry *next = dentry->next;
+        __freeEntry(dentry->entry);
+        free(dentry);
+        dentry = next;
+    }
+
+#ifdef HAS_POSIX_IO
+    pthread_mutex_destroy(&cache->lock);
+#endif
+    free(cache->buckets);
+    free(cache);
+}
+
+// キャッシュされたエントリを使用順のリストから外す
+void unlinkDentry(DentryCache *cache, Dentry *dentry)
+{
+    if (dentry->prev != NULL)
+    {
+        dentry->prev->next = dentry->next;
+    }
+    else
+    {
+        cache->head = dentry->next;
+    }
+
+    if (dentry->next != NULL)
+    {
+        dentry->next->prev = dentry->prev;
+    }
+    else
+    {
+        cache->tail = dentry->prev;
+    }
+}
+
+// キャッシュされたエントリを使用順のリストの先頭に加える
+void pushFrontDentry(DentryCache *cache, Dentry *dentry)
+{
+    dentry->prev = NULL;
+    dentry->next = cache->head;
+    if (cache->head != NULL)
+    {
+        cache->head->prev = dentry;
+    }
+    cache->head = dentry;
+    if (cache->tail == NULL)
+    {
+        cache->tail = dentry;
+    }
+}
+
+/**
+ * キャッシュから、指定された親ディレクトリの指定された名前のエントリを探して開く
+ * 見つかったら0、それ以外の場合は0以外を返す
+ */
+Result findDentry(Entry **entryPointer, DentryCache *cache, u32 parentCluster, const char *name)
+{
+    *entryPointer = NULL;
+
+    u32 hash = hashDentry(parentCluster, name);
+    Result result = 1;
+
+#ifdef HAS_POSIX_IO
+    pthread_mutex_lock(&cache->lock);
+#endif
+
+    Dentry *dentry = cache->buckets[hash & cache->bucketMask];
+    for (; dentry != NULL; dentry = dentry->nextInBucket)
+    {
+        if (dentry->hash == hash && dentry->parentCluster == parentCluster && strcmp(dentry->entry->name, name) == 0)
+        {
+            break;
+        }
+    }
+
+    if (dentry != NULL)
+    {
+        // 最も最近使われたエントリにする
+        unlinkDentry(cache, dentry);
+        pushFrontDentry(cache, dentry);
+
+        result = copyEntry(entryPointer, dentry->entry) ? 2 : 0;
+    }
+
+#ifdef HAS_POSIX_IO
+    pthread_mutex_unlock(&cache->lock);
+#endif
+
+    return result;
+}
+
+/**
+ * 指定された親ディレクトリのエントリをキャッシュに加える
+ * 上限に達していたら、最も以前に使われたエントリを捨てる
+ * 成功したら0、それ以外の場合は0以外を返す
+ */
+Result addDentry(DentryCache *cache, u32 parentCluster, const Entry *entry)
+{
+    Dentry *dentry = malloc(sizeof(Dentry));
+    if (dentry == NULL)
+    {
+        return 1;
+    }
+
+    if (__copyEntry(&dentry->entry, entry, NULL))
+    {
+        free(dentry);
+        return 2;
+    }
+
+    dentry->parentCluster = parentCluster;
+    dentry->hash = hashDentry(parentCluster, entry->name);
+
+#ifdef HAS_POSIX_IO
+    pthread_mutex_lock(&cache->lock);
+#endif
+
+    // 上限に達していたら、最も以前に使われたエントリを捨てる
+    if (cache->count >= cache->capacity)
+    {
+        Dentry *victim = cache->tail;
+        unlinkDentry(cache, victim);
+
+        Dentry **link = &cache->buckets[victim->hash & cache->bucketMask];
+        while (*link != victim)
+        {
+            link = &(*link)->nextInBucket;
+        }
+        *link = victim->nextInBucket;
+
+        __freeEntry(victim->entry);
+        free(victim);
+        cache->count--;
+    }
+
+    Dentry **bucket = &cache->buckets[dentry->hash & cache->bucketMask];
+    dentry->nextInBucket = *bucket;
+    *bucket = dentry;
+    pushFrontDentry(cache, dentry);
+    cache->count++;
+
+#ifdef HAS_POSIX_IO
+    pthread_mutex_unlock(&cache->lock);
+#endif
+
+    return 0;
+}
+
+/**
+ * 指定された名前の子エントリを取得する
+ * 成功したら0、それ以外の場合はエラーコードを返す
+ */
+Result getChildEntry(Entry **childPointer, const Entry *parent, const char *name)
+{
+    *childPointer = NULL;
+
+    // キャッシュにあれば、ディレクトリを読み込まずに済ませる
+    DentryCache *cache = parent->image->dentryCache;
+    if (cache != NULL)
+    {
+        if (findDentry(childPointer, cache, parent->cluster, name) == 0)
+        {
+            addStat(&parent->image->stats->dentryHitCount, 1);
+            return 0;
+        }
+        addStat(&parent->image->stats->dentryMissCount, 1);
+    }
+
+    Directory *directory;
+    Result result = openDir(&directory, parent);
+    if (result)
+    {
+        return result;
+    }
+
+    // 子エントリのうち、パスの一部と名前が一致する最初のエントリだけをコピーする
+    Entry *child = NULL;
+    const Entry *entry;
+    while (readDir(&entry, directory) == 0 && entry != NULL)
+    {
+        if (strcmp(name, entry->name) == 0)
+        {
+            copyEntry(&child, entry);
+            break;
+        }
+    }
+
+    closeDir(directory);
+
+    // 名前が一致するエントリが見つからなかったら
+    if (child == NULL)
+    {
+        return FAT_ERROR_NOT_FOUND;
+    }
+
+    if (cache != NULL)
+    {
+        addDentry(cache, parent->cluster, child);
+    }
+
+    *childPointer = child;
+    return 0;
+}
+
+/**
+ * 指定されたパスの子孫エントリを取得する
+ * 成功したら0、それ以外の場合はエラーコードを返す
+ */
+Result __getDescendantEntry(Entry **descendantPointer, const Entry *parent, const char *path)
+{
+    *descendantPointer = NULL;
+
+    // カタログがあれば、ディレクトリをたどらずにパスから直接探す
+    if (parent->image->catalog != NULL && parent->catalogIndex != NO_CATALOG_INDEX)
+    {
+        u32 index = findCatalogPath(parent->image->catalog, parent->catalogIndex, path);
+        if (index == NO_CATALOG_INDEX)
+        {
+            return FAT_ERROR_NOT_FOUND;
+        }
+        return openCatalogEntry(descendantPointer, parent->image, index, NULL);
+    }
+
+    // 親のエントリをコピーする
+    Entry *descendant;
+    Result result = copyEntry(&descendant, parent);
+    if (result)
+    {
+        return result;
+    }
+
+    // パスをコピーする
+    char *pathCopy;
+    result = coptString(&pathCopy, path);
+    if (result)
+    {
+        closeEntry(descendant);
+        return result;
+    }
+
+    // パスを区切り文字で分割してエントリを探していく
+    char *savePointer;
+    char *token = splitPath(pathCopy, &savePointer);
+
+    while (token != NULL)
+    {
+        Entry *child;
+        result = getChildEntry(&child, descendant, token);
+        closeEntry(descendant);
+
+        if (result)
+        {
+            break;
+        }
+
+        token = splitPath(NULL, &savePointer);
+        descendant = child;
+    }
+
+    if (result == 0)
+    {
+        *descendantPointer = descendant;
+    }
+
+    free(pathCopy);
+    return result;
+}
+
+/**
+ * 指定されたパスの子孫エントリを取得し、解決にかかった時間を統計に加える
+ * 成功したら0、それ以外の場合はエラーコードを返す
+ */
+Result getDescendantEntry(Entry **descendantPointer, const Entry *parent, const char *path)
+{
+    u64 start = getNanoseconds();
+    Result result = __getDescendantEntry(descendantPointer, parent, path);
+
+    ImageStats *stats = parent->image->stats;
+    addStat(&stats->resolveCount, 1);
+    addStat(&stats->resolveNanoseconds, getNanoseconds() - start);
+    return result;
+}
+
+/**
+ * 指定されたFATイメージ、パスのエントリを開く
+ * 成功したら0、それ以外の場合はエラーコードを返す
+ */
+Result openEntry(Entry **entryPointer, Image *image, const char *path)
+{
+    *entryPointer = NULL;
+
+    // ルートのエントリを作成する
+    Entry *root;
+    u8 bytes[ENTRY_SIZE] = {0};
+    bytes[11] = DIRECTORY;
+    bytes[20] = (image->rootCluster >> 16) & 0xff;
+    bytes[21] = (image->rootCluster >> 24) & 0xff;
+    bytes[26] = image->rootCluster & 0xff;
+    bytes[27] = (image->rootCluster >> 8) & 0xff;
+    Result result = __openEntry(&root, image, "", bytes, NULL);
+    if (result)
+    {
+        return result;
+    }
+
+    if (image->catalog != NULL)
+    {
+        root->catalogIndex = 0;
+    }
+
+    result = getDescendantEntry(entryPointer, root, path);
+    closeEntry(root);
+    return result;
+}
+
+// エントリを閉じる
+void closeEntry(Entry *entry)
+{
+    // FATイメージの開いているエントリからエントリを除外する
+    unlinkOpenedEntry(entry->image, entry);
+
+    // 開いているポインタをすべて閉じる
+    File *openedFile = entry->openedFile;
+    while (openedFile != NULL)
+    {
+        File *nextOpenedFile = openedFile->nextOpenedFile;
+        closeFile(openedFile);
+        openedFile = nextOpenedFile;
+    }
+
+    __freeEntry(entry);
+}
+
+/**
+ * 指定されたエントリがルートかどうかを返す
+ * ルートを親とするディレクトリの「..」は、クラスタ番号0でルートを指す
+ */
+Boolean getIsRoot(const Entry *entry)
+{
+    return entry->cluster == entry->image->rootCluster || entry->cluster == 0;
+}
+
+// getChildrenで開いた子エントリをすべて閉じ、配列を解放する
+void freeChildren(Entry *children[], s32 count)
+{
+    for (s32 i = 0; i < count; ++i)
+    {
+        closeEntry(children[i]);
+    }
+    free(children);
+}
+
+/**
+ * 指定されたディレクトリのエントリの子エントリをすべて開く
+ * 子エントリの数を返し、開けなかった場合はエラーコードを負にした値を返す
+ * 途中で開けなくなった場合は、それまでに開いた子エントリを閉じる
+ */
+s32 __getChildren(Entry **childrenPointer[], const Entry *parent)
+{
+    *childrenPointer = NULL;
+
+    Directory *directory;
+    Result result = openDir(&directory, parent);
+    if (result)
+    {
+        return -result;
+    }
+
+    // 開いたエントリ
+    Entry **children = NULL;
+    u32 capacity = 0;
+    u32 count = 0;
+
+    // 開いたエントリの領域を切り出すアリーナ
+    Arena *arena = NULL;
+    if (parent->image->useEntryArena)
+    {
+        createArena(&arena);
+    }
+
+    const Entry *entry;
+    while ((result = readDir(&entry, directory)) == 0 && entry != NULL)
+    {
+        // 開いたエントリの領域が足りなければ広げる
+        if (count == capacity)
+        {
+            capacity = capacity == 0 ? 16 : capacity * 2;
+            Entry **newChildren = realloc(children, capacity * sizeof(Entry *));
+            if (newChildren == NULL)
+            {
+                result = FAT_ERROR_NO_MEMORY;
+                break;
+            }
+            children = newChildren;
+        }
+
+        Entry *child;
+        result = __copyEntry(&child, entry, arena);
+        if (result)
+        {
+            break;
+        }
+        linkOpenedEntry(child->image, child);
+
+        children[count] = child;
+        count++;
+    }
+
+    closeDir(directory);
+
+    // アリーナは開いたエントリがすべて閉じられたときに解放される
+    if (arena != NULL)
+    {
+        releaseArena(arena);
+    }
+
+    if (result)
+    {
+        freeChildren(children, (s32)count);
+        return -result;
+    }
+
+    // 他のスレッドが開いたエントリと混ざらないように、開いたエントリを直接返す
+    *childrenPointer = children;
+    return (s32)count;
+}
+
+/**
+ * 子エントリをすべて取得し、かかった時間を統計に加える
+ * 子エントリの数を返し、取得できなかった場合はエラーコードを負にした値を返す
+ */
+s32 getChildren(Entry **childrenPointer[], const Entry *parent)
+{
+    u64 start = getNanoseconds();
+    s32 count = __getChildren(childrenPointer, parent);
+
+    ImageStats *stats = parent->image->stats;
+    addStat(&stats->getChildrenCount, 1);
+    addStat(&stats->getChildrenNanoseconds, getNanoseconds() - start);
+    return count;
+}
+#pragma endregion
+
+#pragma region Catalog
+/**
+ * FATイメージに含まれるすべてのエントリの情報
+ * 属性ごとに配列を分け、エントリの番号を添字として参照する
+ * 番号0はルートを表し、ディレクトリの子エントリは連続した番号に並ぶ
+ */
+typedef struct __Catalog
+{
+    // エントリの数
+    u32 count;
+
+    // 各配列の大きさ
+    u32 capacity;
+
+    // エントリの名前をUTF-8で連結した領域
+    char *namePool;
+
+    // 名前を連結した領域の使用中の長さ
+    u32 namePoolLength;
+
+    // 名前を連結した領域の大きさ
+    u32 namePoolCapacity;
+
+    // 名前の、連結した領域の中の位置
+    u32 *nameOffsets;
+
+    /**
+     * ディレクトリエントリのバイト列を連結した領域
+     * 属性やサイズ、日時はここから読み取る
+     */
+    u8 *records;
+
+    // 親ディレクトリのエントリの番号
+    u32 *parents;
+
+    // 最初の子エントリの番号
+    u32 *firstChildren;
+
+    // 子エントリの数
+    u32 *childCounts;
+
+    // ルートからのパスのハッシュ値
+    u32 *pathHashes;
+
+    /**
+     * パスからエントリの番号を引くハッシュ表
+     * エントリの番号に1を足した値を格納し、空きは0とする
+     */
+    u32 *pathTable;
+
+    // ハッシュ表の大きさから1を引いた値
+    u32 pathTableMask;
+} Catalog;
+
+// パスのハッシュ値に、区切り文字と名前を加える
+u32 hashCatalogPath(u32 hash, const char *name)
+{
+    hash ^= '/';
+    hash *= 16777619u;
+    for (; *name != '\0'; ++name)
+    {
+        hash ^= (u8)*name;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// カタログのエントリの名前を取得する
+const char *getCatalogName(const Catalog *catalog, u32 index)
+{
+    return catalog->namePool + catalog->nameOffsets[index];
+}
+
+// カタログのエントリのバイト列を取得する
+const u8 *getCatalogRecord(const Catalog *catalog, u32 index)
+{
+    return catalog->records + (u64)index * ENTRY_SIZE;
+}
+
+// カタログを破棄する
+void destroyCatalog(Catalog *catalog)
+{
+    free(catalog->namePool);
+    free(catalog->nameOffsets);
+    free(catalog->records);
+    free(catalog->parents);
+    free(catalog->firstChildren);
+    free(catalog->childCounts);
+    free(catalog->pathHashes);
+    free(catalog->pathTable);
+    free(catalog);
+}
+
+/**
+ * カタログの配列を、指定された数のエントリを格納できるように広げる
+ * 成功したら0、それ以外の場合は0以外を返す
+ */
+Result reserveCatalog(Catalog *catalog, u32 count)
+{
+    if (count <= catalog->capacity)
+    {
+        return 0;
+    }
+
+    u32 capacity = catalog->capacity == 0 ? 256 : catalog->capacity;
+    while (capacity < count)
+    {
+        capacity *= 2;
+    }
+
+#define GROW_CATALOG_ARRAY(member, elementSize)                                         \
+    {                                                                                   \
+        void *array = realloc(catalog->member, capacity * (elementSize));               \
+        if (array == NULL)                                                              \
+        {                                                                               \
+            return 1;                                                                   \
+        }                                                                               \
+        catalog->member = array;                                                        \
+    }
+
+    GROW_CATALOG_ARRAY(nameOffsets, sizeof(*catalog->nameOffsets));
+    GROW_CATALOG_ARRAY(records, ENTRY_SIZE);
+    GROW_CATALOG_ARRAY(parents, sizeof(*catalog->parents));
+    GROW_CATALOG_ARRAY(firstChildren, sizeof(*catalog->firstChildren));
+    GROW_CATALOG_ARRAY(childCounts, sizeof(*catalog->childCounts));
+    GROW_CATALOG_ARRAY(pathHashes, sizeof(*catalog->pathHashes));
+
+#undef GROW_CATALOG_ARRAY
+
+    catalog->capacity = capacity;
+    return 0;
+}
+
+/**
+ * エントリをカタログの末尾に加える
+ * 成功したら0、それ以外の場合は0以外を返す
+ */
+Result addCatalogEntry(Catalog *catalog, const Entry *entry, u32 parent)
+{
+    u32 index = catalog->count;
+    if (reserveCatalog(catalog, index + 1))
+    {
+        return 1;
+    }
+
+    // 名前を連結した領域に名前を加える
+    u32 nameLength = strlen(entry->name) + 1;
+    if (catalog->namePoolLength + nameLength > catalog->namePoolCapacity)
+    {
+        u32 namePoolCapacity = catalog->namePoolCapacity == 0 ? 4096 : catalog->namePoolCapacity;
+        while (catalog->namePoolLength + nameLength > namePoolCapacity)
+        {
+            namePoolCapacity *= 2;
+        }
+
+        char *namePool = realloc(catalog->namePool, namePoolCapacity);
+        if (namePool == NULL)
+        {
+            return 2;
+        }
+        catalog->namePool = namePool;
+        catalog->namePoolCapacity = namePoolCapacity;
+    }
+    strcpy(catalog->namePool + catalog->namePoolLength, entry->name);
+    catalog->nameOffsets[index] = catalog->namePoolLength;
+    catalog->namePoolLength += nameLength;
+
+    memcpy(catalog->records + (u64)index * ENTRY_SIZE, entry->record, ENTRY_SIZE);
+    catalog->parents[index] = parent;
+    catalog->firstChildren[index] = 0;
+    catalog->childCounts[index] = 0;
+    catalog->pathHashes[index] = index == 0 ? 2166136261u : hashCatalogPath(catalog->pathHashes[parent], entry->name);
+
+    catalog->count++;
+    return 0;
+}
+
+/**
+ * パスのハッシュ表を作成する
+ * 成功したら0、それ以外の場合は0以外を返す
+ */
+Result buildCatalogPathTable(Catalog *catalog)
+{
+    // 負荷率が1/2以下になるようにする
+    u32 size = 16;
+    while (size < catalog->count * 2)
+    {
+        size *= 2;
+    }
+
+    catalog->pathTable = calloc(size, sizeof(u32));
+    if (catalog->pathTable == NULL)
+    {
+        return 1;
+    }
+    catalog->pathTableMask = size - 1;
+
+    // 線形探査で空いている位置に格納する
+    for (u32 i = 0; i < catalog->count; ++i)
+    {
+        u32 slot = catalog->pathHashes[i] & catalog->pathTableMask;
+        while (catalog->pathTable[slot] != 0)
+        {
+            slot = (slot + 1) & catalog->pathTableMask;
+        }
+        catalog->pathTable[slot] = i + 1;
+    }
+
+    return 0;
+}
+
+/**
+ * FATイメージのすべてのディレクトリを一度ずつ読み込み、カタログを作成する
+ * 成功したら0、それ以外の場合は0以外を返す
+ */
+Result buildCatalog(Catalog **catalogPointer, Entry *root)
+{
+    Catalog *catalog = *catalogPointer = calloc(1, sizeof(Catalog));
+    if (catalog == NULL)
+    {
+        return 1;
+    }
+
+    const Image *image = root->image;
+
+    // 壊れたイメージで同じディレクトリを何度も読まないように、読んだクラスタを記録する
+    u8 *visited = calloc(image->clusterCount / 8 + 1, sizeof(u8));
+    if (visited == NULL)
+    {
+        destroyCatalog(catalog);
+        *catalogPointer = NULL;
+        return 2;
+    }
+
+    Result result = addCatalogEntry(catalog, root, 0);
+
+    // 幅優先でたどり、子エントリを連続した番号に並べる
+    for (u32 i = 0; result == 0 && i < catalog->count; ++i)
+    {
+        const u8 *record = getCatalogRecord(catalog, i);
+        if ((get8(record, 11) & DIRECTORY) == 0)
+        {
+            continue;
+        }
+
+        // 自身と親を指すエントリはたどらない
+        const char *name = getCatalogName(catalog, i);
+        if (i > 0 && (strcmp(name, ".") == 0 || strcmp(name, "..") == 0))
+        {
+            continue;
+        }
+
+        u32 cluster = getRecordCluster(record);
+        if (i > 0 && (cluster < CLUSTER_START || cluster >= image->clusterCount))
+        {
+            continue;
+        }
+        if (i > 0 || cluster >= CLUSTER_START)
+        {
+            if (visited[cluster / 8] & (1 << (cluster % 8)))
+            {
+                continue;
+            }
+            visited[cluster / 8] |= 1 << (cluster % 8);
+        }
+
+        // ディレクトリのエントリを作成して子エントリを読み込む
+        Entry *directory;
+        if (i == 0)
+        {
+            result = copyEntry(&directory, root);
+        }
+        else
+        {
+            u8 bytes[ENTRY_SIZE] = {0};
+            bytes[11] = DIRECTORY;
+            bytes[20] = (cluster >> 16) & 0xff;
+            bytes[21] = (cluster >> 24) & 0xff;
+            bytes[26] = cluster & 0xff;
+            bytes[27] = (cluster >> 8) & 0xff;
+            result = __openEntry(&directory, root->image, "", bytes, NULL);
+        }
+        if (result)
+        {
+            break;
+        }
+
+        Directory *iterator;
+        result = openDir(&iterator, directory);
+        closeEntry(directory);
+        if (result)
+        {
+            break;
+        }
+
+        catalog->firstChildren[i] = catalog->count;
+
+        const Entry *child;
+        while (result == 0 && readDir(&child, iterator) == 0 && child != NULL)
+        {
+            result = addCatalogEntry(catalog, child, i);
+        }
+        closeDir(iterator);
+
+        catalog->childCounts[i] = catalog->count - catalog->firstChildren[i];
+    }
+
+    free(visited);
+
+    if (result == 0)
+    {
+        result = buildCatalogPathTable(catalog);
+    }
+
+    if (result)
+    {
+        destroyCatalog(catalog);
+        *catalogPointer = NULL;
+    }
+    return result;
+}
+
+/**
+ * カタログのエントリが自身や親を指すエントリであれば、指している先のディレクトリの番号を返す
+ * それ以外の場合は指定された番号をそのまま返す
+ */
+u32 resolveCatalogLink(const Catalog *catalog, u32 index)
+{
+    if (index == 0)
+    {
+        return index;
+    }
+
+    const char *name = getCatalogName(catalog, index);
+    if (strcmp(name, ".") == 0)
+    {
+        return catalog->parents[index];
+    }
+    if (strcmp(name, "..") == 0)
+    {
+        return catalog->parents[catalog->parents[index]];
+    }
+    return index;
+}
+
+/**
+ * カタログから、指定された親ディレクトリの指定された名前の子エントリの番号を探す
+ * 親ディレクトリのパスのハッシュ値に名前を加えた値でハッシュ表を引く
+ * 見つからなかった場合はNO_CATALOG_INDEXを返す
+ */
+u32 findCatalogChild(const Catalog *catalog, u32 parent, const char *name)
+{
+    u32 hash = hashCatalogPath(catalog->pathHashes[parent], name);
+
+    // ハッシュ表を線形探査する
+    u32 slot = hash & catalog->pathTableMask;
+    while (catalog->pathTable[slot] != 0)
+    {
+        u32 candidate = catalog->pathTable[slot] - 1;
+        if (catalog->pathHashes[candidate] == hash &&
+            catalog->parents[candidate] == parent &&
+            candidate != 0 &&
+            strcmp(getCatalogName(catalog, candidate), name) == 0)
+        {
+            return candidate;
+        }
+        slot = (slot + 1) & catalog->pathTableMask;
+    }
+
+    return NO_CATALOG_INDEX;
+}
+
+/**
+ * カタログから、基準となるエントリからの相対パスが指すエントリの番号を探す
+ * 見つからなかった場合はNO_CATALOG_INDEXを返す
+ */
+u32 findCatalogPath(const Catalog *catalog, u32 base, const char *path)
+{
+    // パスをコピーする
+    char *pathCopy;
+    if (coptString(&pathCopy, path))
+    {
+        return NO_CATALOG_INDEX;
+    }
+
+    // パスを区切り文字で分割してエントリを探していく
+    u32 index = base;
+
+    char *savePointer;
+    char *token = splitPath(pathCopy, &savePointer);
+    while (token != NULL && index != NO_CATALOG_INDEX)
+    {
+        index = findCatalogChild(catalog, resolveCatalogLink(catalog, index), token);
+        token = splitPath(NULL, &savePointer);
+    }
+
+    free(pathCopy);
+    return index;
+}
+
+/**
+ * カタログの指定された番号のエントリを開く
+ * 成功したら0、それ以外の場合は0以外を返す
+ */
+Result openCatalogEntry(Entry **entryPointer, Image *image, u32 index, Arena *arena)
+{
+    const Catalog *catalog = image->catalog;
+
+    // エントリと名前の領域を確保する
+    Result result = allocateEntry(entryPointer, getCatalogName(catalog, index), arena);
+    if (result)
+    {
+        return result;
+    }
+    Entry *entry = *entryPointer;
+
+    // メンバを初期化する
+    entry->image = image;
+    entry->openedFile = NULL;
+    entry->catalogIndex = index;
+
+    setEntryRecord(entry, getCatalogRecord(catalog, index));
+
+    linkOpenedEntry(image, entry);
+
+    return 0;
+}
+#pragma endregion
+
+#pragma region Directory
+// ディレクトリの子エントリを先頭から1つずつ読み取るイテレータ
+typedef struct __Directory
+{
+    // ディレクトリが含まれるFATイメージ
+    Image *image;
+
+    // 読み込み中のクラスタ番号
+    u32 cluster;
+
+    // 読み込み中のクラスタ、またはルートディレクトリの領域全体のバイト列
+    const u8 *records;
+
+    // 読み込んだバイト列に含まれるエントリの数
+    u32 recordCount;
+
+    // 次に読み取るエントリの添字
+    u32 recordIndex;
+
+    /**
+     * FATイメージがマッピングされていない場合に、バイト列を読み込むバッファ
+     * マッピングされている場合はNULL
+     */
+    u8 *buffer;
+
+    /**
+     * 読み込み中のクラスタを直接参照している、キャッシュしたブロック
+     * ブロックを参照していない場合はNULL
+     */
+    CacheBlock *block;
+
+    // カタログから読み取る場合の、次のエントリの番号と末尾の番号
+    u32 catalogIndex;
+    u32 catalogEnd;
+
+    // 末尾まで読み取ったかどうか
+    Boolean end;
+
+    // 削除されたエントリも読み取るかどうか
+    Boolean withDeleted;
+
+    // 走査したエントリのスロット数、閉じるときに統計に加える
+    u64 slotCount;
+
+    /**
+     * これまでに読み込んだクラスタの数と、読み込むクラスタの数の上限
+     * FATが壊れてチェーンが循環していても終わるように、上限はクラスタの総数にする
+     */
+    u32 chainLength;
+    u32 maxChainLength;
+
+    // 直前に読み取ったエントリの名前（UTF-8）
+    char name[MAX_NAME_SIZE];
+
+    // 直前に読み取ったエントリ
+    Entry entry;
+} Directory;
+
+/**
+ * ディレクトリのエントリのバイト列を参照する
+ * ブロックのキャッシュに収まるクラスタは、読み終えるまでブロックを固定して直接参照する
+ * それ以外の場合はマッピングを直接参照するか、バッファに読み込む
+ * 参照できなかった場合はNULLを返す
+ */
+const u8 *viewRecords(Directory *directory, u64 offset, u64 size)
+{
+    Image *image = directory->image;
+    if (directory->block != NULL)
+    {
+        unpinBlock(image, directory->block);
+        directory->block = NULL;
+    }
+
+    const u8 *records = pinBlock(&directory->block, image, offset, size);
+    if (records != NULL)
+    {
+        return records;
+    }
+    return viewImage(image, directory->buffer, offset, size);
+}
+
+/**
+ * 指定されたディレクトリのエントリの子エントリを読み取るイテレータを開く
+ * 削除されたエントリも読み取る場合は、カタログを使わずにディレクトリを読み込む
+ * 成功したら0、それ以外の場合は0以外を返す
+ */
+Result __openDir(Directory **directoryPointer, const Entry *parent, Boolean withDeleted)
+{
+    *directoryPointer = NULL;
+
+    if (!hasAttribute(parent, DIRECTORY))
+    {
+        return FAT_ERROR_NOT_DIRECTORY;
+    }
+
+    Directory *directory = *directoryPointer = malloc(sizeof(Directory));
+    if (directory == NULL)
+    {
+        return FAT_ERROR_NO_MEMORY;
+    }
+
+    Image *image = parent->image;
+    directory->image = image;
+    directory->end = FALSE;
+    directory->withDeleted = withDeleted;
+    directory->slotCount = 0;
+    directory->chainLength = 1;
+    directory->maxChainLength = image->clusterCount;
+    directory->buffer = NULL;
+    directory->block = NULL;
+    directory->records = NULL;
+    directory->recordCount = 0;
+    directory->recordIndex = 0;
+    directory->catalogIndex = NO_CATALOG_INDEX;
+    directory->catalogEnd = NO_CATALOG_INDEX;
+
+    // カタログがあれば、ディレクトリを読み込まずにカタログから読み取る
+    if (image->catalog != NULL && parent->catalogIndex != NO_CATALOG_INDEX && !withDeleted)
+    {
+        // 自身や親を指すエントリの場合は、指している先のディレクトリの子エントリを読み取る
+        const Catalog *catalog = image->catalog;
+        u32 index = resolveCatalogLink(catalog, parent->catalogIndex);
+        directory->catalogIndex = catalog->firstChildren[index];
+        directory->catalogEnd = directory->catalogIndex + catalog->childCounts[index];
+        return 0;
+    }
+
+    u64 offset;
+    if (getIsRoot(parent))
+    {
+        directory->cluster = image->rootCluster;
+        directory->recordCount = image->maxRootEntryCount;
+        offset = image->rootOffset;
+    }
+    else
+    {
+        directory->cluster = parent->cluster;
+        directory->recordCount = image->maxSubEntryCount;
+        offset = getDataOffset(image, parent->cluster);
+    }
+
+    // マッピングがなければ、クラスタとルートディレクトリの領域のどちらも収まるバッファを用意する
+    if (image->map == NULL)
+    {
+        u32 bufferCount = image->maxRootEntryCount > image->maxSubEntryCount ? image->maxRootEntryCount : image->maxSubEntryCount;
+        directory->buffer = malloc((u64)bufferCount * ENTRY_SIZE);
+        if (directory->buffer == NULL)
+        {
+            free(directory);
+            *directoryPointer = NULL;
+            return FAT_ERROR_NO_MEMORY;
+        }
+    }
+
+    // 最初のクラスタ、またはルートディレクトリの領域全体をまとめて読み込む
+    directory->records = viewRecords(directory, offset, (u64)directory->recordCount * ENTRY_SIZE);
+    if (directory->records == NULL)
+    {
+        closeDir(directory);
+        *directoryPointer = NULL;
+        return FAT_ERROR_IO;
+    }
+
+    return 0;
+}
+
+/**
+ * 指定されたディレクトリのエントリの、削除されていない子エントリを読み取るイテレータを開く
+ * 成功したら0、それ以外の場合は0以外を返す
+ */
+Result openDir(Directory **directoryPointer, const Entry *parent)
+{
+    return __openDir(directoryPointer, parent, FALSE);
+}
+
+/**
+ * 指定された添字から、削除されていない最初のエントリの添字を探す
+ * 見つからなければエントリの数を返す
+ */
+u32 skipDeletedRecords(const u8 *records, u32 index, u32 count)
+{
+#ifdef __SSE2__
+    // 16エントリの先頭バイトを1つのベクタに集め、まとめて比較する
+    const __m128i deleted = _mm_set1_epi8((char)DELETED);
+    for (; index + 16 <= count; index += 16)
+    {
+        const u8 *bytes = records + (u64)index * ENTRY_SIZE;
+
+        __m128i vectors[16];
+        for (u8 j = 0; j < 16; ++j)
+        {
+            vectors[j] = _mm_loadu_si128((const __m128i *)(bytes + j * ENTRY_SIZE));
+        }
+
+        // 隣り合うエントリの下位バイトを交互に並べていくと、先頭バイトが先頭に集まる
+        for (u8 j = 0; j < 8; ++j)
+        {
+            vectors[j] = _mm_unpacklo_epi8(vectors[j * 2], vectors[j * 2 + 1]);
+        }
+        for (u8 j = 0; j < 4; ++j)
+        {
+            vectors[j] = _mm_unpacklo_epi16(vectors[j * 2], vectors[j * 2 + 1]);
+        }
+        for (u8 j = 0; j < 2; ++j)
+        {
+            vectors[j] = _mm_unpacklo_epi32(vectors[j * 2], vectors[j * 2 + 1]);
+        }
+        __m128i firstBytes = _mm_unpacklo_epi64(vectors[0], vectors[1]);
+
+        u32 live = ~_mm_movemask_epi8(_mm_cmpeq_epi8(firstBytes, deleted)) & 0xffff;
+        if (live != 0)
+        {
+            return index + __builtin_ctz(live);
+        }
+    }
+#endif
+
+    // 残りのエントリを1つずつ調べる
+    while (index < count && records[(u64)index * ENTRY_SIZE] == DELETED)
+    {
+        ++index;
+    }
+    return index;
+}
+
+// イテレータが持つエントリに、読み取ったバイト列を設定する
+void setDirEntry(Directory *directory, const u8 *bytes, u32 catalogIndex)
+{
+    Entry *entry = &directory->entry;
+    entry->image = directory->image;
+    entry->prevOpenedEntry = NULL;
+    entry->nextOpenedEntry = NULL;
+    entry->openedFile = NULL;
+    entry->name = directory->name;
+    entry->arena = NULL;
+    entry->catalogIndex = catalogIndex;
+    setEntryRecord(entry, bytes);
+}
+
+/**
+ * 短い名前のエントリのチェックサムを計算する
+ * 長い名前の断片は、続く短い名前のチェックサムを持つ
+ */
+u8 getShortNameChecksum(const u8 *bytes)
+{
+    u8 checksum = 0;
+    for (u8 i = 0; i < 11; ++i)
+    {
+        checksum = ((checksum & 1) << 7) + (checksum >> 1) + bytes[i];
+    }
+    return checksum;
+}
+
+/**
+ * 短い名前をUTF-8の文字列に変換する
+ * 各バイトはLatin-1の文字として扱う
+ */
+void decodeShortName(char *name, const u8 *bytes)
+{
+    u32 length = 0;
+
+    // 拡張子を除いた名前の末尾の空白を除く
+    s32 basenameLength = 8;
+    while (basenameLength > 0 && bytes[basenameLength - 1] == ' ')
+    {
+        --basenameLength;
+    }
+    for (s32 i = 0; i < basenameLength; ++i)
+    {
+        // 先頭の0x05は、0xe5で始まる名前を表す
+        u8 c = i == 0 && bytes[0] == ESCAPE_DELETED ? DELETED : bytes[i];
+        length += encodeUtf8(name + length, c);
+    }
+
+    if ((bytes[11] & ARCHIVE) != 0)
+    {
+        name[length++] = '.';
+    }
+
+    // 拡張子の末尾の空白を除く
+    s32 extensionLength = 3;
+    while (extensionLength > 0 && bytes[8 + extensionLength - 1] == ' ')
+    {
+        --extensionLength;
+    }
+    for (s32 i = 0; i < extensionLength; ++i)
+    {
+        length += encodeUtf8(name + length, bytes[8 + i]);
+    }
+
+    name[length] = '\0';
+}
+
+/**
+ * UTF-16の長い名前をUTF-8の文字列に変換する
+ * 終端の0か、指定された長さまでを変換する
+ */
+void decodeLongName(char *name, const u16 *units, u32 count)
+{
+    u32 length = 0;
+    for (u32 i = 0; i < count && units[i] != 0; ++i)
+    {
+        u32 codePoint = units[i];
+
+        // サロゲートペアを1つのコードポイントにまとめる
+        if (codePoint >= 0xd800 && codePoint < 0xe000)
+        {
+            if (codePoint < 0xdc00 && i + 1 < count && units[i + 1] >= 0xdc00 && units[i + 1] < 0xe000)
+            {
+                codePoint = 0x10000 + ((codePoint - 0xd800) << 10) + (units[i + 1] - 0xdc00);
+                ++i;
+            }
+            else
+            {
+                codePoint = 0xfffd;
+            }
+        }
+
+        length += encodeUtf8(name + length, codePoint);
+    }
+    name[length] = '\0';
+}
+
+// 長い名前の断片に含まれるUTF-16の13文字を取り出す
+void getLongNameUnits(u16 *units, const u8 *bytes)
+{
+    for (u8 j = 0; j < 5; ++j)
+    {
+        units[j] = get16(bytes, 1 + j * 2);
+    }
+    for (u8 j = 0; j < 6; ++j)
+    {
+        units[5 + j] = get16(bytes, 14 + j * 2);
+    }
+    for (u8 j = 0; j < 2; ++j)
+    {
+        units[11 + j] = get16(bytes, 28 + j * 2);
+    }
+}
+
+/**
+ * 削除された短い名前の、失われた先頭のバイトを長い名前の断片のチェックサムから求める
+ * チェックサムは先頭のバイトに対して一対一なので、一致するバイトは1つだけ見つかる
+ * 見つかったバイトが短い名前に使えない文字なら、断片は別のエントリのものとして0を返す
+ */
+u8 findDeletedShortNameHead(const u8 *bytes, u8 checksum)
+{
+    u8 name[11];
+    memcpy(name, bytes, sizeof(name));
+    for (u32 c = 0x21; c <= 0xff; ++c)
+    {
+        name[0] = c;
+        if (getShortNameChecksum(name) == checksum)
+        {
+            return c == DELETED || (c >= 'a' && c <= 'z') || strchr("\"*+,./:;<=>?[\\]|", c) != NULL ? 0 : c;
+        }
+    }
+    return 0;
+}
+
+/**
+ * ディレクトリから次の子エントリを読み取る
+ * 削除されたエントリも読み取る場合、削除されたエントリの名前は長い名前の断片から組み立て、
+ * 断片がなければ短い名前の先頭の文字を'_'で置き換える
+ * 読み取ったエントリは次にreadDirかcloseDirを呼び出すまで有効で、残す場合はcopyEntryでコピーする
+ * 末尾に到達していたらNULLを格納する
+ * 成功したら0、それ以外の場合は0以外を返す
+ */
+Result readDir(const Entry **entryPointer, Directory *directory)
+{
+    *entryPointer = NULL;
+
+    if (directory->end)
+    {
+        return 0;
+    }
+
+    Image *image = directory->image;
+
+    if (directory->catalogIndex != NO_CATALOG_INDEX)
+    {
+        if (directory->catalogIndex >= directory->catalogEnd)
+        {
+            directory->end = TRUE;
+            return 0;
+        }
+
+        u32 index = directory->catalogIndex++;
+        strcpy(directory->name, getCatalogName(image->catalog, index));
+        setDirEntry(directory, getCatalogRecord(image->catalog, index), index);
+        *entryPointer = &directory->entry;
+        return 0;
+    }
+
+    // 組み立て中の長い名前（UTF-16）
+    u16 longName[MAX_NAME_LENGTH];
+
+    // 次に現れるべき長い名前の断片の順番号と、断片が持つチェックサム
+    u8 expectedSequence = 0;
+    u8 checksum = 0;
+
+    // 組み立て中の長い名前の断片の数
+    // 長さが断片の文字数の倍数の名前には終端の0がないので、この数で変換する長さを区切る
+    u8 sequenceCount = 0;
+
+    // 長い名前を最後の断片まで組み立て終えたかどうか
+    Boolean hasLongName = FALSE;
+
+    // 集めた削除された長い名前の断片の数
+    u32 deletedFragmentCount = 0;
+
+    while (TRUE)
+    {
+        // 削除されたエントリを読み取らない場合は、まとめて読み飛ばす
+        if (!directory->withDeleted)
+        {
+            u32 recordIndex = skipDeletedRecords(directory->records, directory->recordIndex, directory->recordCount);
+            directory->slotCount += recordIndex - directory->recordIndex;
+            directory->recordIndex = recordIndex;
+        }
+
+        if (directory->recordIndex == directory->recordCount)
+        {
+            // 最後のクラスタに到達していたら終わる
+            u32 cluster = directory->cluster;
+            if (cluster >= CLUSTER_START && cluster <= image->clusterEnd)
+            {
+                cluster = image->getNextCluster(image, cluster);
+                addFatLookupStat(image, 1);
+            }
+            if (cluster < CLUSTER_START || cluster > image->clusterEnd)
+            {
+                directory->end = TRUE;
+                return 0;
+            }
+            if (++directory->chainLength > directory->maxChainLength)
+            {
+                directory->end = TRUE;
+                return FAT_ERROR_INVALID_IMAGE;
+            }
+
+            // 次のクラスタをまとめて読み込む
+            directory->cluster = cluster;
+            directory->recordCount = image->maxSubEntryCount;
+            directory->recordIndex = 0;
+            directory->records = viewRecords(directory, getDataOffset(image, cluster), (u64)directory->recordCount * ENTRY_SIZE);
+            if (directory->records == NULL)
+            {
+                directory->end = TRUE;
+                return FAT_ERROR_IO;
+            }
+            continue;
+        }
+
+        const u8 *bytes = directory->records + (u64)directory->recordIndex * ENTRY_SIZE;
+        directory->recordIndex++;
+        directory->slotCount++;
+
+        if (bytes[0] == SKIPPED)
+        {
+            directory->end = TRUE;
+            return 0;
+        }
+
+        if (bytes[0] == DELETED && bytes[11] == LONG_NAME)
+        {
+            // 削除された断片は順番号を失っているので、チェックサムが同じ断片を並んだ順に集める
+            if (deletedFragmentCount == MAX_LONG_NAME_ENTRY_COUNT || (deletedFragmentCount > 0 && bytes[13] != checksum))
+            {
+                deletedFragmentCount = 0;
+            }
+            checksum = bytes[13];
+            expectedSequence = 0;
+            hasLongName = FALSE;
+            getLongNameUnits(longName + deletedFragmentCount * LONG_NAME_LENGTH_PER_ENTRY, bytes);
+            deletedFragmentCount++;
+            continue;
+        }
+
+        if (bytes[0] == DELETED)
+        {
+            // 名前の先頭は最後に集めた断片にあるので、空の名前になる断片は使わない
+            if (deletedFragmentCount > 0 && longName[(deletedFragmentCount - 1) * LONG_NAME_LENGTH_PER_ENTRY] != 0 &&
+                findDeletedShortNameHead(bytes, checksum) != 0)
+            {
+                // 断片は末尾から順に並ぶので、並びを逆にして長い名前を組み立てる
+                for (u32 i = 0; i < deletedFragmentCount / 2; ++i)
+                {
+                    u16 *front = longName + i * LONG_NAME_LENGTH_PER_ENTRY;
+                    u16 *back = longName + (deletedFragmentCount - 1 - i) * LONG_NAME_LENGTH_PER_ENTRY;
+                    u16 units[LONG_NAME_LENGTH_PER_ENTRY];
+                    memcpy(units, front, sizeof(units));
+                    memcpy(front, back, sizeof(units));
+                    memcpy(back, units, sizeof(units));
+                }
+                decodeLongName(directory->name, longName, deletedFragmentCount * LONG_NAME_LENGTH_PER_ENTRY);
+            }
+            else
+            {
+                u8 shortName[ENTRY_SIZE];
+                memcpy(shortName, bytes, ENTRY_SIZE);
+                shortName[0] = '_';
+                decodeShortName(directory->name, shortName);
+            }
+
+            setDirEntry(directory, bytes, NO_CATALOG_INDEX);
+            *entryPointer = &directory->entry;
+            return 0;
+        }
+
+        if (bytes[11] == LONG_NAME)
+        {
+            deletedFragmentCount = 0;
+
+            // 長い名前の断片は末尾から順に並ぶので、順番号が示す位置へ直接書き込む
+            u8 sequence = bytes[0] & ~FIRST_ENTRY_OF_LONG_NAME;
+            if ((bytes[0] & FIRST_ENTRY_OF_LONG_NAME) != 0)
+            {
+                expectedSequence = sequence <= MAX_LONG_NAME_ENTRY_COUNT ? sequence : 0;
+                sequenceCount = expectedSequence;
+                checksum = bytes[13];
+                hasLongName = FALSE;
+            }
+
+            // 順番号やチェックサムが合わない断片は、組み立て中の長い名前ごと捨てる
+            if (sequence == 0 || sequence != expectedSequence || bytes[13] != checksum)
+            {
+                expectedSequence = 0;
+                hasLongName = FALSE;
+                continue;
+            }
+
+            getLongNameUnits(longName + (sequence - 1) * LONG_NAME_LENGTH_PER_ENTRY, bytes);
+
+            expectedSequence--;
+            hasLongName = expectedSequence == 0;
+            continue;
+        }
+
+        // 直前の長い名前が、このエントリの短い名前のものであれば使う
+        if (hasLongName && getShortNameChecksum(bytes) == checksum)
+        {
+            decodeLongName(directory->name, longName, sequenceCount * LONG_NAME_LENGTH_PER_ENTRY);
+        }
+        else
+        {
+            decodeShortName(directory->name, bytes);
+        }
+
+        setDirEntry(directory, bytes, NO_CATALOG_INDEX);
+        *entryPointer = &directory->entry;
+        return 0;
+    }
+}
+
+// イテレータを閉じる
+void closeDir(Directory *directory)
+{
+    addStat(&directory->image->stats->slotCount, directory->slotCount);
+    if (directory->block != NULL)
+    {
+        unpinBlock(directory->image, directory->block);
+    }
+    free(directory->buffer);
+    free(directory);
+}
+#pragma endregion
+
+#pragma region File
+/**
+ * 指定されたエントリのポインタを開く
+ * 成功したら0、それ以外の場合はエラーコードを返す
+ */
+Result openFile(File **filePointer, Entry *entry)
+{
+    *filePointer = NULL;
+
+    if (!hasAttribute(entry, ARCHIVE))
+    {
+        return FAT_ERROR_NOT_FILE;
+    }
+
+    // ポインタの領域を確保する
+    File *file = *filePointer = malloc(sizeof(File));
+    if (file == NULL)
+    {
+        return FAT_ERROR_NO_MEMORY;
+    }
+
+    // ファイルのデータが格納されているクラスタの並びを求める
+    const Image *image = entry->image;
+    u32 clusterCount = ((u64)entry->size + image->clusterSize - 1) / image->clusterSize;
+    Result result = getExtents(&file->extents, &file->extentCount, image, entry->cluster, clusterCount);
+    if (result)
+    {
+        free(file);
+        *filePointer = NULL;
+        return result;
+    }
+
+    // メンバを初期化する
+    file->entry = entry;
+
+    lockImage(entry->image);
+    file->prevOpenedFile = NULL;
+    file->nextOpenedFile = entry->openedFile;
+    if (entry->openedFile != NULL)
+    {
+        entry->openedFile->prevOpenedFile = file;
+    }
+    entry->openedFile = file;
+    unlockImage(entry->image);
+
+    file->position = 0;
+    file->extentIndex = 0;
+    file->lastReadEnd = 0;
+    file->readAheadPosition = 0;
+    file->readAheadSize = 0;
+
+    return 0;
+}
+
+// ポインタを閉じる
+void closeFile(File *file)
+{
+    // エントリの開いているポインタからポインタを除外する
+    lockImage(file->entry->image);
+    if (file->prevOpenedFile == NULL)
+    {
+        file->entry->openedFile = file->nextOpenedFile;
+    }
+    else
+    {
+        file->prevOpenedFile->nextOpenedFile = file->nextOpenedFile;
+    }
+    if (file->nextOpenedFile != NULL)
+    {
+        file->nextOpenedFile->prevOpenedFile = file->prevOpenedFile;
+    }
+    unlockImage(file->entry->image);
+
+    free(file->extents);
+    free(file);
+}
+
+/**
+ * ファイルの中の指定された位置を含むクラスタの並びの添字を、二分探索で求める
+ * 位置がどの並びにも含まれない場合は並びの数を返す
+ */
+u32 findExtent(const File *file, u32 position)
+{
+    u32 clusterIndex = position / file->entry->image->clusterSize;
+
+    // 最初のクラスタの順番が位置以下である最後の並びを探す
+    u32 low = 0;
+    u32 high = file->extentCount;
+    while (low < high)
+    {
+        u32 middle = low + (high - low) / 2;
+        if (file->extents[middle].index <= clusterIndex)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+
+    if (low == 0)
+    {
+        return file->extentCount;
+    }
+
+    const Extent *extent = &file->extents[low - 1];
+    if (clusterIndex >= extent->index + extent->length)
+    {
+        return file->extentCount;
+    }
+    return low - 1;
+}
+
+/**
+ * ファイルの中の指定された位置から、指定された長さのバイト列を読み込む
+ * 連続したクラスタの並びごとに一度に読み込む
+ * 読み込みを始める並びの添字を受け取り、読み込みを終えた位置を含む並びの添字に更新する
+ * 実際に読み込まれたバイト列の長さを返す
+ */
+u32 readExtents(u8 *bytes, u32 size, const File *file, u32 position, u32 *extentIndexPointer)
+{
+    // 位置がファイルの終端に達していたら
+    if (position >= file->entry->size)
+    {
+        return 0;
+    }
+
+    // 指定されたバイト列の長さが読み込める範囲を超えていたら、範囲に収まるようにする
+    if (size > file->entry->size - position)
+    {
+        size = file->entry->size - position;
+    }
+
+    const Image *image = file->entry->image;
+    u32 extentIndex = *extentIndexPointer;
+
+    u32 readSize = 0;
+    while (readSize < size && extentIndex < file->extentCount)
+    {
+        const Extent *extent = &file->extents[extentIndex];
+        u64 extentPosition = (u64)image->clusterSize * extent->index;
+        u64 extentSize = (u64)image->clusterSize * extent->length;
+
+        // 現在の並びを読み終えていたら、次の並びに移る
+        u64 extentOffset = position - extentPosition;
+        if (extentOffset >= extentSize)
+        {
+            extentIndex++;
+            continue;
+        }
+
+        // 並びの残りのうち、必要な分を一度に読み込む
+        u64 chunkSize = extentSize - extentOffset;
+        if (chunkSize > size - readSize)
+        {
+            chunkSize = size - readSize;
+        }
+
+        // ファイルの中身でFATやディレクトリのブロックを追い出さないように、キャッシュを通さずに読み込む
+        u64 offset = getDataOffset(image, extent->cluster) + extentOffset;
+        u64 chunkReadSize = __readImage(image, bytes + readSize, offset, chunkSize);
+        readSize += chunkReadSize;
+        position += chunkReadSize;
+
+        if (chunkReadSize < chunkSize)
+        {
+            break;
+        }
+    }
+
+    *extentIndexPointer = extentIndex;
+    return readSize;
+}
+
+/**
+ * ファイルの中の指定された範囲を先読みする
+ * 近くにあるクラスタの並びは1つの範囲にまとめて、OSに伝える回数を減らす
+ */
+void prefetchFile(const File *file, u32 position, u32 size)
+{
+    const Image *image = file->entry->image;
+
+    // まとめている途中の範囲
+    u64 rangeStart = 0;
+    u64 rangeEnd = 0;
+
+    for (u32 i = findExtent(file, position); i < file->extentCount && size > 0; ++i)
+    {
+        const Extent *extent = &file->extents[i];
+        u64 extentOffset = position - (u64)image->clusterSize * extent->index;
+        u64 chunkSize = (u64)image->clusterSize * extent->length - extentOffset;
+        if (chunkSize > size)
+        {
+            chunkSize = size;
+        }
+
+        u64 chunkStart = getDataOffset(image, extent->cluster) + extentOffset;
+        u64 chunkEnd = chunkStart + chunkSize;
+        if (rangeEnd != 0 && chunkStart <= rangeEnd + READ_AHEAD_MERGE_GAP && chunkEnd + READ_AHEAD_MERGE_GAP >= rangeStart)
+        {
+            rangeStart = chunkStart < rangeStart ? chunkStart : rangeStart;
+            rangeEnd = chunkEnd > rangeEnd ? chunkEnd : rangeEnd;
+        }
+        else
+        {
+            if (rangeEnd != 0)
+            {
+                prefetchImage(image, rangeStart, rangeEnd - rangeStart);
+            }
+            rangeStart = chunkStart;
+            rangeEnd = chunkEnd;
+        }
+
+        position += chunkSize;
+        size -= chunkSize;
+    }
+
+    if (rangeEnd != 0)
+    {
+        prefetchImage(image, rangeStart, rangeEnd - rangeStart);
+    }
+}
+
+/**
+ * 読み込みが直前の読み込みの続きであれば、これから読み込む範囲の先を先読みする
+ * 続きである間は先読みする範囲を広げ、途切れたら先読みをやめる
+ */
+void updateReadAhead(File *file, u32 size)
+{
+    u32 maxReadAheadSize = file->entry->image->maxReadAheadSize;
+    if (maxReadAheadSize == 0)
+    {
+        return;
+    }
+
+    // 別の位置に移動してから読み込む場合は、連続した読み込みとみなさない
+    u32 position = file->position;
+    if (position != file->lastReadEnd)
+    {
+        file->readAheadPosition = position;
+        file->readAheadSize = 0;
+        return;
+    }
+
+    // 先読みした範囲の残りが半分以上あれば、まだ先読みしない
+    u64 end = (u64)position + size;
+    if (file->readAheadSize != 0 && file->readAheadPosition >= end + file->readAheadSize / 2)
+    {
+        return;
+    }
+
+    // 先読みする範囲を倍々に広げる
+    u32 readAheadSize = file->readAheadSize == 0 ? MIN_READ_AHEAD_SIZE : file->readAheadSize * 2;
+    if (readAheadSize > maxReadAheadSize || readAheadSize < file->readAheadSize)
+    {
+        readAheadSize = maxReadAheadSize;
+    }
+    file->readAheadSize = readAheadSize;
+
+    u64 readAheadEnd = end + readAheadSize;
+    if (readAheadEnd > file->entry->size)
+    {
+        readAheadEnd = file->entry->size;
+    }
+
+    // まだ先読みしていない部分だけを先読みする
+    u32 start = file->readAheadPosition > position ? file->readAheadPosition : position;
+    if (start < readAheadEnd)
+    {
+        prefetchFile(file, start, readAheadEnd - start);
+        file->readAheadPosition = readAheadEnd;
+    }
+}
+
+/**
+ * 指定されたポインタから、指定された長さのバイト列を読み込む
+ * 連続して読み込んでいる間は、続きを先読みする
+ * 実際に読み込まれたバイト列の長さを返す
+ */
+u32 readFile(u8 *bytes, u32 size, File *file)
+{
+    u64 start = getNanoseconds();
+    updateReadAhead(file, size);
+
+    u32 readSize = readExtents(bytes, size, file, file->position, &file->extentIndex);
+    file->position += readSize;
+    file->lastReadEnd = file->position;
+
+    ImageStats *stats = file->entry->image->stats;
+    addStat(&stats->readFileCount, 1);
+    addStat(&stats->readFileNanoseconds, getNanoseconds() - start);
+    return readSize;
+}
+
+/**
+ * ポインタの位置を変えずに、ファイルの中の指定された位置から指定された長さのバイト列を読み込む
+ * 実際に読み込まれたバイト列の長さを返す
+ */
+u32 preadFile(const File *file, u8 *bytes, u32 size, u32 position)
+{
+    u32 extentIndex = findExtent(file, position);
+    return readExtents(bytes, size, file, position, &extentIndex);
+}
+
+#ifdef HAS_POSIX_IO
+/**
+ * ポインタの位置を変えずに、ファイルの中の指定された位置から指定された長さのバイト列をディスクリプタに書き出す
+ * 連続したクラスタの並びごとに、FATイメージからカーネルの中でコピーする
+ * 実際に書き出されたバイト列の長さを返す
+ */
+u32 copyFileTo(s32 fd, const File *file, u32 position, u32 size)
+{
+    if (position >= file->entry->size)
+    {
+        return 0;
+    }
+    if (size > file->entry->size - position)
+    {
+        size = file->entry->size - position;
+    }
+
+    const Image *image = file->entry->image;
+    CopyMethod method = getCopyMethod(fd);
+
+    u32 copiedSize = 0;
+    for (u32 i = findExtent(file, position); i < file->extentCount && copiedSize < size; ++i)
+    {
+        const Extent *extent = &file->extents[i];
+        u64 extentOffset = position - (u64)image->clusterSize * extent->index;
+        u64 chunkSize = (u64)image->clusterSize * extent->length - extentOffset;
+        if (chunkSize > size - copiedSize)
+        {
+            chunkSize = size - copiedSize;
+        }
+
+        u64 chunkCopiedSize = copyImage(image, fd, getDataOffset(image, extent->cluster) + extentOffset, chunkSize, &method);
+        copiedSize += chunkCopiedSize;
+        position += chunkCopiedSize;
+
+        if (chunkCopiedSize < chunkSize)
+        {
+            break;
+        }
+    }
+    return copiedSize;
+}
+#endif
+
+/**
+ * ポインタの位置を、基準となる位置(SEEK_SET、SEEK_CUR、SEEK_END)からの相対位置に移動させる
+ * 成功したら0、それ以外の場合はエラーコードを返す
+ */
+Result seekFile(File *file, s64 offset, s32 whence)
+{
+    addStat(&file->entry->image->stats->seekCount, 1);
+
+    s64 base;
+    switch (whence)
+    {
+    case SEEK_SET:
+        base = 0;
+        break;
+    case SEEK_CUR:
+        base = file->position;
+        break;
+    case SEEK_END:
+        base = file->entry->size;
+        break;
+    default:
+        return FAT_ERROR_INVALID_ARGUMENT;
+    }
+
+    // ファイルの範囲外には移動できない
+    s64 position = base + offset;
+    if (position < 0 || position > file->entry->size)
+    {
+        return FAT_ERROR_INVALID_ARGUMENT;
+    }
+
+    file->position = position;
+    file->extentIndex = findExtent(file, file->position);
+    return 0;
+}
+#pragma endregion
+
+#pragma region Read queue
+typedef struct __ReadRequest ReadRequest;
+
+// 非同期の読み込みの要求を表す
+typedef struct __ReadRequest
+{
+    /**
+     * 読み込むファイルのポインタ
+     * NULLの場合はoffsetをFATイメージの中の位置とみなす
+     * ポインタの位置は使わず、変更もしない
+     */
+    const File *file;
+
+    // 読み込みを始める位置
+    u64 offset;
+
+    // 読み込み先のバイト列
+    u8 *bytes;
+
+    // 読み込むバイト数
+    u32 size;
+
+    // 完了したときに、実際に読み込まれたバイト数が設定される
+    u32 readSize;
+
+    // 呼び出し元が自由に使う値
+    void *userData;
+
+    // 完了していない断片の数
+    u32 pendingCount;
+
+    // 完了した要求の連結リストで次の要求
+    ReadRequest *nextCompletedRequest;
+} ReadRequest;
+
+// 要求を連続したクラスタの並びごとに分けた、読み込みの断片を表す
+typedef struct __ReadSlot
+{
+    // 断片を含む要求
+    ReadRequest *request;
+
+    // 読み込み先のバイト列
+    u8 *bytes;
+
+    // FATイメージの中の位置
+    u64 offset;
+
+    // 読み込むバイト数
+    u32 size;
+} ReadSlot;
+
+/**
+ * 複数の読み込みをまとめて発行し、完了したものから受け取るキュー
+ * io_uringを使える環境では、最大で深さの数の断片を同時に読み込ませる
+ * 使えない環境では、要求を受け付けたときに読み込みを済ませる
+ * 1つのキューは1つのスレッドから使う
+ */
+typedef struct __ReadQueue
+{
+    // 読み込むFATイメージ
+    const Image *image;
+
+    // 同時に読み込ませる断片の数の上限
+    u32 depth;
+
+    // 断片の領域
+    ReadSlot *slots;
+
+    // 空いている断片の添字のスタック
+    u32 *freeSlots;
+    u32 freeSlotCount;
+
+    // 完了した要求の連結リストの先頭と末尾
+    ReadRequest *completedRequest;
+    ReadRequest *lastCompletedRequest;
+
+#ifdef HAS_IO_URING
+    // io_uringのディスクリプタ、使わない場合は-1
+    s32 ring;
+
+    // 投入キューと完了キューをマッピングした領域と、それぞれのバイト数
+    u8 *submissionRing;
+    u64 submissionRingSize;
+    u8 *completionRing;
+    u64 completionRingSize;
+
+    // 投入キューの要素をマッピングした領域と、そのバイト数
+    struct io_uring_sqe *submissions;
+    u64 submissionsSize;
+
+    // 投入キューの先頭、末尾、添字のマスク、要素の添字の配列
+    u32 *submissionHead;
+    u32 *submissionTail;
+    u32 *submissionMask;
+    u32 *submissionArray;
+
+    // 完了キューの先頭、末尾、添字のマスク、要素
+    u32 *completionHead;
+    u32 *completionTail;
+    u32 *completionMask;
+    struct io_uring_cqe *completions;
+
+    // 投入キューに追加したが、まだカーネルに渡していない断片の数
+    u32 unsubmittedCount;
+#endif
+} ReadQueue;
+
+#ifdef HAS_IO_URING
+/**
+ * io_uringを作成し、投入キューと完了キューをマッピングする
+ * 成功したら0、それ以外の場合は0以外を返す
+ */
+Result setupRing(ReadQueue *queue)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    s32 ring = syscall(__NR_io_uring_setup, queue->depth, &params);
+    if (ring < 0)
+    {
+        return 1;
+    }
+
+    queue->submissionRingSize = params.sq_off.array + params.sq_entries * sizeof(u32);
+    queue->completionRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+    // 1回でマッピングできる場合は、大きい方に合わせて投入キューと完了キューを共有する
+    Boolean singleMap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (singleMap && queue->completionRingSize > queue->submissionRingSize)
+    {
+        queue->submissionRingSize = queue->completionRingSize;
+    }
+
+    void *submissionRing = mmap(NULL, queue->submissionRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQ_RING);
+    if (submissionRing == MAP_FAILED)
+    {
+        close(ring);
+        return 2;
+    }
+
+    void *completionRing = submissionRing;
+    if (!singleMap)
+    {
+        completionRing = mmap(NULL, queue->completionRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_CQ_RING);
+        if (completionRing == MAP_FAILED)
+        {
+            munmap(submissionRing, queue->submissionRingSize);
+            close(ring);
+            return 3;
+        }
+    }
+
+    queue->submissionsSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    void *submissions = mmap(NULL, queue->submissionsSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQES);
+    if (submissions == MAP_FAILED)
+    {
+        if (!singleMap)
+        {
+            munmap(completionRing, queue->completionRingSize);
+        }
+        munmap(submissionRing, queue->submissionRingSize);
+        close(ring);
+        return 4;
+    }
+
+    queue->ring = ring;
+    queue->submissionRing = submissionRing;
+    queue->completionRing = completionRing;
+    queue->submissions = submissions;
+
+    queue->submissionHead = (u32 *)(queue->submissionRing + params.sq_off.head);
+    queue->submissionTail = (u32 *)(queue->submissionRing + params.sq_off.tail);
+    queue->submissionMask = (u32 *)(queue->submissionRing + params.sq_off.ring_mask);
+    queue->submissionArray = (u32 *)(queue->submissionRing + params.sq_off.array);
+
+    queue->completionHead = (u32 *)(queue->completionRing + params.cq_off.head);
+    queue->completionTail = (u32 *)(queue->completionRing + params.cq_off.tail);
+    queue->completionMask = (u32 *)(queue->completionRing + params.cq_off.ring_mask);
+    queue->completions = (struct io_uring_cqe *)(queue->completionRing + params.cq_off.cqes);
+
+    queue->unsubmittedCount = 0;
+    return 0;
+}
+
+// io_uringのマッピングを解除して閉じる
+void teardownRing(ReadQueue *queue)
+{
+    munmap(queue->submissions, queue->submissionsSize);
+    if (queue->completionRing != queue->submissionRing)
+    {
+        munmap(queue->completionRing, queue->completionRingSize);
+    }
+    munmap(queue->submissionRing, queue->submissionRingSize);
+    close(queue->ring);
+    queue->ring = -1;
+}
+#endif
+
+/**
+ * 読み込みのキューを作成する
+ * 深さにはFATイメージを開くときのオプションで指定した値を使う
+ * io_uringを使えない場合は、要求を受け付けたときに読み込むキューになる
+ * 成功したら0、それ以外の場合は0以外を返す
+ */
+Result createReadQueue(ReadQueue **queuePointer, const Image *image)
+{
+    ReadQueue *queue = *queuePointer = malloc(sizeof(ReadQueue));
+    if (queue == NULL)
+    {
+        return 1;
+    }
+
+    queue->image = image;
+    queue->depth = image->readQueueDepth == 0 ? 1 : image->readQueueDepth;
+    queue->completedRequest = NULL;
+    queue->lastCompletedRequest = NULL;
+
+    queue->slots = malloc(queue->depth * sizeof(ReadSlot));
+    queue->freeSlots = malloc(queue->depth * sizeof(u32));
+    if (queue->slots == NULL || queue->freeSlots == NULL)
+    {
+        free(queue->slots);
+        free(queue->freeSlots);
+        free(queue);
+        *queuePointer = NULL;
+        return 2;
+    }
+
+    // 小さい添字から使うように、スタックの末尾に0を置く
+    queue->freeSlotCount = queue->depth;
+    for (u32 i = 0; i < queue->depth; ++i)
+    {
+        queue->freeSlots[i] = queue->depth - 1 - i;
+    }
+
+#ifdef HAS_IO_URING
+    // io_uringを作成できなかった場合は、要求を受け付けたときに読み込む
+    queue->ring = -1;
+    if (image->readQueueDepth > 0)
+    {
+        setupRing(queue);
+    }
+#endif
+
+    return 0;
+}
+
+// 要求の断片が1つ完了したことを記録し、すべて完了したら完了した要求の連結リストの末尾に追加する
+void completeReadPart(ReadQueue *queue, ReadRequest *request)
+{
+    if (--request->pendingCount > 0)
+    {
+        return;
+    }
+
+    request->nextCompletedRequest = NULL;
+    if (queue->lastCompletedRequest == NULL)
+    {
+        queue->completedRequest = request;
+    }
+    else
+    {
+        queue->lastCompletedRequest->nextCompletedRequest = request;
+    }
+    queue->lastCompletedRequest = request;
+}
+
+#ifdef HAS_IO_URING
+/**
+ * 断片の読み込みが完了したことを記録し、断片の領域を空ける
+ * 途中までしか読み込めなかった場合や失敗した場合は、残りをその場で読み込む
+ */
+void finishReadSlot(ReadQueue *queue, u32 index, s32 result)
+{
+    ReadSlot *slot = &queue->slots[index];
+    u64 readSize = result > 0 ? result : 0;
+    addStat(&queue->image->stats->readCount, 1);
+    addStat(&queue->image->stats->readByteCount, readSize);
+    if (readSize < slot->size)
+    {
+        readSize += __readImage(queue->image, slot->bytes + readSize, slot->offset + readSize, slot->size - readSize);
+    }
+
+    slot->request->readSize += readSize;
+    queue->freeSlots[queue->freeSlotCount++] = index;
+    completeReadPart(queue, slot->request);
+}
+
+// 完了キューに届いている断片をすべて受け取る
+void reapRing(ReadQueue *queue)
+{
+    u32 head = *queue->completionHead;
+    u32 tail = __atomic_load_n(queue->completionTail, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head)
+    {
+        const struct io_uring_cqe *completion = &queue->completions[head & *queue->completionMask];
+        finishReadSlot(queue, completion->user_data, completion->res);
+    }
+    __atomic_store_n(queue->completionHead, head, __ATOMIC_RELEASE);
+}
+
+/**
+ * 投入キューに追加した断片をカーネルに渡し、指定された数の断片が完了するまで待機する
+ * 渡せなかった断片はその場で読み込み、以降はio_uringを使わない
+ */
+void enterRing(ReadQueue *queue, u32 waitCount)
+{
+    while (queue->unsubmittedCount > 0 || waitCount > 0)
+    {
+        u32 flags = waitCount > 0 ? IORING_ENTER_GETEVENTS : 0;
+        long submittedCount = syscall(__NR_io_uring_enter, queue->ring, queue->unsubmittedCount, waitCount, flags, NULL, 0);
+        if (submittedCount >= 0)
+        {
+            queue->unsubmittedCount -= submittedCount;
+            if (waitCount == 0 || *queue->completionHead != __atomic_load_n(queue->completionTail, __ATOMIC_ACQUIRE))
+            {
+                return;
+            }
+            continue;
+        }
+
+        if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+        {
+            continue;
+        }
+
+        // 渡せなかった断片は投入キューの末尾に並んでいるので、その場で読み込む
+        u32 tail = *queue->submissionTail;
+        for (u32 i = tail - queue->unsubmittedCount; i != tail; ++i)
+        {
+            const struct io_uring_sqe *submission = &queue->submissions[queue->submissionArray[i & *queue->submissionMask]];
+            finishReadSlot(queue, submission->user_data, 0);
+        }
+        queue->unsubmittedCount = 0;
+
+        // 既に渡した断片はカーネルが読み込むので、完了キューに届くのを待つ
+        while (queue->freeSlotCount < queue->depth)
+        {
+            if (*queue->completionHead == __atomic_load_n(queue->completionTail, __ATOMIC_ACQUIRE))
+            {
+                sched_yield();
+                continue;
+            }
+            reapRing(queue);
+        }
+
+        teardownRing(queue);
+        return;
+    }
+}
+
+// どれかの断片が完了するまで待機し、完了した断片を受け取る
+void waitRing(ReadQueue *queue)
+{
+    enterRing(queue, 1);
+    if (queue->ring >= 0)
+    {
+        reapRing(queue);
+    }
+}
+#endif
+
+/**
+ * 要求の断片を1つ読み込みに出す
+ * 同時に読み込ませている断片が深さに達している場合は、どれかが完了するまで待機する
+ */
+void addReadPart(ReadQueue *queue, ReadRequest *request, u8 *bytes, u64 offset, u32 size)
+{
+    request->pendingCount++;
+
+#ifdef HAS_IO_URING
+    if (queue->ring >= 0 && queue->freeSlotCount == 0)
+    {
+        waitRing(queue);
+    }
+
+    if (queue->ring >= 0)
+    {
+        u32 index = queue->freeSlots[--queue->freeSlotCount];
+        ReadSlot *slot = &queue->slots[index];
+        slot->request = request;
+        slot->bytes = bytes;
+        slot->offset = offset;
+        slot->size = size;
+
+        // 投入キューの末尾に断片を追加する
+        u32 tail = *queue->submissionTail;
+        u32 submissionIndex = tail & *queue->submissionMask;
+        struct io_uring_sqe *submission = &queue->submissions[submissionIndex];
+        memset(submission, 0, sizeof(struct io_uring_sqe));
+        submission->opcode = IORING_OP_READ;
+        submission->fd = queue->image->fd;
+        submission->addr = (unsigned long)bytes;
+        submission->len = size;
+        submission->off = offset;
+        submission->user_data = index;
+        queue->submissionArray[submissionIndex] = submissionIndex;
+        __atomic_store_n(queue->submissionTail, tail + 1, __ATOMIC_RELEASE);
+        queue->unsubmittedCount++;
+        return;
+    }
+#endif
+
+    request->readSize += __readImage(queue->image, bytes, offset, size);
+    completeReadPart(queue, request);
+}
+
+/**
+ * 読み込みの要求をキューに追加する
+ * ファイルの読み込みは連続したクラスタの並びごとの断片に分けて、まとめて読み込みに出す
+ * 要求は完了してwaitReadで受け取るまで、呼び出し元が保持しておく
+ */
+void submitRead(ReadQueue *queue, ReadRequest *request)
+{
+    request->readSize = 0;
+    request->nextCompletedRequest = NULL;
+
+    // 断片をすべて出し終えるまで完了しないように、1つ多く数えておく
+    request->pendingCount = 1;
+
+    const File *file = request->file;
+    if (file == NULL)
+    {
+        addReadPart(queue, request, request->bytes, request->offset, request->size);
+    }
+    else if (request->offset < file->entry->size)
+    {
+        const Image *image = queue->image;
+        u64 position = request->offset;
+        u32 size = request->size;
+        if (size > file->entry->size - position)
+        {
+            size = file->entry->size - position;
+        }
+
+        u32 queuedSize = 0;
+        for (u32 i = findExtent(file, position); i < file->extentCount && queuedSize < size; ++i)
+        {
+            const Extent *extent = &file->extents[i];
+            u64 extentOffset = position - (u64)image->clusterSize * extent->index;
+            u64 chunkSize = (u64)image->clusterSize * extent->length - extentOffset;
+            if (chunkSize > size - queuedSize)
+            {
+                chunkSize = size - queuedSize;
+            }
+
+            addReadPart(queue, request, request->bytes + queuedSize, getDataOffset(image, extent->cluster) + extentOffset, chunkSize);
+            position += chunkSize;
+            queuedSize += chunkSize;
+        }
+    }
+
+#ifdef HAS_IO_URING
+    if (queue->ring >= 0)
+    {
+        enterRing(queue, 0);
+    }
+#endif
+
+    completeReadPart(queue, request);
+}
+
+/**
+ * 完了した要求を1つ受け取る
+ * 完了した要求がなければ、どれかが完了するまで待機する
+ * 読み込み中の要求がない場合はNULLを設定する
+ */
+void waitRead(ReadRequest **requestPointer, ReadQueue *queue)
+{
+#ifdef HAS_IO_URING
+    while (queue->completedRequest == NULL && queue->ring >= 0 && queue->freeSlotCount < queue->depth)
+    {
+        waitRing(queue);
+    }
+#endif
+
+    ReadRequest *request = *requestPointer = queue->completedRequest;
+    if (request != NULL)
+    {
+        queue->completedRequest = request->nextCompletedRequest;
+        if (queue->completedRequest == NULL)
+        {
+            queue->lastCompletedRequest = NULL;
+        }
+    }
+}
+
+/**
+ * 読み込みのキューを破棄する
+ * 読み込み中の要求が完了するのを待ってから破棄する
+ */
+void destroyReadQueue(ReadQueue *queue)
+{
+#ifdef HAS_IO_URING
+    while (queue->ring >= 0 && queue->freeSlotCount < queue->depth)
+    {
+        waitRing(queue);
+    }
+    if (queue->ring >= 0)
+    {
+        teardownRing(queue);
+    }
+#endif
+
+    free(queue->slots);
+    free(queue->freeSlots);
+    free(queue);
+}
+#pragma endregion
+
+#pragma region Extraction
+#ifdef HAS_POSIX_IO
+// 展開に使うスレッドの数を取得する
+u32 getExtractWorkerCount()
+{
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? count : 1;
+}
+#endif
+
+// 展開は失敗したパスを標準エラー出力に表示するので、ライブラリとしてビルドする場合は含めない
+#if defined(HAS_POSIX_IO) && !defined(FAT_LIBRARY)
+/**
+ * 展開先のホストのディレクトリを表す
+ * 子エントリはこのディレクトリからの相対で作成するので、子エントリの作業がすべて終わるまで開いておく
+ */
+typedef struct __HostDirectory
+{
+    // ディレクトリのディスクリプタ
+    s32 fd;
+
+    // ディレクトリを参照している作業の数
+    u32 referenceCount;
+} HostDirectory;
+
+// 展開の作業を表す
+typedef struct __ExtractTask
+{
+    // 展開するエントリ
+    Entry *entry;
+
+    // 展開先の親ディレクトリ
+    HostDirectory *parent;
+
+    // 表示に使う展開先のパス
+    char *path;
+
+    /**
+     * 親ディレクトリの中に作成する名前、pathの末尾を指す
+     * NULLの場合は、親ディレクトリ自体に子エントリを展開する
+     */
+    const char *name;
+} ExtractTask;
+
+/**
+ * 作業者ごとの作業の両端キュー
+ * 持ち主は末尾から取り出し、他の作業者は先頭から盗む
+ */
+typedef struct __TaskDeque
+{
+    pthread_mutex_t lock;
+
+    // 作業を格納する領域
+    ExtractTask *tasks;
+
+    // 作業を格納する領域の大きさ
+    u32 capacity;
+
+    // 先頭の作業の添字
+    u32 head;
+
+    // 末尾の作業の次の添字
+    u32 tail;
+} TaskDeque;
+
+// 展開の結果を表す
+typedef struct __ExtractStats
+{
+    // 展開したファイルの数
+    u64 fileCount;
+
+    // 作成したディレクトリの数
+    u64 directoryCount;
+
+    // 書き込んだバイト数
+    u64 byteCount;
+
+    // 展開に失敗したエントリの数
+    u64 errorCount;
+
+    // 展開にかかった秒数
+    double seconds;
+} ExtractStats;
+
+// 展開を行うスレッドプールを表す
+typedef struct __ExtractPool
+{
+    // 展開するエントリを含むFATイメージ
+    const Image *image;
+
+    // 作業者ごとの作業の両端キュー
+    TaskDeque *deques;
+
+    // 作業者の数
+    u32 workerCount;
+
+    // 作業がないときに待機するためのロックと条件変数
+    pthread_mutex_t lock;
+    pthread_cond_t condition;
+
+    // キューに入っている作業の数
+    u32 queuedCount;
+
+    // キューに入ったがまだ終わっていない作業の数
+    u32 pendingCount;
+
+    // 展開の結果
+    ExtractStats stats;
+} ExtractPool;
+
+// 作業者のスレッドに渡す引数
+typedef struct __ExtractWorker
+{
+    ExtractPool *pool;
+
+    // 作業者の番号
+    u32 index;
+} ExtractWorker;
+
+// ファイルの読み書きに使うバッファのバイト数
+#define EXTRACT_BUFFER_SIZE (1024 * 1024)
+
+// 1つのファイルについて同時に読み込ませる要求の数、バッファを等分して使う
+#define EXTRACT_REQUEST_COUNT 8
+
+/**
+ * 開いたディスクリプタから展開先のディレクトリを作成する
+ * 作成できなかった場合はディスクリプタを閉じる
+ * 成功したら0、それ以外の場合は0以外を返す
+ */
+Result createHostDirectory(HostDirectory **directoryPointer, s32 fd)
+{
+    HostDirectory *directory = *directoryPointer = malloc(sizeof(HostDirectory));
+    if (directory == NULL)
+    {
+        close(fd);
+        return 1;
+    }
+    directory->fd = fd;
+    directory->referenceCount = 1;
+    return 0;
+}
+
+// 展開先のディレクトリの参照を増やす
+void retainHostDirectory(HostDirectory *directory)
+{
+    __atomic_add_fetch(&directory->referenceCount, 1, __ATOMIC_RELAXED);
+}
+
+// 展開先のディレクトリの参照を減らし、参照がなくなったら閉じる
+void releaseHostDirectory(HostDirectory *directory)
+{
+    if (__atomic_sub_fetch(&directory->referenceCount, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        close(directory->fd);
+        free(directory);
+    }
+}
+
+/**
+ * FATイメージの中の名前を、ホストのディレクトリの中にそのまま作成できるかどうかを返す
+ * 区切り文字や制御文字を含む名前、自身と親を指す名前は、展開先の外を指しうるので作成しない
+ */
+Boolean isSafeHostName(const char *name)
+{
+    if (name[0] == '\0' || strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+    {
+        return FALSE;
+    }
+    for (const u8 *c = (const u8 *)name; *c != '\0'; ++c)
+    {
+        if (*c == '/' || *c == '\\' || *c < 0x20 || *c == 0x7f)
+        {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/**
+ * 作業を指定された作業者のキューの末尾に追加する
+ * 作業は親ディレクトリの参照を1つ持つ
+ * 成功したら0、それ以外の場合は0以外を返す
+ */
+Result pushTask(ExtractPool *pool, u32 index, Entry *entry, HostDirectory *parent, char *path, const char *name)
+{
+    TaskDeque *deque = &pool->deques[index];
+
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail == deque->capacity)
+    {
+        if (deque->head > 0)
+        {
+            // 先頭の空きを詰める
+            memmove(deque->tasks, deque->tasks + deque->head, (deque->tail - deque->head) * sizeof(ExtractTask));
+            deque->tail -= deque->head;
+            deque->head = 0;
+        }
+        else
+        {
+            u32 capacity = deque->capacity == 0 ? 64 : deque->capacity * 2;
+            ExtractTask *tasks = realloc(deque->tasks, capacity * sizeof(ExtractTask));
+            if (tasks == NULL)
+            {
+                pthread_mutex_unlock(&deque->lock);
+                return 1;
+            }
+            deque->tasks = tasks;
+            deque->capacity = capacity;
+        }
+    }
+    deque->tasks[deque->tail].entry = entry;
+    deque->tasks[deque->tail].parent = parent;
+    deque->tasks[deque->tail].path = path;
+    deque->tasks[deque->tail].name = name;
+    deque->tail++;
+    pthread_mutex_unlock(&deque->lock);
+
+    // 待機している作業者を起こす
+    __atomic_add_fetch(&pool->pendingCount, 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&pool->queuedCount, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_lock(&pool->lock);
+    pthread_cond_signal(&pool->condition);
+    pthread_mutex_unlock(&pool->lock);
+
+    return 0;
+}
+
+/**
+ * 指定された作業者のキューの末尾から作業を取り出す
+ * 取り出せたらTRUE、それ以外の場合はFALSEを返す
+ */
+Boolean popTask(ExtractPool *pool, u32 index, ExtractTask *task)
+{
+    TaskDeque *deque = &pool->deques[index];
+    Boolean found = FALSE;
+
+    pthread_mutex_lock(&deque->lock);
+    if (deque->head < deque->tail)
+    {
+        deque->tail--;
+        *task = deque->tasks[deque->tail];
+        found = TRUE;
+    }
+    pthread_mutex_unlock(&deque->lock);
+
+    if (found)
+    {
+        __atomic_sub_fetch(&pool->queuedCount, 1, __ATOMIC_SEQ_CST);
+    }
+    return found;
+}
+
+/**
+ * 指定された作業者以外のキューの先頭から作業を盗む
+ * 盗めたらTRUE、それ以外の場合はFALSEを返す
+ */
+Boolean stealTask(ExtractPool *pool, u32 index, ExtractTask *task)
+{
+    for (u32 i = 1; i < pool->workerCount; ++i)
+    {
+        TaskDeque *deque = &pool->deques[(index + i) % pool->workerCount];
+        Boolean found = FALSE;
+
+        pthread_mutex_lock(&deque->lock);
+        if (deque->head < deque->tail)
+        {
+            *task = deque->tasks[deque->head];
+            deque->head++;
+            found = TRUE;
+        }
+        pthread_mutex_unlock(&deque->lock);
+
+        if (found)
+        {
+            __atomic_sub_fetch(&pool->queuedCount, 1, __ATOMIC_SEQ_CST);
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/**
+ * 書き込みが終わるまで、指定された位置にバイト列を書き込む
+ * 成功したら0、それ以外の場合は0以外を返す
+ */
+Result writeAt(s32 fd, const u8 *bytes, u32 size, u64 offset)
+{
+    u32 writtenSize = 0;
+    while (writtenSize < size)
+    {
+        ssize_t chunkSize = pwrite(fd, bytes + writtenSize, size - writtenSize, offset + writtenSize);
+        if (chunkSize <= 0)
+        {
+            return 1;
+        }
+        writtenSize += chunkSize;
+    }
+    return 0;
+}
+
+/**
+ * ファイルのエントリを、指定されたディレクトリの中の指定された名前のファイルに書き出す
+ * 既存のファイルやシンボリックリンクには書き出さない
+ * バッファを分けた複数の範囲の読み込みを同時にキューに出し、完了した順に書き込む
+ * 成功したら0、それ以外の場合は0以外を返す
+ */
+Result extractFile(Entry *entry, const HostDirectory *parent, const char *name, u8 *buffer, ReadQueue *queue, u64 *byteCount)
+{
+    File *file;
+    Result result = openFile(&file, entry);
+    if (result)
+    {
+        return 1;
+    }
+
+    s32 fd = openat(parent->fd, name, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, 0644);
+    if (fd < 0)
+    {
+        closeFile(file);
+        return 2;
+    }
+
+    // 断片化を防ぐために、書き込む前に領域を確保しておく
+#ifdef HAS_FALLOCATE
+    if (entry->size > 0)
+    {
+        posix_fallocate(fd, 0, entry->size);
+    }
+#endif
+
+    // バッファの各部分に、ファイルの先頭から順に範囲を割り当てて読み込みに出す
+    u32 chunkSize = EXTRACT_BUFFER_SIZE / EXTRACT_REQUEST_COUNT;
+    ReadRequest requests[EXTRACT_REQUEST_COUNT];
+    u64 position = 0;
+    for (u32 i = 0; i < EXTRACT_REQUEST_COUNT && position < entry->size; ++i)
+    {
+        ReadRequest *request = &requests[i];
+        request->file = file;
+        request->offset = position;
+        request->bytes = buffer + (u64)chunkSize * i;
+        request->size = entry->size - position < chunkSize ? entry->size - position : chunkSize;
+        submitRead(queue, request);
+        position += request->size;
+    }
+
+    // 読み込みが完了した範囲を書き込み、空いた部分で次の範囲を読み込む
+    result = 0;
+    while (TRUE)
+    {
+        ReadRequest *request;
+        waitRead(&request, queue);
+        if (request == NULL)
+        {
+            break;
+        }
+
+        if (result == 0 && request->readSize != request->size)
+        {
+            result = 4;
+        }
+        if (result == 0 && writeAt(fd, request->bytes, request->readSize, request->offset))
+        {
+            result = 3;
+        }
+        if (result)
+        {
+            continue;
+        }
+        *byteCount += request->readSize;
+
+        if (position < entry->size)
+        {
+            request->offset = position;
+            request->size = entry->size - position < chunkSize ? entry->size - position : chunkSize;
+            submitRead(queue, request);
+            position += request->size;
+        }
+    }
+
+    if (close(fd) != 0 && result == 0)
+    {
+        result = 5;
+    }
+    closeFile(file);
+    return result;
+}
+
+/**
+ * ディレクトリのエントリを指定されたディレクトリの中に作成し、子エントリの展開を作業としてキューに追加する
+ * 名前がNULLの場合は、指定されたディレクトリに子エントリを展開する
+ * 既存のディレクトリには展開するが、シンボリックリンクはたどらない
+ * 成功したら0、それ以外の場合は0以外を返す
+ */
+Result extractDirectory(ExtractPool *pool, u32 index, Entry *entry, HostDirectory *parent, const char *path, const char *name)
+{
+    HostDirectory *directory = parent;
+    if (name == NULL)
+    {
+        retainHostDirectory(parent);
+    }
+    else
+    {
+        if (mkdirat(parent->fd, name, 0755) != 0 && errno != EEXIST)
+        {
+            return 1;
+        }
+        s32 fd = openat(parent->fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+        if (fd < 0 || createHostDirectory(&directory, fd))
+        {
+            return 1;
+        }
+    }
+
+    Entry **children;
+    s32 count = getChildren(&children, entry);
+
+    Result result = 0;
+    for (s32 i = 0; i < count; ++i)
+    {
+        Entry *child = children[i];
+
+        // 自身と親を指すエントリ、ボリュームのエントリは展開しない
+        if (strcmp(child->name, ".") == 0 || strcmp(child->name, "..") == 0 || hasAttribute(child, VOLUME_ID))
+        {
+            closeEntry(child);
+            continue;
+        }
+
+        // 展開先の外を指しうる名前のエントリは展開せず、失敗として数える
+        // 名前には制御文字が含まれうるので、親ディレクトリのパスだけを表示する
+        if (!isSafeHostName(child->name))
+        {
+            fprintf(stderr, "Skipped unsafe name in: %s\n", path);
+            __atomic_add_fetch(&pool->stats.errorCount, 1, __ATOMIC_RELAXED);
+            closeEntry(child);
+            continue;
+        }
+
+        s32 length = snprintf(NULL, 0, "%s/%s", path, child->name);
+        char *childPath = length < 0 ? NULL : malloc(length + 1);
+        if (childPath == NULL)
+        {
+            closeEntry(child);
+            result = 2;
+            continue;
+        }
+        snprintf(childPath, length + 1, "%s/%s", path, child->name);
+
+        retainHostDirectory(directory);
+        if (pushTask(pool, index, child, directory, childPath, childPath + length - strlen(child->name)))
+        {
+            releaseHostDirectory(directory);
+            free(childPath);
+            closeEntry(child);
+            result = 3;
+        }
+    }
+
+    free(children);
+    releaseHostDirectory(directory);
+    return result;
+}
+
+// 作業が終わったことを記録する
+void finishTask(ExtractPool *pool)
+{
+    if (__atomic_sub_fetch(&pool->pendingCount, 1, __ATOMIC_SEQ_CST) == 0)
+    {
+        // すべての作業が終わったら、待機している作業者を起こして終了させる
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_broadcast(&pool->condition);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+// 作業者のスレッドの処理
+void *runExtractWorker(void *argument)
+{
+    ExtractWorker *worker = argument;
+    ExtractPool *pool = worker->pool;
+
+    u8 *buffer = malloc(EXTRACT_BUFFER_SIZE);
+
+    // 作業者ごとに読み込みのキューを使う
+    ReadQueue *queue;
+    if (createReadQueue(&queue, worker->pool->image))
+    {
+        queue = NULL;
+    }
+
+    while (TRUE)
+    {
+        ExtractTask task;
+        if (popTask(pool, worker->index, &task) || stealTask(pool, worker->index, &task))
+        {
+            Result result;
+            u64 byteCount = 0;
+            if (hasAttribute(task.entry, DIRECTORY))
+            {
+                result = extractDirectory(pool, worker->index, task.entry, task.parent, task.path, task.name);
+                if (result == 0)
+                {
+                    __atomic_add_fetch(&pool->stats.directoryCount, 1, __ATOMIC_RELAXED);
+                }
+            }
+            else if (hasAttribute(task.entry, ARCHIVE) && buffer != NULL && queue != NULL)
+            {
+                result = extractFile(task.entry, task.parent, task.name, buffer, queue, &byteCount);
+                if (result == 0)
+                {
+                    __atomic_add_fetch(&pool->stats.fileCount, 1, __ATOMIC_RELAXED);
+                }
+            }
+            else
+            {
+                result = 1;
+            }
+
+            __atomic_add_fetch(&pool->stats.byteCount, byteCount, __ATOMIC_RELAXED);
+            if (result)
+            {
+                fprintf(stderr, "Failed to extract: %s (%d)\n", task.path, result);
+                __atomic_add_fetch(&pool->stats.errorCount, 1, __ATOMIC_RELAXED);
+            }
+
+            releaseHostDirectory(task.parent);
+            closeEntry(task.entry);
+            free(task.path);
+            finishTask(pool);
+            continue;
+        }
+
+        // 盗める作業がなければ、作業が追加されるかすべての作業が終わるまで待機する
+        pthread_mutex_lock(&pool->lock);
+        while (__atomic_load_n(&pool->queuedCount, __ATOMIC_SEQ_CST) == 0 &&
+               __atomic_load_n(&pool->pendingCount, __ATOMIC_SEQ_CST) > 0)
+        {
+            pthread_cond_wait(&pool->condition, &pool->lock);
+        }
+        Boolean finished = __atomic_load_n(&pool->pendingCount, __ATOMIC_SEQ_CST) == 0;
+        pthread_mutex_unlock(&pool->lock);
+
+        if (finished)
+        {
+            break;
+        }
+    }
+
+    if (queue != NULL)
+    {
+        destroyReadQueue(queue);
+    }
+    free(buffer);
+    return NULL;
+}
+
+/**
+ * 指定されたエントリ以下の階層構造を、ホストのファイルシステムの指定されたディレクトリに展開する
+ * ディレクトリは子エントリを作業として分割し、ファイルは複数のスレッドで並列に書き出す
+ * 成功したら0、それ以外の場合は0以外を返す
+ */
+Result extractEntry(ExtractStats *stats, const Entry *root, const char *destination, u32 workerCount)
+{
+    memset(stats, 0, sizeof(ExtractStats));
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // 展開先のディレクトリを作成して開き、以降はこのディレクトリからの相対で作成する
+    if (mkdir(destination, 0755) != 0 && errno != EEXIST)
+    {
+        return 1;
+    }
+    s32 destinationFd = open(destination, O_RDONLY | O_DIRECTORY);
+    HostDirectory *destinationDirectory;
+    if (destinationFd < 0 || createHostDirectory(&destinationDirectory, destinationFd))
+    {
+        return 1;
+    }
+
+    ExtractPool pool;
+    memset(&pool, 0, sizeof(pool));
+    pool.image = root->image;
+    pool.workerCount = workerCount == 0 ? 1 : workerCount;
+    pool.deques = calloc(pool.workerCount, sizeof(TaskDeque));
+    if (pool.deques == NULL)
+    {
+        releaseHostDirectory(destinationDirectory);
+        return 2;
+    }
+    for (u32 i = 0; i < pool.workerCount; ++i)
+    {
+        pthread_mutex_init(&pool.deques[i].lock, NULL);
+    }
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.condition, NULL);
+
+    // 最初の作業を追加する
+    Entry *entry;
+    Result result = copyEntry(&entry, root);
+    char *path = NULL;
+    const char *name = NULL;
+    if (result == 0)
+    {
+        if (hasAttribute(root, DIRECTORY))
+        {
+            path = strdup(destination);
+        }
+        else if (isSafeHostName(root->name))
+        {
+            s32 length = snprintf(NULL, 0, "%s/%s", destination, root->name);
+            path = length < 0 ? NULL : malloc(length + 1);
+            if (path != NULL)
+            {
+                snprintf(path, length + 1, "%s/%s", destination, root->name);
+                name = path + length - strlen(root->name);
+            }
+        }
+
+        retainHostDirectory(destinationDirectory);
+        if (path == NULL || pushTask(&pool, 0, entry, destinationDirectory, path, name))
+        {
+            releaseHostDirectory(destinationDirectory);
+            free(path);
+            closeEntry(entry);
+            result = 3;
+        }
+    }
+
+    // 作業者のスレッドを起動し、すべての作業が終わるのを待つ
+    if (result == 0)
+    {
+        pthread_t *threads = malloc(pool.workerCount * sizeof(pthread_t));
+        ExtractWorker *workers = malloc(pool.workerCount * sizeof(ExtractWorker));
+        u32 startedCount = 0;
+        if (threads != NULL && workers != NULL)
+        {
+            for (; startedCount < pool.workerCount; ++startedCount)
+            {
+                workers[startedCount].pool = &pool;
+                workers[startedCount].index = startedCount;
+                if (pthread_create(&threads[startedCount], NULL, runExtractWorker, &workers[startedCount]) != 0)
+                {
+                    break;
+                }
+            }
+        }
+
+        if (startedCount == 0)
+        {
+            // スレッドを起動できなかったら、このスレッドで作業を行う
+            ExtractWorker worker = {&pool, 0};
+            runExtractWorker(&worker);
+        }
+
+        for (u32 i = 0; i < startedCount; ++i)
+        {
+            pthread_join(threads[i], NULL);
+        }
+
+        free(workers);
+        free(threads);
+    }
+
+    for (u32 i = 0; i < pool.workerCount; ++i)
+    {
+        pthread_mutex_destroy(&pool.deques[i].lock);
+        free(pool.deques[i].tasks);
+    }
+    free(pool.deques);
+    pthread_mutex_destroy(&pool.lock);
+    pthread_cond_destroy(&pool.condition);
+    releaseHostDirectory(destinationDirectory);
+
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    *stats = pool.stats;
+    stats->seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    if (result == 0 && stats->errorCount > 0)
+    {
+        result = 4;
+    }
+    return result;
+}
+
+#endif
+#pragma endregion
+
+#pragma region Check
+// 記録する問題の数の上限、それ以降は種類ごとの数だけを数える
+#define MAX_CHECK_PROBLEM_COUNT 100
+
+// 検査で見つかる問題の種類
+typedef enum __CheckProblemType
+{
+    // 複数のチェーンが同じクラスタを使っている
+    CHECK_CROSS_LINK,
+
+    // チェーンが自身のクラスタに戻って循環している
+    CHECK_CYCLE,
+
+    // チェーンが範囲外、空き、不良、予約済みのクラスタを指している
+    CHECK_BAD_CHAIN,
+
+    // ファイルのサイズとチェーンの長さが合わない
+    CHECK_SIZE_MISMATCH,
+
+    // 使用中だが、どのチェーンからも使われていないクラスタ
+    CHECK_LOST_CLUSTER,
+
+    // FATの複製の値が最初のFATと異なる
+    CHECK_FAT_MISMATCH,
+
+    CHECK_PROBLEM_TYPE_COUNT,
+} CheckProblemType;
+
+// 検査で見つかった問題
+typedef struct __CheckProblem
+{
+    // 問題の種類
+    CheckProblemType type;
+
+    // 問題のあるクラスタ番号
+    u32 cluster;
+
+    /**
+     * 問題のあるエントリのパス（UTF-8）
+     * エントリに関係しない問題の場合はNULL
+     */
+    char *path;
+} CheckProblem;
+
+// 検査の結果
+typedef struct __CheckReport
+{
+    // 種類ごとの問題の数
+    u64 problemCounts[CHECK_PROBLEM_TYPE_COUNT];
+
+    // 見つかった順に記録した問題（MAX_CHECK_PROBLEM_COUNT個まで）
+    CheckProblem *problems;
+    u32 problemCount;
+
+    // 検査したファイルとディレクトリの数
+    u64 fileCount;
+    u64 directoryCount;
+
+    // チェーンが使っているクラスタの数
+    u64 clusterCount;
+} CheckReport;
+
+// 検査するディレクトリ
+typedef struct __CheckDirectory
+{
+    // ディレクトリのエントリ
+    Entry *entry;
+
+    // ディレクトリのパス（UTF-8）
+    char *path;
+} CheckDirectory;
+
+// 検査の途中の状態
+typedef struct __Checker
+{
+    // 検査するFATイメージ
+    Image *image;
+
+    // 検査の結果
+    CheckReport *report;
+
+    /**
+     * チェーンが使っているクラスタのビットマップ
+     * 複数のスレッドから不可分に印を付ける
+     */
+    u8 *bitmap;
+
+    // 検査を待っているディレクトリのスタック
+    CheckDirectory *directories;
+    u32 directoryCount;
+    u32 directoryCapacity;
+
+    // スタックに入っているか、検査中のディレクトリの数
+    u32 pendingCount;
+
+    // 最初のFATと比べている複製のFATの番号
+    u8 fatIndex;
+
+#ifdef HAS_POSIX_IO
+    // スタックと結果を操作するときのロックと、ディレクトリを待つための条件変数
+    pthread_mutex_t lock;
+    pthread_cond_t condition;
+#endif
+} Checker;
+
+// 検査の状態と結果を操作するためにロックする
+void lockChecker(Checker *checker)
+{
+#ifdef HAS_POSIX_IO
+    pthread_mutex_lock(&checker->lock);
+#endif
+}
+
+// lockCheckerによるロックを解除する
+void unlockChecker(Checker *checker)
+{
+#ifdef HAS_POSIX_IO
+    pthread_mutex_unlock(&checker->lock);
+#endif
+}
+
+/**
+ * ディレクトリのパスと名前をつなげたパスを作成する
+ * 名前がNULLの場合はディレクトリのパスを複製する
+ * 作成できなかった場合はNULLを返す
+ */
+char *joinCheckPath(const char *directoryPath, const char *name)
+{
+    if (name == NULL)
+    {
+        char *path;
+        return coptString(&path, directoryPath) ? NULL : path;
+    }
+
+    // ルートディレクトリの直下は区切り文字を重ねない
+    const char *delimiter = strcmp(directoryPath, PATH_DELIMITER) == 0 ? "" : PATH_DELIMITER;
+    u64 size = strlen(directoryPath) + strlen(delimiter) + strlen(name) + 1;
+    char *path = malloc(size);
+    if (path != NULL)
+    {
+        snprintf(path, size, "%s%s%s", directoryPath, delimiter, name);
+    }
+    return path;
+}
+
+/**
+ * 見つかった問題を結果に加える
+ * 記録する問題の数の上限に達していたら、種類ごとの数だけを数える
+ */
+void addCheckProblem(Checker *checker, CheckProblemType type, u32 cluster, const char *directoryPath, const char *name)
+{
+    CheckReport *report = checker->report;
+
+    lockChecker(checker);
+
+    report->problemCounts[type]++;
+    if (report->problemCount < MAX_CHECK_PROBLEM_COUNT)
+    {
+        CheckProblem *problem = &report->problems[report->problemCount++];
+        problem->type = type;
+        problem->cluster = cluster;
+        problem->path = directoryPath != NULL ? joinCheckPath(directoryPath, name) : NULL;
+    }
+
+    unlockChecker(checker);
+}
+
+/**
+ * クラスタに使用中の印を付ける
+ * 既に印が付いていた場合はFALSE、それ以外の場合はTRUEを返す
+ */
+Boolean claimCluster(Checker *checker, u32 cluster)
+{
+    u8 bit = 1 << (cluster % 8);
+    return (__atomic_fetch_or(&checker->bitmap[cluster / 8], bit, __ATOMIC_RELAXED) & bit) == 0;
+}
+
+// クラスタに使用中の印が付いているかどうか
+Boolean isClusterClaimed(const Checker *checker, u32 cluster)
+{
+    return (__atomic_load_n(&checker->bitmap[cluster / 8], __ATOMIC_RELAXED) & (1 << (cluster % 8))) != 0;
+}
+
+// 指定されたクラスタから始まるチェーンの、先頭から指定された数のクラスタに含まれるかどうか
+Boolean hasClusterInChain(const Image *image, u32 start, u32 length, u32 cluster)
+{
+    for (u32 i = 0; i < length; ++i)
+    {
+        if (start == cluster)
+        {
+            return TRUE;
+        }
+        start = image->getNextCluster(image, start);
+    }
+    return FALSE;
+}
+
+/**
+ * 指定されたクラスタから始まるチェーンをたどり、使用中の印を付ける
+ * 既に印が付いたクラスタに達したら、チェーンの中で循環しているか、他のチェーンと交差しているとして止まる
+ * 印を付けたクラスタの数を返し、チェーンが正しく終端していたかどうかを設定する
+ */
+u32 walkChain(Boolean *validPointer, Checker *checker, u32 cluster, const char *directoryPath, const char *name)
+{
+    const Image *image = checker->image;
+    *validPointer = FALSE;
+
+    // 途切れた位置として、範囲外のクラスタを指している直前のクラスタか、範囲外の最初のクラスタ番号を記録する
+    u32 start = cluster;
+    u32 previousCluster = cluster;
+    u32 length = 0;
+    while (TRUE)
+    {
+        if (cluster < CLUSTER_START || cluster >= image->clusterCount)
+        {
+            addCheckProblem(checker, CHECK_BAD_CHAIN, previousCluster, directoryPath, name);
+            break;
+        }
+
+        if (!claimCluster(checker, cluster))
+        {
+            CheckProblemType type = hasClusterInChain(image, start, length, cluster) ? CHECK_CYCLE : CHECK_CROSS_LINK;
+            addCheckProblem(checker, type, cluster, directoryPath, name);
+            break;
+        }
+        length++;
+
+        // 不良クラスタの値より大きい値は、チェーンの終端を表す
+        u32 nextCluster = image->getNextCluster(image, cluster);
+        if (nextCluster > image->clusterEnd + 1)
+        {
+            *validPointer = TRUE;
+            break;
+        }
+        if (nextCluster == image->clusterEnd + 1)
+        {
+            addCheckProblem(checker, CHECK_BAD_CHAIN, cluster, directoryPath, name);
+            break;
+        }
+        previousCluster = cluster;
+        cluster = nextCluster;
+    }
+
+    addFatLookupStat(image, length);
+    addStat(&checker->report->clusterCount, length);
+    return length;
+}
+
+// ファイルのチェーンをたどり、チェーンの長さがサイズに合っているかを確かめる
+void checkFile(Checker *checker, const Entry *entry, const char *directoryPath)
+{
+    addStat(&checker->report->fileCount, 1);
+
+    u32 clusterSize = checker->image->clusterSize;
+    u64 expectedLength = ((u64)entry->size + clusterSize - 1) / clusterSize;
+    if (entry->cluster == 0)
+    {
+        if (expectedLength > 0)
+        {
+            addCheckProblem(checker, CHECK_SIZE_MISMATCH, 0, directoryPath, entry->name);
+        }
+        return;
+    }
+
+    Boolean valid;
+    u32 length = walkChain(&valid, checker, entry->cluster, directoryPath, entry->name);
+    if (valid && length != expectedLength)
+    {
+        addCheckProblem(checker, CHECK_SIZE_MISMATCH, entry->cluster, directoryPath, entry->name);
+    }
+}
+
+/**
+ * ディレクトリを検査するためにスタックに積む
+ * エントリは複製し、パスは作成して積む
+ * 成功したら0、それ以外の場合は0以外を返す
+ */
+Result pushCheckDirectory(Checker *checker, const Entry *entry, const char *directoryPath, const char *name)
+{
+    Entry *copy;
+    if (copyEntry(&copy, entry))
+    {
+        return 1;
+    }
+
+    char *path = joinCheckPath(directoryPath, name);
+    if (path == NULL)
+    {
+        closeEntry(copy);
+        return 2;
+    }
+
+    lockChecker(checker);
+
+    if (checker->directoryCount == checker->directoryCapacity)
+    {
+        u32 capacity = checker->directoryCapacity == 0 ? 64 : checker->directoryCapacity * 2;
+        CheckDirectory *directories = realloc(checker->directories, capacity * sizeof(CheckDirectory));
+        if (directories == NULL)
+        {
+            unlockChecker(checker);
+            free(path);
+            closeEntry(copy);
+            return 3;
+        }
+        checker->directories = directories;
+        checker->directoryCapacity = capacity;
+    }
+
+    checker->directories[checker->directoryCount].entry = copy;
+    checker->directories[checker->directoryCount].path = path;
+    checker->directoryCount++;
+    checker->pendingCount++;
+
+#ifdef HAS_POSIX_IO
+    pthread_cond_signal(&checker->condition);
+#endif
+    unlockChecker(checker);
+
+    return 0;
+}
+
+/**
+ * ディレクトリのチェーンをたどってから子エントリを読み取り、ファイルを検査してディレクトリを積む
+ * チェーンの最初のクラスタが既に使われていた場合は、同じディレクトリを二度たどらないように読み取らない
+ */
+void checkDirectory(Checker *checker, const Entry *entry, const char *path)
+{
+    Image *image = checker->image;
+    addStat(&checker->report->directoryCount, 1);
+
+    // FAT12とFAT16のルートディレクトリは専用の領域にあり、チェーンを持たない
+    u32 length = 0;
+    if (!getIsRoot(entry) || image->fatType == FAT32)
+    {
+        Boolean valid;
+        u32 cluster = getIsRoot(entry) ? image->rootCluster : entry->cluster;
+        length = walkChain(&valid, checker, cluster, path, NULL);
+        if (length == 0)
+        {
+            return;
+        }
+    }
+
+    Directory *directory;
+    if (openDir(&directory, entry))
+    {
+        return;
+    }
+
+    // チェーンが循環していたり途切れていたりしても、たどれたクラスタだけを読み取る
+    if (length > 0)
+    {
+        directory->maxChainLength = length;
+    }
+
+    const Entry *child;
+    while (readDir(&child, directory) == 0 && child != NULL)
+    {
+        if (strcmp(child->name, ".") == 0 || strcmp(child->name, "..") == 0 || hasAttribute(child, VOLUME_ID))
+        {
+            continue;
+        }
+
+        if (hasAttribute(child, DIRECTORY))
+        {
+            // ルートディレクトリを指すサブディレクトリは、ルートディレクトリを二度たどらないように積まない
+            if (getIsRoot(child))
+            {
+                addCheckProblem(checker, child->cluster == 0 ? CHECK_BAD_CHAIN : CHECK_CROSS_LINK, child->cluster, path, child->name);
+            }
+            else
+            {
+                pushCheckDirectory(checker, child, path, child->name);
+            }
+        }
+        else
+        {
+            checkFile(checker, child, path);
+        }
+    }
+
+    closeDir(directory);
+}
+
+/**
+ * 積まれたディレクトリがなくなり、検査中のディレクトリもなくなるまで検査する
+ * スレッドの開始関数としても使う
+ */
+void *runChecker(void *argument)
+{
+    Checker *checker = argument;
+
+    while (TRUE)
+    {
+        lockChecker(checker);
+
+#ifdef HAS_POSIX_IO
+        // 他のスレッドがディレクトリを積むかもしれない間は待つ
+        while (checker->directoryCount == 0 && checker->pendingCount > 0)
+        {
+            pthread_cond_wait(&checker->condition, &checker->lock);
+        }
+#endif
+
+        if (checker->directoryCount == 0)
+        {
+            unlockChecker(checker);
+            break;
+        }
+
+        CheckDirectory task = checker->directories[--checker->directoryCount];
+        unlockChecker(checker);
+
+        checkDirectory(checker, task.entry, task.path);
+        closeEntry(task.entry);
+        free(task.path);
+
+        lockChecker(checker);
+        if (--checker->pendingCount == 0)
+        {
+#ifdef HAS_POSIX_IO
+            pthread_cond_broadcast(&checker->condition);
+#endif
+        }
+        unlockChecker(checker);
+    }
+
+    return NULL;
+}
+
+// FATのチャンクから、使用中だがどのチェーンにも印が付いていないクラスタを探す
+void findLostClusters(FatScanTask *task, u32 start, u32 count)
+{
+    Checker *checker = task->context;
+    const Image *image = task->image;
+
+    const u32 *values = viewFatValues(image, task->values[0], task->buffers[0], 0, start, count);
+    if (values == NULL)
+    {
+        task->result = 2;
+        return;
+    }
+
+    for (u32 i = 0; i < count; ++i)
+    {
+        // 空き、不良、予約済みのクラスタは使用中として扱わない
+        u32 v = values[i] & 0x0FFFFFFF;
+        if (v == 0 || v == 1 || (v >= image->clusterEnd - 6 && v <= image->clusterEnd + 1))
+        {
+            continue;
+        }
+
+        if (!isClusterClaimed(checker, start + i))
+        {
+            task->count++;
+            addCheckProblem(checker, CHECK_LOST_CLUSTER, start + i, NULL, NULL);
+        }
+    }
+}
+
+// FATのチャンクを、最初のFATと複製のFATとで比べる
+void compareFatCopies(FatScanTask *task, u32 start, u32 count)
+{
+    Checker *checker = task->context;
+    const Image *image = task->image;
+
+    const u32 *values = viewFatValues(image, task->values[0], task->buffers[0], 0, start, count);
+    const u32 *copyValues = viewFatValues(image, task->values[1], task->buffers[1], checker->fatIndex, start, count);
+    if (values == NULL || copyValues == NULL)
+    {
+        task->result = 2;
+        return;
+    }
+
+    // FAT32のエントリの上位4ビットは予約されているので比べない
+    for (u32 i = 0; i < count; ++i)
+    {
+        if (((values[i] ^ copyValues[i]) & 0x0FFFFFFF) != 0)
+        {
+            task->count++;
+            addCheckProblem(checker, CHECK_FAT_MISMATCH, start + i, NULL, NULL);
+        }
+    }
+}
+
+/**
+ * FATイメージの整合性を検査する
+ * すべてのディレクトリとファイルのチェーンを複数のスレッドでたどってクラスタの使用状況のビットマップを作り、
+ * 交差、循環、不正な終端、サイズとの不一致を探す
+ * その後、どのチェーンからも使われていないクラスタと、複製のFATとの不一致をFATの走査で探す
+ * 検査を終えられたら0、それ以外の場合は0以外を返す（問題が見つかったかどうかは結果で確かめる）
+ * 結果はfreeCheckReportで解放する
+ */
+Result checkImage(CheckReport *report, Image *image)
+{
+    memset(report, 0, sizeof(CheckReport));
+    report->problems = malloc(MAX_CHECK_PROBLEM_COUNT * sizeof(CheckProblem));
+    if (report->problems == NULL)
+    {
+        return 1;
+    }
+
+    Checker checker;
+    checker.image = image;
+    checker.report = report;
+    checker.directories = NULL;
+    checker.directoryCount = 0;
+    checker.directoryCapacity = 0;
+    checker.pendingCount = 0;
+    checker.fatIndex = 0;
+    checker.bitmap = calloc(((u64)image->clusterCount + 7) / 8 + 1, sizeof(u8));
+    if (checker.bitmap == NULL)
+    {
+        return 2;
+    }
+#ifdef HAS_POSIX_IO
+    pthread_mutex_init(&checker.lock, NULL);
+    pthread_cond_init(&checker.condition, NULL);
+#endif
+
+    Result result = 0;
+    Entry *root;
+    if (openEntry(&root, image, PATH_DELIMITER))
+    {
+        result = 3;
+    }
+    else
+    {
+        if (pushCheckDirectory(&checker, root, PATH_DELIMITER, NULL))
+        {
+            result = 4;
+        }
+        closeEntry(root);
+    }
+
+    if (result == 0)
+    {
+#ifdef HAS_POSIX_IO
+        // スレッドを作成できなかった分は、呼び出したスレッドだけで検査する
+        u32 workerCount = getExtractWorkerCount();
+        pthread_t *threads = malloc(workerCount * sizeof(pthread_t));
+        u32 startedCount = 0;
+        while (threads != NULL && startedCount + 1 < workerCount &&
+               pthread_create(&threads[startedCount], NULL, runChecker, &checker) == 0)
+        {
+            startedCount++;
+        }
+        runChecker(&checker);
+        for (u32 i = 0; i < startedCount; ++i)
+        {
+            pthread_join(threads[i], NULL);
+        }
+        free(threads);
+#else
+        runChecker(&checker);
+#endif
+
+        countFatScan(&result, image, FAT_SCAN_PARALLEL_COUNT, findLostClusters, &checker);
+        for (checker.fatIndex = 1; checker.fatIndex < image->fatCount; ++checker.fatIndex)
+        {
+            countFatScan(&result, image, FAT_SCAN_PARALLEL_COUNT, compareFatCopies, &checker);
+        }
+    }
+
+#ifdef HAS_POSIX_IO
+    pthread_mutex_destroy(&checker.lock);
+    pthread_cond_destroy(&checker.condition);
+#endif
+    free(checker.directories);
+    free(checker.bitmap);
+    return result;
+}
+
+// 検査の結果が持つ領域を解放する
+void freeCheckReport(CheckReport *report)
+{
+    for (u32 i = 0; i < report->problemCount; ++i)
+    {
+        free(report->problems[i].path);
+    }
+    free(report->problems);
+    report->problems = NULL;
+    report->problemCount = 0;
+}
+#pragma endregion
+
+#pragma region Recovery
+// 復元はコマンドラインからだけ使い、ファイルを書き出すので、ライブラリとしてビルドする場合は含めない
+#ifndef FAT_LIBRARY
+// 署名と比べるために読み込む、空きクラスタの先頭のバイト数
+#define CARVE_HEADER_SIZE 8
+
+// 署名から切り出すファイルの大きさの上限
+#define MAX_CARVE_SIZE (256ULL * 1024 * 1024)
+
+// ファイルの終わりを探すときに、まとめて参照する範囲のバイト数
+#define CARVE_WINDOW_SIZE (64 * 1024)
+
+// マッピングされていない場合に、切り出す範囲を先読みするバッファのバイト数
+#define CARVE_BUFFER_SIZE (1024 * 1024)
+
+// 空き領域の走査を複数のスレッドに分けるクラスタ数、FATの走査よりクラスタごとの読み込みが重いので小さくする
+#define CARVE_PARALLEL_COUNT (256 * 1024)
+
+// ファイルの終わりが見つからなかったことを表す位置
+#define NO_CARVE_POSITION 0xffffffffffffffffULL
+
+// 署名から見分けるファイルの種類
+typedef enum __CarveType
+{
+    CARVE_JPEG,
+    CARVE_PNG,
+    CARVE_ZIP,
+} CarveType;
+
+// 空き領域から切り出したファイル
+typedef struct __CarvedFile
+{
+    // ファイルの種類
+    CarveType type;
+
+    // 署名が見つかったクラスタ番号
+    u32 cluster;
+
+    // ファイルのバイト数、終わりが見つからなかった場合は空きクラスタが続く範囲のバイト数
+    u64 size;
+
+    // ファイルの終わりが見つかったかどうか
+    Boolean complete;
+} CarvedFile;
+
+// 削除されたエントリ
+typedef struct __DeletedEntry
+{
+    // 組み立てた名前を含むパス（UTF-8）
+    char *path;
+
+    // ディレクトリかどうか
+    Boolean isDirectory;
+
+    // エントリのサイズと最初のクラスタ番号
+    u32 size;
+    u32 cluster;
+
+    /**
+     * データが残っていると考えられるクラスタの並び
+     * 削除されるとチェーンは失われるので、最初のクラスタから使用中のクラスタを飛ばして空きクラスタをサイズの分だけ集める
+     */
+    Extent *extents;
+    u32 extentCount;
+
+    // 集めたクラスタの数と、サイズから求めたクラスタの数
+    u32 clusterCount;
+    u32 expectedClusterCount;
+
+    // 最初のクラスタが、既に他のチェーンに使われているかどうか
+    Boolean overwritten;
+} DeletedEntry;
+
+// 復元のための走査の結果
+typedef struct __RecoveryReport
+{
+    // 見つかった削除されたエントリ
+    DeletedEntry *deletedEntries;
+    u32 deletedEntryCount;
+    u32 deletedEntryCapacity;
+
+    // 空き領域から切り出したファイル（クラスタ番号の順）
+    CarvedFile *carvedFiles;
+    u32 carvedFileCount;
+    u32 carvedFileCapacity;
+
+    // 空きクラスタの数と、読み取ったディレクトリの数
+    u64 freeClusterCount;
+    u64 directoryCount;
+} RecoveryReport;
+
+// 復元のための走査の途中の状態
+typedef struct __Recoverer
+{
+    // 走査するFATイメージ
+    Image *image;
+
+    // 走査の結果
+    RecoveryReport *report;
+
+    /**
+     * 空きクラスタと、読み取ったディレクトリの最初のクラスタのビットマップ
+     * ビットの位置はクラスタ番号からCLUSTER_STARTを引いた値にし、FATのチャンクの境界をバイトの境界にそろえる
+     */
+    u8 *freeBitmap;
+    u8 *visitedBitmap;
+
+#ifdef HAS_POSIX_IO
+    // 結果を複数のスレッドから操作するときのロック
+    pthread_mutex_t lock;
+#endif
+} Recoverer;
+
+// 空き領域の切り出す範囲を、先頭からの位置で参照するストリーム
+typedef struct __CarveStream
+{
+    // 切り出すFATイメージ
+    const Image *image;
+
+    // 範囲の先頭のオフセットとバイト数
+    u64 offset;
+    u64 size;
+
+    // マッピングされていない場合に先読みするバッファと、バッファに読み込んだ範囲
+    u8 *buffer;
+    u64 bufferPosition;
+    u64 bufferSize;
+} CarveStream;
+
+// クラスタが空いているかどうか
+Boolean isFreeCluster(const Recoverer *recoverer, u32 cluster)
+{
+    if (cluster < CLUSTER_START || cluster >= recoverer->image->clusterCount)
+    {
+        return FALSE;
+    }
+    u32 bit = cluster - CLUSTER_START;
+    return (recoverer->freeBitmap[bit / 8] & (1 << (bit % 8))) != 0;
+}
+
+/**
+ * ディレクトリの最初のクラスタに、読み取った印を付ける
+ * 範囲外のクラスタか、既に印が付いていた場合はFALSE、それ以外の場合はTRUEを返す
+ */
+Boolean visitCluster(Recoverer *recoverer, u32 cluster)
+{
+    if (cluster < CLUSTER_START || cluster >= recoverer->image->clusterCount)
+    {
+        return FALSE;
+    }
+    u32 bit = cluster - CLUSTER_START;
+    if ((recoverer->visitedBitmap[bit / 8] & (1 << (bit % 8))) != 0)
+    {
+        return FALSE;
+    }
+    recoverer->visitedBitmap[bit / 8] |= 1 << (bit % 8);
+    return TRUE;
+}
+
+// FATのチャンクから空きクラスタを探し、ビットマップに印を付ける
+void findFreeClusters(FatScanTask *task, u32 start, u32 count)
+{
+    Recoverer *recoverer = task->context;
+
+    const u32 *values = viewFatValues(task->image, task->values[0], task->buffers[0], 0, start, count);
+    if (values == NULL)
+    {
+        task->result = 2;
+        return;
+    }
+
+    // チャンクの先頭はバイトの境界にそろうので、他の作業と同じバイトには書き込まない
+    u8 *bitmap = recoverer->freeBitmap + (start - CLUSTER_START) / 8;
+    for (u32 i = 0; i < count; ++i)
+    {
+        if ((values[i] & 0x0FFFFFFF) == 0)
+        {
+            bitmap[i / 8] |= 1 << (i % 8);
+            task->count++;
+        }
+    }
+}
+
+/**
+ * 削除されたエントリについて、データが残っていると考えられるクラスタの並びを求めて結果に加える
+ * 成功したら0、それ以外の場合は0以外を返す
+ */
+Result addDeletedEntry(Recoverer *recoverer, const Entry *entry, const char *directoryPath)
+{
+    const Image *image = recoverer->image;
+    RecoveryReport *report = recoverer->report;
+
+    if (report->deletedEntryCount == report->deletedEntryCapacity)
+    {
+        u32 capacity = report->deletedEntryCapacity == 0 ? 64 : report->deletedEntryCapacity * 2;
+        DeletedEntry *entries = realloc(report->deletedEntries, capacity * sizeof(DeletedEntry));
+        if (entries == NULL)
+        {
+            return 1;
+        }
+        report->deletedEntries = entries;
+        report->deletedEntryCapacity = capacity;
+    }
+
+    DeletedEntry *deleted = &report->deletedEntries[report->deletedEntryCount];
+    memset(deleted, 0, sizeof(DeletedEntry));
+    deleted->path = joinCheckPath(directoryPath, entry->name);
+    if (deleted->path == NULL)
+    {
+        return 2;
+    }
+    deleted->isDirectory = hasAttribute(entry, DIRECTORY);
+    deleted->size = entry->size;
+    deleted->cluster = entry->cluster;
+    report->deletedEntryCount++;
+
+    // ディレクトリのサイズは記録されないので、最初のクラスタだけを求める
+    u32 clusterSize = image->clusterSize;
+    deleted->expectedClusterCount = deleted->isDirectory ? 1 : ((u64)entry->size + clusterSize - 1) / clusterSize;
+    if (deleted->expectedClusterCount == 0 || entry->cluster < CLUSTER_START || entry->cluster >= image->clusterCount)
+    {
+        return 0;
+    }
+    if (!isFreeCluster(recoverer, entry->cluster))
+    {
+        deleted->overwritten = TRUE;
+        return 0;
+    }
+
+    // サイズが壊れていて空きクラスタが足りるはずのない場合は、最初の空きクラスタの並びだけを集める
+    Boolean satisfiable = deleted->expectedClusterCount <= report->freeClusterCount;
+
+    u32 capacity = 0;
+    for (u32 cluster = entry->cluster; cluster < image->clusterCount && deleted->clusterCount < deleted->expectedClusterCount; ++cluster)
+    {
+        if (!isFreeCluster(recoverer, cluster))
+        {
+            // 空きクラスタの並びが途切れたとき、残りのクラスタがすべて空いていても足りなければ打ち切る
+            if (!satisfiable || image->clusterCount - cluster < deleted->expectedClusterCount - deleted->clusterCount)
+            {
+                break;
+            }
+            continue;
+        }
+
+        Extent *last = deleted->extentCount > 0 ? &deleted->extents[deleted->extentCount - 1] : NULL;
+        if (last != NULL && last->cluster + last->length == cluster)
+        {
+            last->length++;
+        }
+        else
+        {
+            if (deleted->extentCount == capacity)
+            {
+                capacity = capacity == 0 ? 4 : capacity * 2;
+                Extent *extents = realloc(deleted->extents, capacity * sizeof(Extent));
+                if (extents == NULL)
+                {
+                    return 3;
+                }
+                deleted->extents = extents;
+            }
+
+            Extent *extent = &deleted->extents[deleted->extentCount++];
+            extent->cluster = cluster;
+            extent->length = 1;
+            extent->index = deleted->clusterCount;
+        }
+        deleted->clusterCount++;
+    }
+
+    return 0;
+}
+
+/**
+ * 削除されたディレクトリのクラスタが、ディレクトリとして残っているかどうか
+ * 先頭のエントリが、自身のクラスタを指す"."であれば残っているとみなす
+ */
+Boolean isDirectoryCluster(const Image *image, u32 cluster)
+{
+    u8 buffer[ENTRY_SIZE];
+    const u8 *bytes = viewImage(image, buffer, getDataOffset(image, cluster), ENTRY_SIZE);
+    return bytes != NULL && memcmp(bytes, ".          ", 11) == 0 && (bytes[11] & DIRECTORY) != 0 &&
+           getRecordCluster(bytes) == cluster;
+}
+
+/**
+ * ディレクトリの削除されたエントリを含むすべての子エントリを読み取り、削除されたエントリを結果に加える
+ * 削除されたディレクトリは、クラスタが空いていてディレクトリとして残っていればその子エントリも読み取る
+ * 削除されたディレクトリの子エントリは、削除の印が付いていなくても削除されたエントリとして扱う
+ */
+void recoverDirectory(Recoverer *recoverer, const Entry *entry, const char *path, Boolean deleted)
+{
+    Image *image = recoverer->image;
+    recoverer->report->directoryCount++;
+
+    Directory *directory;
+    if (__openDir(&directory, entry, TRUE))
+    {
+        return;
+    }
+
+    // 削除されたディレクトリのチェーンは失われているので、最初のクラスタだけを読み取る
+    if (deleted)
+    {
+        directory->maxChainLength = 1;
+    }
+
+    const Entry *child;
+    while (readDir(&child, directory) == 0 && child != NULL)
+    {
+        if (strcmp(child->name, ".") == 0 || strcmp(child->name, "..") == 0 || hasAttribute(child, VOLUME_ID))
+        {
+            continue;
+        }
+
+        Boolean childDeleted = deleted || child->record[0] == DELETED;
+        if (childDeleted)
+        {
+            addDeletedEntry(recoverer, child, path);
+        }
+        if (!hasAttribute(child, DIRECTORY))
+        {
+            continue;
+        }
+
+        if (childDeleted && (!isFreeCluster(recoverer, child->cluster) || !isDirectoryCluster(image, child->cluster)))
+        {
+            continue;
+        }
+        if (!visitCluster(recoverer, child->cluster))
+        {
+            continue;
+        }
+
+        // 読み取ったエントリは次のreadDirで無効になるので、複製してから子エントリを読み取る
+        Entry *copy;
+        char *childPath = joinCheckPath(path, child->name);
+        if (childPath != NULL && copyEntry(&copy, child) == 0)
+        {
+            recoverDirectory(recoverer, copy, childPath, childDeleted);
+            closeEntry(copy);
+        }
+        free(childPath);
+    }
+
+    closeDir(directory);
+}
+
+// 空きクラスタの先頭のバイト列から、ファイルの種類を見分ける
+Boolean getCarveType(CarveType *typePointer, const u8 *bytes)
+{
+    if (bytes[0] == 0xff && bytes[1] == 0xd8 && bytes[2] == 0xff && bytes[3] >= 0xc0)
+    {
+        *typePointer = CARVE_JPEG;
+        return TRUE;
+    }
+    if (memcmp(bytes, "\x89PNG\r\n\x1a\n", 8) == 0)
+    {
+        *typePointer = CARVE_PNG;
+        return TRUE;
+    }
+    if (memcmp(bytes, "PK\x03\x04", 4) == 0)
+    {
+        *typePointer = CARVE_ZIP;
+        return TRUE;
+    }
+    return FALSE;
+}
+
+/**
+ * ストリームの指定された位置から、指定された長さのバイト列を参照する
+ * 長さはCARVE_WINDOW_SIZE以下にする
+ * 範囲の全体を参照できなかった場合はNULLを返す
+ */
+const u8 *viewCarveStream(CarveStream *stream, u64 position, u64 size)
+{
+    if (position > stream->size || size > stream->size - position)
+    {
+        return NULL;
+    }
+
+    const Image *image = stream->image;
+    if (image->map != NULL)
+    {
+        return image->map + stream->offset + position;
+    }
+
+    if (position >= stream->bufferPosition && position + size <= stream->bufferPosition + stream->bufferSize)
+    {
+        return stream->buffer + (position - stream->bufferPosition);
+    }
+
+    // 続く範囲もまとめて、キャッシュを通さずに読み込む
+    u64 readSize = stream->size - position < CARVE_BUFFER_SIZE ? stream->size - position : CARVE_BUFFER_SIZE;
+    stream->bufferSize = __readImage(image, stream->buffer, stream->offset + position, readSize);
+    stream->bufferPosition = position;
+    return size <= stream->bufferSize ? stream->buffer : NULL;
+}
+
+/**
+ * ストリームの指定された位置から、指定されたバイト列が最初に現れる位置を探す
+ * 見つからなかった場合はNO_CARVE_POSITIONを返す
+ */
+u64 findCarvePattern(CarveStream *stream, u64 position, const u8 *pattern, u32 size)
+{
+    while (position + size <= stream->size)
+    {
+        u64 windowSize = stream->size - position < CARVE_WINDOW_SIZE ? stream->size - position : CARVE_WINDOW_SIZE;
+        const u8 *bytes = viewCarveStream(stream, position, windowSize);
+        if (bytes == NULL)
+        {
+            break;
+        }
+
+        // 先頭のバイトをmemchrで探してから、残りを比べる
+        const u8 *limit = bytes + windowSize - size + 1;
+        for (const u8 *found = bytes; (found = memchr(found, pattern[0], limit - found)) != NULL; ++found)
+        {
+            if (memcmp(found, pattern, size) == 0)
+            {
+                return position + (found - bytes);
+            }
+        }
+
+        // 範囲の境界をまたぐバイト列を見落とさないように、重ねて次の範囲を参照する
+        if (position + windowSize == stream->size)
+        {
+            break;
+        }
+        position += windowSize - size + 1;
+    }
+    return NO_CARVE_POSITION;
+}
+
+/**
+ * JPEGのセグメントをたどり、画像データに続くEOIマーカーの終わりの位置を返す
+ * セグメントを飛ばすので、Exifのサムネイルが持つEOIマーカーでは止まらない
+ */
+u64 findJpegEnd(CarveStream *stream)
+{
+    u64 position = 2;
+    while (TRUE)
+    {
+        const u8 *bytes = viewCarveStream(stream, position, 2);
+        if (bytes == NULL || bytes[0] != 0xff)
+        {
+            return NO_CARVE_POSITION;
+        }
+
+        u8 marker = bytes[1];
+        if (marker == 0xff)
+        {
+            // マーカーの前の埋め草
+            position++;
+            continue;
+        }
+        if (marker == 0xd9)
+        {
+            return position + 2;
+        }
+        if (marker == 0x01 || (marker >= 0xd0 && marker <= 0xd7))
+        {
+            // 長さを持たないマーカー
+            position += 2;
+            continue;
+        }
+
+        bytes = viewCarveStream(stream, position + 2, 2);
+        if (bytes == NULL)
+        {
+            return NO_CARVE_POSITION;
+        }
+        position += 2 + ((bytes[0] << 8) | bytes[1]);
+
+        if (marker == 0xda)
+        {
+            // 画像データの中の0xffには0x00かRSTマーカーが続くので、EOIマーカーを直接探す
+            u64 end = findCarvePattern(stream, position, (const u8 *)"\xff\xd9", 2);
+            return end == NO_CARVE_POSITION ? end : end + 2;
+        }
+    }
+}
+
+// PNGのチャンクをたどり、IENDチャンクの終わりの位置を返す
+u64 findPngEnd(CarveStream *stream)
+{
+    u64 position = 8;
+    while (TRUE)
+    {
+        const u8 *bytes = viewCarveStream(stream, position, 8);
+        if (bytes == NULL)
+        {
+            return NO_CARVE_POSITION;
+        }
+
+        // チャンクは長さ、種類、データ、CRCの順に並ぶ
+        u32 length = ((u32)bytes[0] << 24) | (bytes[1] << 16) | (bytes[2] << 8) | bytes[3];
+        if (length > 0x7fffffff)
+        {
+            return NO_CARVE_POSITION;
+        }
+        position += 12 + (u64)length;
+
+        if (memcmp(bytes + 4, "IEND", 4) == 0)
+        {
+            return position <= stream->size ? position : NO_CARVE_POSITION;
+        }
+    }
+}
+
+// ZIPの中央ディレクトリの終端レコードを探し、コメントを含むレコードの終わりの位置を返す
+u64 findZipEnd(CarveStream *stream)
+{
+    u64 position = findCarvePattern(stream, 4, (const u8 *)"PK\x05\x06", 4);
+    if (position == NO_CARVE_POSITION)
+    {
+        return NO_CARVE_POSITION;
+    }
+
+    const u8 *bytes = viewCarveStream(stream, position, 22);
+    if (bytes == NULL)
+    {
+        return NO_CARVE_POSITION;
+    }
+    u64 end = position + 22 + get16(bytes, 20);
+    return end <= stream->size ? end : NO_CARVE_POSITION;
+}
+
+/**
+ * 署名が見つかった空きクラスタから、空きクラスタが続く範囲でファイルの終わりを探し、切り出したファイルとして結果に加える
+ * ファイルは連続したクラスタに書き込まれていたとみなす
+ */
+void carveFile(FatScanTask *task, CarveType type, u32 cluster)
+{
+    Recoverer *recoverer = task->context;
+    const Image *image = task->image;
+
+    u64 maxClusterCount = MAX_CARVE_SIZE / image->clusterSize;
+    u32 length = 1;
+    while (length < maxClusterCount && isFreeCluster(recoverer, cluster + length))
+    {
+        ++length;
+    }
+
+    CarveStream stream;
+    stream.image = image;
+    stream.offset = getDataOffset(image, cluster);
+    stream.size = (u64)image->clusterSize * length;
+    stream.buffer = NULL;
+    stream.bufferPosition = 0;
+    stream.bufferSize = 0;
+    if (image->map != NULL)
+    {
+        if (stream.offset >= image->mapSize)
+        {
+            return;
+        }
+        if (stream.size > image->mapSize - stream.offset)
+        {
+            stream.size = image->mapSize - stream.offset;
+        }
+    }
+    else if ((stream.buffer = malloc(CARVE_BUFFER_SIZE)) == NULL)
+    {
+        task->result = 3;
+        return;
+    }
+
+    u64 end;
+    switch (type)
+    {
+    case CARVE_JPEG:
+        end = findJpegEnd(&stream);
+        break;
+    case CARVE_PNG:
+        end = findPngEnd(&stream);
+        break;
+    default:
+        end = findZipEnd(&stream);
+        break;
+    }
+    free(stream.buffer);
+
+    RecoveryReport *report = recoverer->report;
+
+#ifdef HAS_POSIX_IO
+    pthread_mutex_lock(&recoverer->lock);
+#endif
+
+    if (report->carvedFileCount == report->carvedFileCapacity)
+    {
+        u32 capacity = report->carvedFileCapacity == 0 ? 64 : report->carvedFileCapacity * 2;
+        CarvedFile *files = realloc(report->carvedFiles, capacity * sizeof(CarvedFile));
+        if (files == NULL)
+        {
+            task->result = 4;
+        }
+        else
+        {
+            report->carvedFiles = files;
+            report->carvedFileCapacity = capacity;
+        }
+    }
+    if (report->carvedFileCount < report->carvedFileCapacity)
+    {
+        CarvedFile *file = &report->carvedFiles[report->carvedFileCount++];
+        file->type = type;
+        file->cluster = cluster;
+        file->complete = end != NO_CARVE_POSITION;
+        file->size = file->complete ? end : stream.size;
+        task->count++;
+    }
+
+#ifdef HAS_POSIX_IO
+    pthread_mutex_unlock(&recoverer->lock);
+#endif
+}
+
+/**
+ * チャンクの範囲の空きクラスタの先頭を署名と比べ、見つかったファイルを切り出す
+ * マッピングされている場合は空きクラスタの先頭のページだけに触れ、それ以外の場合は先頭だけをキャッシュを通さずに読み込む
+ */
+void carveChunk(FatScanTask *task, u32 start, u32 count)
+{
+    Recoverer *recoverer = task->context;
+    const Image *image = task->image;
+
+    u8 header[CARVE_HEADER_SIZE];
+    for (u32 i = 0; i < count && task->result == 0; ++i)
+    {
+        // 空きクラスタのない8クラスタはまとめて飛ばす
+        u32 bit = start + i - CLUSTER_START;
+        if (bit % 8 == 0 && recoverer->freeBitmap[bit / 8] == 0)
+        {
+            i += 7;
+            continue;
+        }
+
+        u32 cluster = start + i;
+        if (!isFreeCluster(recoverer, cluster))
+        {
+            continue;
+        }
+
+        const u8 *bytes;
+        u64 offset = getDataOffset(image, cluster);
+        if (image->map != NULL)
+        {
+            if (offset >= image->mapSize || image->mapSize - offset < CARVE_HEADER_SIZE)
+            {
+                break;
+            }
+            bytes = image->map + offset;
+        }
+        else
+        {
+            if (__readImage(image, header, offset, CARVE_HEADER_SIZE) != CARVE_HEADER_SIZE)
+            {
+                break;
+            }
+            bytes = header;
+        }
+
+        CarveType type;
+        if (getCarveType(&type, bytes))
+        {
+            carveFile(task, type, cluster);
+        }
+    }
+}
+
+// 切り出したファイルをクラスタ番号の順に並べるための比較関数
+int compareCarvedFiles(const void *a, const void *b)
+{
+    u32 clusterA = ((const CarvedFile *)a)->cluster;
+    u32 clusterB = ((const CarvedFile *)b)->cluster;
+    return clusterA < clusterB ? -1 : clusterA > clusterB;
+}
+
+/**
+ * 削除されたファイルを復元するためにFATイメージを走査する
+ * FATを走査して空きクラスタのビットマップを作り、削除されたエントリを含めてすべてのディレクトリを読み取って
+ * 削除されたエントリとデータが残っていると考えられるクラスタの並びを求める
+ * その後、空きクラスタの先頭を複数のスレッドで署名と比べ、JPEG、PNG、ZIPのファイルを切り出す
+ * 走査を終えられたら0、それ以外の場合は0以外を返す
+ * 結果はfreeRecoveryReportで解放する
+ */
+Result recoverImage(RecoveryReport *report, Image *image)
+{
+    memset(report, 0, sizeof(RecoveryReport));
+
+    Recoverer recoverer;
+    recoverer.image = image;
+    recoverer.report = report;
+    u64 bitmapSize = ((u64)image->clusterCount + 7) / 8 + 1;
+    recoverer.freeBitmap = calloc(bitmapSize, sizeof(u8));
+    recoverer.visitedBitmap = calloc(bitmapSize, sizeof(u8));
+    if (recoverer.freeBitmap == NULL || recoverer.visitedBitmap == NULL)
+    {
+        free(recoverer.freeBitmap);
+        free(recoverer.visitedBitmap);
+        return 1;
+    }
+#ifdef HAS_POSIX_IO
+    pthread_mutex_init(&recoverer.lock, NULL);
+#endif
+
+    Result result = 0;
+    report->freeClusterCount = countFatScan(&result, image, FAT_SCAN_PARALLEL_COUNT, findFreeClusters, &recoverer);
+
+    Entry *root;
+    if (result == 0 && openEntry(&root, image, PATH_DELIMITER) == 0)
+    {
+        // FAT32のルートディレクトリはクラスタにあるので、子エントリから二度たどらないように印を付けておく
+        visitCluster(&recoverer, image->rootCluster);
+        recoverDirectory(&recoverer, root, PATH_DELIMITER, FALSE);
+        closeEntry(root);
+    }
+    else if (result == 0)
+    {
+        result = 3;
+    }
+
+    if (result == 0)
+    {
+        countFatScan(&result, image, CARVE_PARALLEL_COUNT, carveChunk, &recoverer);
+        qsort(report->carvedFiles, report->carvedFileCount, sizeof(CarvedFile), compareCarvedFiles);
+    }
+
+#ifdef HAS_POSIX_IO
+    pthread_mutex_destroy(&recoverer.lock);
+#endif
+    free(recoverer.freeBitmap);
+    free(recoverer.visitedBitmap);
+    return result;
+}
+
+// 復元のための走査の結果が持つ領域を解放する
+void freeRecoveryReport(RecoveryReport *report)
+{
+    for (u32 i = 0; i < report->deletedEntryCount; ++i)
+    {
+        free(report->deletedEntries[i].path);
+        free(report->deletedEntries[i].extents);
+    }
+    free(report->deletedEntries);
+    free(report->carvedFiles);
+    memset(report, 0, sizeof(RecoveryReport));
+}
+
+// 切り出すファイルの種類に合わせた拡張子を取得する
+const char *getCarveExtension(CarveType type)
+{
+    switch (type)
+    {
+    case CARVE_JPEG:
+        return "jpg";
+    case CARVE_PNG:
+        return "png";
+    default:
+        return "zip";
+    }
+}
+
+#ifdef HAS_POSIX_IO
+/**
+ * FATイメージのクラスタの並びを、指定されたディスクリプタのディレクトリの中のファイルに書き出す
+ * ファイル名は最初のクラスタ番号に、区切りと名前を続けたものにする
+ * シンボリックリンクをたどらず、既にあるファイルは上書きしない
+ * 最後の並びは指定されたサイズまでに切り詰める
+ * 成功したら0、同じ名前のファイルが既にある場合は2、それ以外の場合は0以外を返す
+ */
+Result writeRecoveredFile(const Image *image, s32 directoryFd, u32 cluster, const char *delimiter, const char *name,
+                          const Extent *extents, u32 extentCount, u64 size)
+{
+    s32 length = snprintf(NULL, 0, "%08u%s%s", cluster, delimiter, name);
+    char *filename = malloc(length + 1);
+    if (filename == NULL)
+    {
+        return 1;
+    }
+    snprintf(filename, length + 1, "%08u%s%s", cluster, delimiter, name);
+
+    s32 fd = openat(directoryFd, filename, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, 0644);
+    free(filename);
+    if (fd < 0)
+    {
+        return errno == EEXIST ? 2 : 3;
+    }
+
+    CopyMethod method = getCopyMethod(fd);
+    Result result = 0;
+    for (u32 i = 0; i < extentCount && size > 0 && result == 0; ++i)
+    {
+        u64 chunkSize = (u64)image->clusterSize * extents[i].length;
+        if (chunkSize > size)
+        {
+            chunkSize = size;
+        }
+        if (copyImage(image, fd, getDataOffset(image, extents[i].cluster), chunkSize, &method) != chunkSize)
+        {
+            result = 4;
+        }
+        size -= chunkSize;
+    }
+
+    if (close(fd) != 0 && result == 0)
+    {
+        result = 5;
+    }
+    return result;
+}
+
+/**
+ * 切り出したファイルと、データがすべて空きクラスタに残っている削除されたファイルを指定されたディレクトリに書き出す
+ * 削除されたファイルの名前は、最初のクラスタ番号に組み立てた名前を続けたものにする
+ * 同じ名前のファイルが既にある場合は書き出さずに飛ばす
+ * 書き出したファイルと飛ばしたファイルの数を設定し、成功したら0、それ以外の場合は0以外を返す
+ */
+Result writeRecoveredFiles(u64 *countPointer, u64 *skippedCountPointer, const RecoveryReport *report, const Image *image,
+                           const char *destination)
+{
+    *countPointer = 0;
+    *skippedCountPointer = 0;
+
+    // 書き出し先のディレクトリを作成して開き、以降はこのディレクトリからの相対で作成する
+    if (mkdir(destination, 0755) != 0 && errno != EEXIST)
+    {
+        return 1;
+    }
+    s32 directoryFd = open(destination, O_RDONLY | O_DIRECTORY);
+    if (directoryFd < 0)
+    {
+        return 1;
+    }
+
+    Result result = 0;
+    for (u32 i = 0; i < report->carvedFileCount; ++i)
+    {
+        const CarvedFile *file = &report->carvedFiles[i];
+        Extent extent = {file->cluster, (file->size + image->clusterSize - 1) / image->clusterSize, 0};
+        Result fileResult = writeRecoveredFile(image, directoryFd, file->cluster, ".", getCarveExtension(file->type), &extent, 1, file->size);
+        if (fileResult == 2)
+        {
+            (*skippedCountPointer)++;
+            continue;
+        }
+        if (fileResult)
+        {
+            result = 2;
+            continue;
+        }
+        (*countPointer)++;
+    }
+
+    for (u32 i = 0; i < report->deletedEntryCount; ++i)
+    {
+        const DeletedEntry *entry = &report->deletedEntries[i];
+        if (entry->isDirectory || entry->size == 0 || entry->clusterCount < entry->expectedClusterCount)
+        {
+            continue;
+        }
+
+        // 名前に区切り文字や制御文字が含まれていたら、指定されたディレクトリの外を指しうるので書き出さない
+        const char *name = strrchr(entry->path, PATH_DELIMITER[0]) + 1;
+        if (!isSafeHostName(name))
+        {
+            result = 3;
+            continue;
+        }
+        Result fileResult = writeRecoveredFile(image, directoryFd, entry->cluster, "-", name, entry->extents, entry->extentCount, entry->size);
+        if (fileResult == 2)
+        {
+            (*skippedCountPointer)++;
+            continue;
+        }
+        if (fileResult)
+        {
+            result = 3;
+            continue;
+        }
+        (*countPointer)++;
+    }
+
+    close(directoryFd);
+    return result;
+}
+#endif
+#endif
+#pragma endregion
+
+#pragma region Batch
+typedef struct __PathNode PathNode;
+
+// まとめて解決するパスを、区切り文字で分けた部分ごとにたどるトライのノード
+typedef struct __PathNode
+{
+    // パスの一部の名前（UTF-8）、ルートの場合は空文字列
+    char *name;
+
+    // このノードで終わるパスとして指定された文字列、指定されていなければNULL
+    const char *path;
+
+    // 名前の順に並べた子ノードの配列と、その数
+    PathNode **children;
+    u32 childCount;
+
+    // 構築中に子ノードをつなぐ連結リスト
+    PathNode *firstChild;
+    PathNode *lastChild;
+    PathNode *nextSibling;
+
+    // 一致するエントリが見つかったかどうか
+    Boolean found;
+} PathNode;
+
+// まとめて解決するパスのトライ
+typedef struct __PathTrie
+{
+    // トライのノードと名前を切り出したアリーナ
+    Arena *arena;
+
+    // ルートディレクトリに対応するノード
+    PathNode *root;
+} PathTrie;
+
+// 並べ替えるパスと、区切り文字を1つにそろえたキー
+typedef struct __PathKey
+{
+    const char *path;
+    char *key;
+} PathKey;
+
+// 見つかったエントリか、見つからなかったパスごとに呼び出す関数、見つからなかった場合のエントリはNULL
+typedef void (*PathTrieFunction)(const char *path, const Entry *entry, void *context);
+
+/**
+ * パスの先頭と末尾の区切り文字を除き、連続した区切り文字を1つにまとめたキーをアリーナに作成する
+ * 作成できなかった場合はNULLを返す
+ */
+char *getPathKey(Arena *arena, const char *path)
+{
+    char *key = allocateArena(arena, strlen(path) + 1);
+    if (key == NULL)
+    {
+        return NULL;
+    }
+
+    u64 length = 0;
+    while (TRUE)
+    {
+        path += strspn(path, PATH_DELIMITER);
+        if (*path == '\0')
+        {
+            break;
+        }
+
+        u64 nameLength = strcspn(path, PATH_DELIMITER);
+        if (length > 0)
+        {
+            key[length++] = PATH_DELIMITER[0];
+        }
+        memcpy(key + length, path, nameLength);
+        length += nameLength;
+        path += nameLength;
+    }
+    key[length] = '\0';
+    return key;
+}
+
+/**
+ * 区切り文字を名前のどの文字よりも小さいとみなしてキーを比べる
+ * 部分ごとの名前をstrcmpで比べた順に並ぶので、兄弟のノードも名前の順に並ぶ
+ */
+int comparePathKeys(const void *a, const void *b)
+{
+    const u8 *keyA = (const u8 *)((const PathKey *)a)->key;
+    const u8 *keyB = (const u8 *)((const PathKey *)b)->key;
+    while (*keyA != '\0' && *keyA == *keyB)
+    {
+        ++keyA;
+        ++keyB;
+    }
+
+    u32 c = *keyA == PATH_DELIMITER[0] ? 1 : *keyA;
+    u32 d = *keyB == PATH_DELIMITER[0] ? 1 : *keyB;
+    return c < d ? -1 : c > d;
+}
+
+// 指定された長さの名前を持つノードをアリーナに作成する
+PathNode *createPathNode(Arena *arena, const char *name, u64 length)
+{
+    PathNode *node = allocateArena(arena, sizeof(PathNode));
+    char *nodeName = allocateArena(arena, length + 1);
+    if (node == NULL || nodeName == NULL)
+    {
+        return NULL;
+    }
+    memcpy(nodeName, name, length);
+    nodeName[length] = '\0';
+
+    memset(node, 0, sizeof(PathNode));
+    node->name = nodeName;
+    return node;
+}
+
+/**
+ * ノードとその子孫の、子ノードの連結リストを配列に変換する
+ * 成功したら0、それ以外の場合は0以外を返す
+ */
+Result finishPathNode(Arena *arena, PathNode *node)
+{
+    if (node->childCount == 0)
+    {
+        return 0;
+    }
+
+    node->children = allocateArena(arena, node->childCount * sizeof(PathNode *));
+    if (node->children == NULL)
+    {
+        return 1;
+    }
+
+    u32 index = 0;
+    for (PathNode *child = node->firstChild; child != NULL; child = child->nextSibling)
+    {
+        node->children[index++] = child;
+        if (finishPathNode(arena, child))
+        {
+            return 2;
+        }
+    }
+    return 0;
+}
+
+/**
+ * 指定されたパスを並べ替え、共通する部分を共有するトライを作成する
+ * トライは指定されたパスの文字列を参照するので、トライを破棄するまで文字列を残しておく
+ * 成功したら0、それ以外の場合は0以外を返す
+ */
+Result buildPathTrie(PathTrie **triePointer, const char **paths, u32 count)
+{
+    *triePointer = NULL;
+
+    Arena *arena;
+    if (createArena(&arena))
+    {
+        return 1;
+    }
+
+    PathTrie *trie = allocateArena(arena, sizeof(PathTrie));
+    PathKey *keys = malloc((u64)count * sizeof(PathKey));
+    if (trie == NULL || keys == NULL || (trie->root = createPathNode(arena, "", 0)) == NULL)
+    {
+        free(keys);
+        releaseArena(arena);
+        return 2;
+    }
+    trie->arena = arena;
+
+    for (u32 i = 0; i < count; ++i)
+    {
+        keys[i].path = paths[i];
+        keys[i].key = getPathKey(arena, paths[i]);
+        if (keys[i].key == NULL)
+        {
+            free(keys);
+            releaseArena(arena);
+            return 3;
+        }
+    }
+    qsort(keys, count, sizeof(PathKey), comparePathKeys);
+
+    // 並べ替えてあるので、直前のパスと共通する部分は常に最後の子ノードにある
+    for (u32 i = 0; i < count; ++i)
+    {
+        PathNode *node = trie->root;
+        const char *name = keys[i].key;
+        while (*name != '\0')
+        {
+            u64 length = strcspn(name, PATH_DELIMITER);
+            PathNode *last = node->lastChild;
+            if (last != NULL && strncmp(last->name, name, length) == 0 && last->name[length] == '\0')
+            {
+                node = last;
+            }
+            else
+            {
+                PathNode *child = createPathNode(arena, name, length);
+                if (child == NULL)
+                {
+                    free(keys);
+                    releaseArena(arena);
+                    return 4;
+                }
+                if (last != NULL)
+                {
+                    last->nextSibling = child;
+                }
+                else
+                {
+                    node->firstChild = child;
+                }
+                node->lastChild = child;
+                node->childCount++;
+                node = child;
+            }
+
+            name += length;
+            name += strspn(name, PATH_DELIMITER);
+        }
+
+        // 同じパスが複数回指定されても、最初の1つだけを残す
+        if (node->path == NULL)
+        {
+            node->path = keys[i].path;
+        }
+    }
+    free(keys);
+
+    if (finishPathNode(arena, trie->root))
+    {
+        releaseArena(arena);
+        return 5;
+    }
+
+    *triePointer = trie;
+    return 0;
+}
+
+// トライを破棄する
+void destroyPathTrie(PathTrie *trie)
+{
+    releaseArena(trie->arena);
+}
+
+/**
+ * ノードの子ノードから、指定された名前のノードを二分探索で探す
+ * 見つからなければNULLを返す
+ */
+PathNode *findPathChild(const PathNode *node, const char *name)
+{
+    u32 low = 0;
+    u32 high = node->childCount;
+    while (low < high)
+    {
+        u32 middle = low + (high - low) / 2;
+        s32 order = strcmp(node->children[middle]->name, name);
+        if (order == 0)
+        {
+            return node->children[middle];
+        }
+        if (order < 0)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * ディレクトリの子エントリを一度だけ読み取り、子ノードに一致するエントリを関数に渡して子孫をたどる
+ * 子ノードがすべて見つかったら、残りのエントリは読み取らない
+ */
+void walkPathNode(PathNode *node, const Entry *directoryEntry, PathTrieFunction visit, void *context)
+{
+    Directory *directory;
+    if (openDir(&directory, directoryEntry))
+    {
+        return;
+    }
+
+    u32 remainingCount = node->childCount;
+    const Entry *entry;
+    while (remainingCount > 0 && readDir(&entry, directory) == 0 && entry != NULL)
+    {
+        // 同じ名前のエントリが複数あれば、openEntryと同じく最初のエントリを使う
+        PathNode *child = findPathChild(node, entry->name);
+        if (child == NULL || child->found)
+        {
+            continue;
+        }
+        child->found = TRUE;
+        remainingCount--;
+
+        if (child->path != NULL)
+        {
+            visit(child->path, entry, context);
+        }
+        if (child->childCount > 0 && hasAttribute(entry, DIRECTORY))
+        {
+            walkPathNode(child, entry, visit, context);
+        }
+    }
+
+    closeDir(directory);
+}
+
+// 指定されたが見つからなかったパスを、エントリをNULLとして関数に渡す
+void visitMissingPaths(const PathNode *node, PathTrieFunction visit, void *context)
+{
+    if (node->path != NULL && !node->found)
+    {
+        visit(node->path, NULL, context);
+    }
+    for (u32 i = 0; i < node->childCount; ++i)
+    {
+        visitMissingPaths(node->children[i], visit, context);
+    }
+}
+
+/**
+ * トライのパスをルートディレクトリから解決し、見つかったエントリをディレクトリを読み取った順に関数に渡す
+ * 各ディレクトリは一度だけ読み取る
+ * その後、見つからなかったパスをパスの順に関数に渡す
+ * 成功したら0、それ以外の場合は0以外を返す
+ */
+Result walkPathTrie(PathTrie *trie, Image *image, PathTrieFunction visit, void *context)
+{
+    Entry *root;
+    if (openEntry(&root, image, PATH_DELIMITER))
+    {
+        return 1;
+    }
+
+    if (trie->root->path != NULL)
+    {
+        trie->root->found = TRUE;
+        visit(trie->root->path, root, context);
+    }
+    if (trie->root->childCount > 0)
+    {
+        walkPathNode(trie->root, root, visit, context);
+    }
+    closeEntry(root);
+
+    visitMissingPaths(trie->root, visit, context);
+    return 0;
+}
+#pragma endregion
+
+#pragma region Library
+/**
+ * fat.hで公開する関数
+ * 埋め込む側の名前と衝突しないように、fat_で始まる名前で内部の関数を呼び出す
+ */
+FatResult fat_openImage(FatImage **imagePointer, const char *path)
+{
+    return openImage(imagePointer, path);
+}
+
+FatResult fat_closeImage(FatImage *image)
+{
+    return closeImage(image);
+}
+
+FatResult fat_openEntry(FatEntry **entryPointer, FatImage *image, const char *path)
+{
+    return openEntry(entryPointer, image, path);
+}
+
+FatResult fat_getDescendantEntry(FatEntry **descendantPointer, const FatEntry *parent, const char *path)
+{
+    return getDescendantEntry(descendantPointer, parent, path);
+}
+
+void fat_closeEntry(FatEntry *entry)
+{
+    closeEntry(entry);
+}
+
+const char *fat_getEntryName(const FatEntry *entry)
+{
+    return entry->name;
+}
+
+unsigned int fat_getEntrySize(const FatEntry *entry)
+{
+    return entry->size;
+}
+
+FatBoolean fat_hasAttribute(const FatEntry *entry, unsigned char attribute)
+{
+    return hasAttribute(entry, attribute);
+}
+
+int fat_getChildren(FatEntry **childrenPointer[], const FatEntry *parent)
+{
+    return getChildren(childrenPointer, parent);
+}
+
+void fat_freeChildren(FatEntry *children[], int count)
+{
+    freeChildren(children, count);
+}
+
+FatResult fat_openFile(FatFile **filePointer, FatEntry *entry)
+{
+    return openFile(filePointer, entry);
+}
+
+void fat_closeFile(FatFile *file)
+{
+    closeFile(file);
+}
+
+unsigned int fat_readFile(unsigned char *bytes, unsigned int size, FatFile *file)
+{
+    return readFile(bytes, size, file);
+}
+
+FatResult fat_seekFile(FatFile *file, long long offset, int whence)
+{
+    return seekFile(file, offset, whence);
+}
+#pragma endregion
+
+// ライブラリとしてビルドする場合は、表示とコマンドラインの処理を含めない
+#ifndef FAT_LIBRARY
+#pragma region Main utilities
+// ヘルプを表示する
+void printHelp()
+{
+    printf("Available commands:\n");
+    printf("  cd PATH\tChange current directory\n");
+    printf("  ls [PATH]\tList child entries\n");
+    printf("  tree [PATH]\tList descendant entries\n");
+    printf("  info [PATH]\tShow entry information\n");
+    printf("  cat [PATH] [OFFSET] [LENGTH]\tShow entry data\n");
+    printf("  head [PATH] [LENGTH]\tShow first bytes of entry data\n");
+    printf("  tail [PATH] [LENGTH]\tShow last bytes of entry data\n");
+    printf("  extract [PATH] DESTDIR\tCopy entries to host directory\n");
+    printf("  df\tShow used and free clusters\n");
+    printf("  check\tCheck consistency of FAT and chains\n");
+    printf("  recover [DESTDIR]\tList deleted entries and carve free clusters\n");
+    printf("  stats\tShow I/O and timing counters\n");
+    printf("  help\tShow this help\n");
+    printf("  exit\tStop program\n");
+}
+
+/**
+ * 基準となるエントリに相対的な、または絶対的なエントリを取得する
+ * 成功したら0、それ以外の場合は0以外を返す
+ */
+Result getEntry(Entry **entryPointer, const Entry *baseEntry, const char *path)
+{
+    if (startsWith(path, PATH_DELIMITER))
+    {
+        return openEntry(entryPointer, baseEntry->image, path);
+    }
+    return getDescendantEntry(entryPointer, baseEntry, path);
+}
+
+// 子エントリをすべて表示する
+void printChildren(const Entry *parent)
+{
+    Directory *directory;
+    Result result = openDir(&directory, parent);
+    if (result)
+    {
+        printf("Error: %d\n", result);
+        return;
+    }
+
+    // 読み取ったそばから表示する
+    const Entry *child;
+    while ((result = readDir(&child, directory)) == 0 && child != NULL)
+    {
+        char type = hasAttribute(child, DIRECTORY) ? 'd' : 'f';
+        printf("%c %s\n", type, child->name);
+    }
+
+    closeDir(directory);
+
+    if (result)
+    {
+        printf("Error: %d\n", result);
+    }
+}
+
+// 指定されたエントリ以下の階層構造を表示する
+void printTree(const Entry *root)
+{
+    // エントリをコピーする
+    Entry *entry;
+    Result result = copyEntry(&entry, root);
+    if (result)
+    {
+        printf("Error: %d\n", result);
+        return;
+    }
+
+    // エントリのスタックのノード
+    typedef struct __EntryNode
+    {
+        // エントリの根からの深さ
+        u8 depth;
+
+        // 末尾のエントリかどうか
+        Boolean tail;
+
+        // エントリ
+        Entry *entry;
+
+        // 次のノード
+        struct __EntryNode *nextNode;
+    } EntryNode;
+
+    // ノードは表示が終わるまでアリーナから切り出す
+    Arena *nodeArena;
+    result = createArena(&nodeArena);
+    if (result)
+    {
+        closeEntry(entry);
+        printf("Error: %d\n", result);
+        return;
+    }
+
+    // スタックにエントリを格納していく
+    EntryNode *entryStack = allocateArena(nodeArena, sizeof(EntryNode));
+    entryStack->depth = 0;
+    entryStack->entry = entry;
+    entryStack->nextNode = NULL;
+
+    while (entryStack != NULL)
+    {
+        // スタックからエントリをポップする
+        EntryNode *node = entryStack;
+        entryStack = node->nextNode;
+
+        // インデントを下げる
+        for (u8 i = 1; i < node->depth; ++i)
+        {
+            printf("    ");
+        }
+
+        // 親子関係を表す線を引く
+        if (node->depth > 0)
+        {
+            printf(node->tail ? "└── " : "├── ");
+        }
+
+        // エントリの名前を表示する
+        printf("%s\n", node->entry->name);
+
+        if (hasAttribute(node->entry, DIRECTORY))
+        {
+            Entry **children;
+            s32 count = getChildren(&children, node->entry);
+            if (count < 0)
+            {
+                printf("Error: %d\n", count);
+            }
+            else if (count > 0)
+            {
+                u8 nextDepth = node->depth + 1;
+
+                // スタックにエントリをプッシュする
+                EntryNode *newNode = allocateArena(nodeArena, sizeof(EntryNode));
+                newNode->depth = nextDepth;
+                newNode->tail = TRUE;
+                newNode->entry = children[count - 1];
+                newNode->nextNode = entryStack;
+                entryStack = newNode;
+
+                for (s32 i = count - 2; i >= 0; --i)
+                {
+                    Entry *child = children[i];
+                    if (startsWith(child->name, "."))
+                    {
+                        closeEntry(child);
+                        continue;
+                    }
+
+                    newNode = allocateArena(nodeArena, sizeof(EntryNode));
+                    newNode->depth = nextDepth;
+                    newNode->tail = FALSE;
+                    newNode->entry = child;
+                    newNode->nextNode = entryStack;
+                    entryStack = newNode;
+                }
+            }
+
+            free(children);
+        }
+
+        closeEntry(node->entry);
+    }
+
+    releaseArena(nodeArena);
+}
+
+// Datetimeを表示する
+void printDatetime(Datetime *datetime)
+{
+    printf("%04d/%02d/%02d %02d:%02d:%02d.%04d\n",
+           datetime->year,
+           datetime->month,
+           datetime->dayOfMonth,
+           datetime->hour,
+           datetime->minute,
+           datetime->second,
+           datetime->millisecond);
+}
+
+// エントリの情報を表示する
+void printInfo(const Entry *entry)
+{
+    printf("Name: %s\n", entry->name);
+    printf("Attribute(s):");
+    printf(hasAttribute(entry, READ_ONLY) ? " Readonly" : "");
+    printf(hasAttribute(entry, HIDDEN) ? " Hidden" : "");
+    printf(hasAttribute(entry, SYSTEM) ? " System" : "");
+    printf(hasAttribute(entry, VOLUME_ID) ? " Volume" : "");
+    printf(hasAttribute(entry, DIRECTORY) ? " Directory" : "");
+    printf(hasAttribute(entry, ARCHIVE) ? " File" : "");
+    puts("");
+
+    // 日時は表示するときに読み取る
+    Datetime datetime;
+    getCreatedAt(&datetime, entry);
+    printf("Create: ");
+    printDatetime(&datetime);
+    getModifiedAt(&datetime, entry);
+    printf("Modify: ");
+    printDatetime(&datetime);
+    getAccessedAt(&datetime, entry);
+    printf("Access: ");
+    printDatetime(&datetime);
+    printf("Size: %dB\n", entry->size);
+}
 
 /**
- * 基準となるエントリに相対的な、または絶対的なエントリを取得する
+ * ファイルの内容のうち、指定された位置から指定された長さの範囲を表示する
+ * 範囲がファイルの終端を超える場合は終端までを表示する
+ */
+void printDataRange(Entry *entry, u32 offset, u32 length)
+{
+    if (!hasAttribute(entry, ARCHIVE))
+    {
+        printf("Not file: %s\n", entry->name);
+        return;
+    }
+
+    File *file;
+    Result result = openFile(&file, entry);
+    if (result)
+    {
+        printf("Error: %d\n", result);
+        return;
+    }
+
+#ifdef HAS_POSIX_IO
+    // バイナリのファイルも途中で切れないように、バイト列をそのまま標準出力に書き出す
+    fflush(stdout);
+    copyFileTo(STDOUT_FILENO, file, offset, length);
+#else
+    // 表示を始める位置まで移動する
+    if (offset > entry->size)
+    {
+        offset = entry->size;
+    }
+    seekFile(file, offset, SEEK_SET);
+
+    u8 bytes[4096];
+    while (length > 0)
+    {
+        u32 readSize = length < sizeof(bytes) ? length : sizeof(bytes);
+        u32 size = readFile(bytes, readSize, file);
+        if (size <= 0)
+        {
+            break;
+        }
+
+        fwrite(bytes, sizeof(u8), size, stdout);
+        length -= size;
+    }
+#endif
+
+    closeFile(file);
+}
+
+// 終了するときに統計を表示する形式
+typedef enum __StatsFormat
+{
+    STATS_NONE,
+    STATS_TEXT,
+    STATS_JSON,
+} StatsFormat;
+
+// 統計を表示する
+void printStats(FILE *fp, const Image *image)
+{
+    const ImageStats *stats = image->stats;
+    fprintf(fp, "Seeks: %llu\n", stats->seekCount);
+    fprintf(fp, "Reads: %llu (%llu bytes)\n", stats->readCount, stats->readByteCount);
+    fprintf(fp, "Prefetches: %llu\n", stats->prefetchCount);
+    fprintf(fp, "FAT lookups: FAT12 %llu, FAT16 %llu, FAT32 %llu (%s)\n",
+            stats->fatLookupCounts[FAT12],
+            stats->fatLookupCounts[FAT16],
+            stats->fatLookupCounts[FAT32],
+            image->fatTable != NULL ? "table" : "on demand");
+    fprintf(fp, "Directory slots scanned: %llu\n", stats->slotCount);
+    fprintf(fp, "Entries allocated: %llu\n", stats->entryCount);
+    fprintf(fp, "Dentry cache: %llu hit(s), %llu miss(es)\n", stats->dentryHitCount, stats->dentryMissCount);
+
+    if (image->blockCache != NULL)
+    {
+        u64 blockLookupCount = stats->blockHitCount + stats->blockMissCount;
+        fprintf(fp, "Block cache: %llu hit(s), %llu miss(es), %llu eviction(s), %.1f%% hit rate (%u x %u bytes)\n",
+                stats->blockHitCount,
+                stats->blockMissCount,
+                stats->blockEvictionCount,
+                blockLookupCount > 0 ? stats->blockHitCount * 100.0 / blockLookupCount : 0.0,
+                image->blockCache->capacity,
+                image->blockCache->blockSize);
+    }
+    else
+    {
+        fprintf(fp, "Block cache: off (%s)\n", image->map != NULL ? "mapped" : "disabled");
+    }
+    fprintf(fp, "getChildren: %llu call(s), %.3f ms\n", stats->getChildrenCount, stats->getChildrenNanoseconds / 1e6);
+    fprintf(fp, "readFile: %llu call(s), %.3f ms\n", stats->readFileCount, stats->readFileNanoseconds / 1e6);
+    fprintf(fp, "Path resolution: %llu call(s), %.3f ms\n", stats->resolveCount, stats->resolveNanoseconds / 1e6);
+}
+
+// 統計をJSONのオブジェクトとして1行で表示する
+void printStatsJson(FILE *fp, const Image *image)
+{
+    const ImageStats *stats = image->stats;
+    fprintf(fp, "{\"seeks\": %llu, \"reads\": %llu, \"bytesRead\": %llu, \"prefetches\": %llu, ",
+            stats->seekCount, stats->readCount, stats->readByteCount, stats->prefetchCount);
+    fprintf(fp, "\"fatLookups\": {\"FAT12\": %llu, \"FAT16\": %llu, \"FAT32\": %llu}, \"fatTable\": %s, ",
+            stats->fatLookupCounts[FAT12],
+            stats->fatLookupCounts[FAT16],
+            stats->fatLookupCounts[FAT32],
+            image->fatTable != NULL ? "true" : "false");
+    fprintf(fp, "\"slotsScanned\": %llu, \"entriesAllocated\": %llu, \"dentryCacheHits\": %llu, \"dentryCacheMisses\": %llu, ",
+            stats->slotCount, stats->entryCount, stats->dentryHitCount, stats->dentryMissCount);
+    fprintf(fp, "\"blockCache\": {\"enabled\": %s, \"hits\": %llu, \"misses\": %llu, \"evictions\": %llu}, ",
+            image->blockCache != NULL ? "true" : "false", stats->blockHitCount, stats->blockMissCount, stats->blockEvictionCount);
+    fprintf(fp, "\"getChildren\": {\"calls\": %llu, \"nanoseconds\": %llu}, ", stats->getChildrenCount, stats->getChildrenNanoseconds);
+    fprintf(fp, "\"readFile\": {\"calls\": %llu, \"nanoseconds\": %llu}, ", stats->readFileCount, stats->readFileNanoseconds);
+    fprintf(fp, "\"resolve\": {\"calls\": %llu, \"nanoseconds\": %llu}}\n", stats->resolveCount, stats->resolveNanoseconds);
+}
+
+// 種類ごとのクラスタ数を、バイト数と全体に占める割合とともに表示する
+void printClusterUsage(const char *label, u32 count, const VolumeUsage *usage, const Image *image)
+{
+    printf("%-9s %u cluster(s), %llu bytes (%.1f%%)\n",
+           label,
+           count,
+           (u64)count * image->clusterSize,
+           usage->clusterCount > 0 ? count * 100.0 / usage->clusterCount : 0.0);
+}
+
+/**
+ * クラスタの使用状況を表示する
+ * 成功したら0、FATを読み込めなかった場合は0以外を返す
+ */
+Result printVolumeUsage(const Image *image, Boolean useFsInfo)
+{
+    VolumeUsage usage;
+    Result result = getVolumeUsage(&usage, image, useFsInfo);
+    if (result)
+    {
+        printf("Error: could not read FAT\n");
+        return result;
+    }
+
+    printf("Clusters: %u x %u bytes (%llu bytes)\n",
+           usage.clusterCount,
+           image->clusterSize,
+           (u64)usage.clusterCount * image->clusterSize);
+    printClusterUsage("Used:", usage.usedCount, &usage, image);
+    printClusterUsage("Free:", usage.freeCount, &usage, image);
+    if (usage.fromFsInfo)
+    {
+        printf("Source: FSInfo\n");
+        return 0;
+    }
+    printClusterUsage("Bad:", usage.badCount, &usage, image);
+    printClusterUsage("Reserved:", usage.reservedCount, &usage, image);
+
+    // 走査した結果とFSInfoの記録を比べる
+    if (image->fsInfoFreeCount == FSINFO_UNKNOWN)
+    {
+        printf("FSInfo: none\n");
+    }
+    else if (image->fsInfoFreeCount == usage.freeCount)
+    {
+        printf("FSInfo: %u free (up to date)\n", image->fsInfoFreeCount);
+    }
+    else
+    {
+        printf("FSInfo: %u free (stale)\n", image->fsInfoFreeCount);
+    }
+    return 0;
+}
+
+// 検査で見つかる問題の種類の名前を取得する
+const char *getCheckProblemName(CheckProblemType type)
+{
+    switch (type)
+    {
+    case CHECK_CROSS_LINK:
+        return "Cross-linked clusters";
+    case CHECK_CYCLE:
+        return "Cyclic chains";
+    case CHECK_BAD_CHAIN:
+        return "Broken chains";
+    case CHECK_SIZE_MISMATCH:
+        return "Size mismatches";
+    case CHECK_LOST_CLUSTER:
+        return "Lost clusters";
+    default:
+        return "FAT copy mismatches";
+    }
+}
+
+/**
+ * FATイメージの整合性を検査し、結果を表示する
+ * 問題がなければ0、問題が見つかった場合や検査を終えられなかった場合は0以外を返す
+ */
+Result printCheck(Image *image)
+{
+    CheckReport report;
+    Result result = checkImage(&report, image);
+    if (result)
+    {
+        printf("Error: %d\n", result);
+        freeCheckReport(&report);
+        return result;
+    }
+
+    printf("Checked %llu file(s), %llu directory(s), %llu cluster(s) in chains\n",
+           report.fileCount,
+           report.directoryCount,
+           report.clusterCount);
+
+    u64 problemCount = 0;
+    for (u32 type = 0; type < CHECK_PROBLEM_TYPE_COUNT; ++type)
+    {
+        printf("%s: %llu\n", getCheckProblemName(type), report.problemCounts[type]);
+        problemCount += report.problemCounts[type];
+    }
+
+    for (u32 i = 0; i < report.problemCount; ++i)
+    {
+        const CheckProblem *problem = &report.problems[i];
+        printf("  %s: cluster %u%s%s\n",
+               getCheckProblemName(problem->type),
+               problem->cluster,
+               problem->path != NULL ? " " : "",
+               problem->path != NULL ? problem->path : "");
+    }
+    if (problemCount > report.problemCount)
+    {
+        printf("  ... %llu more\n", problemCount - report.problemCount);
+    }
+
+    if (problemCount == 0)
+    {
+        printf("No problems found\n");
+    }
+    else
+    {
+        printf("%llu problem(s) found\n", problemCount);
+    }
+
+    freeCheckReport(&report);
+    return problemCount == 0 ? 0 : 1;
+}
+
+// 切り出したファイルの種類の名前を取得する
+const char *getCarveTypeName(CarveType type)
+{
+    switch (type)
+    {
+    case CARVE_JPEG:
+        return "JPEG";
+    case CARVE_PNG:
+        return "PNG";
+    default:
+        return "ZIP";
+    }
+}
+
+// 削除されたエントリと、データが残っていると考えられるクラスタの並びを表示する
+void printDeletedEntry(const DeletedEntry *entry)
+{
+    printf("  %c %s (%u bytes, cluster %u): ", entry->isDirectory ? 'd' : 'f', entry->path, entry->size, entry->cluster);
+    if (entry->overwritten)
+    {
+        printf("overwritten\n");
+        return;
+    }
+    if (entry->extentCount == 0)
+    {
+        printf("no data\n");
+        return;
+    }
+
+    for (u32 i = 0; i < entry->extentCount; ++i)
+    {
+        const Extent *extent = &entry->extents[i];
+        printf("%s%u", i > 0 ? "," : "", extent->cluster);
+        if (extent->length > 1)
+        {
+            printf("-%u", extent->cluster + extent->length - 1);
+        }
+    }
+    printf("%s\n", entry->clusterCount < entry->expectedClusterCount ? " (partial)" : "");
+}
+
+/**
+ * 削除されたエントリと空き領域から切り出したファイルを探して表示する
+ * ディレクトリが指定された場合は、見つかったファイルをディレクトリに書き出す
+ * 成功したら0、それ以外の場合は0以外を返す
+ */
+Result printRecovery(Image *image, const char *destination)
+{
+    RecoveryReport report;
+    Result result = recoverImage(&report, image);
+    if (result)
+    {
+        printf("Error: %d\n", result);
+        freeRecoveryReport(&report);
+        return result;
+    }
+
+    printf("Scanned %llu directory(s), %llu free cluster(s)\n", report.directoryCount, report.freeClusterCount);
+
+    printf("Deleted entries: %u\n", report.deletedEntryCount);
+    for (u32 i = 0; i < report.deletedEntryCount; ++i)
+    {
+        printDeletedEntry(&report.deletedEntries[i]);
+    }
+
+    printf("Carved files: %u\n", report.carvedFileCount);
+    for (u32 i = 0; i < report.carvedFileCount; ++i)
+    {
+        const CarvedFile *file = &report.carvedFiles[i];
+        printf("  %s: cluster %u, %llu bytes%s\n",
+               getCarveTypeName(file->type),
+               file->cluster,
+               file->size,
+               file->complete ? "" : " (end not found)");
+    }
+
+    if (destination != NULL)
+    {
+#ifdef HAS_POSIX_IO
+        u64 count;
+        u64 skippedCount;
+        result = writeRecoveredFiles(&count, &skippedCount, &report, image, destination);
+        printf("Wrote %llu file(s) to %s\n", count, destination);
+        if (skippedCount > 0)
+        {
+            printf("Skipped %llu existing file(s)\n", skippedCount);
+        }
+        if (result)
+        {
+            printf("Error: %d\n", result);
+        }
+#else
+        printf("Not supported: recover DESTDIR\n");
+        result = 1;
+#endif
+    }
+
+    freeRecoveryReport(&report);
+    return result;
+}
+
+/**
+ * 指定された形式で統計を標準エラー出力に表示する
+ * 標準出力に書き出したファイルの内容と混ざらないようにする
+ */
+void reportStats(const Image *image, StatsFormat format)
+{
+    if (format == STATS_TEXT)
+    {
+        printStats(stderr, image);
+    }
+    else if (format == STATS_JSON)
+    {
+        printStatsJson(stderr, image);
+    }
+}
+
+// エントリを展開し、結果を表示する
+Result printExtract(const Entry *entry, const char *destination)
+{
+#ifdef HAS_POSIX_IO
+    ExtractStats stats;
+    Result result = extractEntry(&stats, entry, destination, getExtractWorkerCount());
+
+    double megabytes = stats.byteCount / (1024.0 * 1024.0);
+    printf("Extracted %llu file(s), %llu directory(s), %llu bytes in %.3fs (%.1f MiB/s)\n",
+           stats.fileCount,
+           stats.directoryCount,
+           stats.byteCount,
+           stats.seconds,
+           stats.seconds > 0 ? megabytes / stats.seconds : 0.0);
+    if (result)
+    {
+        printf("Error: %d (%llu failure(s))\n", result, stats.errorCount);
+    }
+    return result;
+#else
+    printf("Not supported: extract\n");
+    return 1;
+#endif
+}
+
+// ファイルの内容をすべて表示する
+void printData(Entry *entry)
+{
+    printDataRange(entry, 0, entry->size);
+}
+
+// ファイルの内容のうち、末尾の指定された長さを表示する
+void printDataTail(Entry *entry, u32 length)
+{
+    u32 offset = entry->size > length ? entry->size - length : 0;
+    printDataRange(entry, offset, length);
+}
+
+// まとめて解決したパスの表示の設定と結果
+typedef struct __BatchOutput
+{
+    // 情報に加えて内容も表示するかどうか
+    Boolean dump;
+
+    // 見つからなかったパスの数
+    u32 missingCount;
+} BatchOutput;
+
+/**
+ * 指定されたファイルの内容をすべて読み込み、終端の0を加えたバッファを返す
+ * ファイル名が"-"の場合は標準入力から読み込む
  * 成功したら0、それ以外の場合は0以外を返す
  */
-Result getEntry(Entry **entryPointer, const Entry *baseEntry, const char *path)
+Result readListFile(char **bufferPointer, u64 *sizePointer, const char *filename)
 {
-    wchar_t *widePath;
-    toWide(&widePath, path);
-    Result result;
+    *bufferPointer = NULL;
+    *sizePointer = 0;
 
-    if (startsWith(widePath, PATH_DELIMITER))
+    FILE *fp = strcmp(filename, "-") == 0 ? stdin : fopen(filename, "rb");
+    if (fp == NULL)
     {
-        result = openEntry(entryPointer, baseEntry->image, widePath);
+        return 1;
     }
-    else
+
+    char *buffer = NULL;
+    u64 size = 0;
+    u64 capacity = 0;
+    Result result = 0;
+    while (TRUE)
+    {
+        if (size + 1 >= capacity)
+        {
+            capacity = capacity == 0 ? COPY_BUFFER_SIZE : capacity * 2;
+            char *newBuffer = realloc(buffer, capacity);
+            if (newBuffer == NULL)
+            {
+                result = 2;
+                break;
+            }
+            buffer = newBuffer;
+        }
+
+        u64 readSize = fread(buffer + size, sizeof(char), capacity - size - 1, fp);
+        size += readSize;
+        if (readSize == 0)
+        {
+            result = ferror(fp) ? 3 : 0;
+            break;
+        }
+    }
+
+    if (fp != stdin)
+    {
+        fclose(fp);
+    }
+    if (result)
     {
-        result = getDescendantEntry(entryPointer, baseEntry, widePath);
+        free(buffer);
+        return result;
     }
 
-    free(widePath);
-    return result;
+    buffer[size] = '\0';
+    *bufferPointer = buffer;
+    *sizePointer = size;
+    return 0;
 }
 
-// 子エントリをすべて表示する
-void printChildren(const Entry *parent)
+// まとめて解決したパスのエントリの情報と、指定されていれば内容を表示する
+void printBatchEntry(const char *path, const Entry *entry, void *context)
 {
-    Entry **children;
-    u16 count = getChildren(&children, parent);
-    if (count < 0)
+    BatchOutput *output = context;
+    if (entry == NULL)
     {
-        printf("Error: %d\n", count);
+        printf("Not found: %s\n", path);
+        output->missingCount++;
         return;
     }
 
-    for (u16 i = 0; i < count; ++i)
+    printf("Path: %s\n", path);
+    printInfo(entry);
+    if (!output->dump)
     {
-        Entry *child = children[i];
-        char type = child->directory ? 'd' : 'f';
-        printf("%c %ls\n", type, child->name);
-        closeEntry(child);
+        return;
     }
 
-    free(children);
+    // 読み取ったエントリは次のreadDirで無効になるので、複製してから内容を読み込む
+    Entry *copy;
+    if (copyEntry(&copy, entry) == 0)
+    {
+        puts("/=================================================================================================\\");
+        printData(copy);
+        puts("\\=================================================================================================/");
+        closeEntry(copy);
+    }
 }
 
-// 指定されたエントリ以下の階層構造を表示する
-void printTree(const Entry *root)
+/**
+ * 0で区切られたパスの一覧を読み込み、各ディレクトリを一度だけ読み取って解決したエントリを表示する
+ * 見つからなかったパスがあれば最後に表示する
+ * すべて見つかったら0、それ以外の場合は0以外を返す
+ */
+Result printBatch(Image *image, const char *listFilename, Boolean dump)
 {
-    // エントリをコピーする
-    Entry *entry;
-    Result result = copyEntry(&entry, root);
+    char *buffer;
+    u64 size;
+    Result result = readListFile(&buffer, &size, listFilename);
     if (result)
     {
         printf("Error: %d\n", result);
-        return;
+        return result;
     }
 
-    // エントリのスタックのノード
-    typedef struct __EntryNode
+    // 空のパスは除いて、各パスの先頭を集める
+    u32 count = 0;
+    for (u64 i = 0; i < size; i += strlen(buffer + i) + 1)
     {
-        // エントリの根からの深さ
-        u8 depth;
-
-        // 末尾のエントリかどうか
-        Boolean tail;
-
-        // エントリ
-        Entry *entry;
-
-        // 次のノード
-        struct __EntryNode *nextNode;
-    } EntryNode;
-
-    // スタックにエントリを格納していく
-    EntryNode *entryStack = malloc(sizeof(EntryNode));
-    entryStack->depth = 0;
-    entryStack->entry = entry;
-    entryStack->nextNode = NULL;
-
-    while (entryStack != NULL)
+        count += buffer[i] != '\0';
+    }
+    const char **paths = malloc((count > 0 ? count : 1) * sizeof(char *));
+    if (paths == NULL)
     {
-        // スタックからエントリをポップする
-        EntryNode *node = entryStack;
-        entryStack = node->nextNode;
-
-        // インデントを下げる
-        for (u8 i = 1; i < node->depth; ++i)
-        {
-            printf("    ");
-        }
-
-        // 親子関係を表す線を引く
-        if (node->depth > 0)
+        free(buffer);
+        return 1;
+    }
+    count = 0;
+    for (u64 i = 0; i < size; i += strlen(buffer + i) + 1)
+    {
+        if (buffer[i] != '\0')
         {
-            printf(node->tail ? "└── " : "├── ");
+            paths[count++] = buffer + i;
         }
+    }
 
-        // エントリの名前を表示する
-        printf("%ls\n", node->entry->name);
-
-        if (node->entry->directory)
+    PathTrie *trie;
+    result = buildPathTrie(&trie, paths, count);
+    if (result == 0)
+    {
+        BatchOutput output;
+        output.dump = dump;
+        output.missingCount = 0;
+        result = walkPathTrie(trie, image, printBatchEntry, &output);
+        if (result == 0 && output.missingCount > 0)
         {
-            Entry **children;
-            u16 count = getChildren(&children, node->entry);
-            if (count < 0)
-            {
-                printf("Error: %d\n", count);
-            }
-            else if (count > 0)
-            {
-                u8 nextDepth = node->depth + 1;
-
-                // スタックにエントリをプッシュする
-                EntryNode *newNode = malloc(sizeof(EntryNode));
-                newNode->depth = nextDepth;
-                newNode->tail = TRUE;
-                newNode->entry = children[count - 1];
-                newNode->nextNode = entryStack;
-                entryStack = newNode;
-
-                for (s16 i = count - 2; i >= 0; --i)
-                {
-                    Entry *child = children[i];
-                    if (startsWith(child->name, L"."))
-                    {
-                        continue;
-                    }
-
-                    newNode = malloc(sizeof(EntryNode));
-                    newNode->depth = nextDepth;
-                    newNode->tail = FALSE;
-                    newNode->entry = child;
-                    newNode->nextNode = entryStack;
-                    entryStack = newNode;
-                }
-            }
-
-            free(children);
+            result = 127;
         }
-
-        closeEntry(node->entry);
-        free(node);
+        destroyPathTrie(trie);
     }
-}
-
-// Datetimeを表示する
-void printDatetime(Datetime *datetime)
-{
-    printf("%04d/%02d/%02d %02d:%02d:%02d.%04d\n",
-           datetime->year,
-           datetime->month,
-           datetime->dayOfMonth,
-           datetime->hour,
-           datetime->minute,
-           datetime->second,
-           datetime->millisecond);
-}
-
-// エントリの情報を表示する
-void printInfo(const Entry *entry)
-{
-    printf("Name: %ls\n", entry->name);
-    printf("Attribute(s):");
-    printf(entry->readonly ? " Readonly" : "");
-    printf(entry->hidden ? " Hidden" : "");
-    printf(entry->system ? " System" : "");
-    printf(entry->volume ? " Volume" : "");
-    printf(entry->directory ? " Directory" : "");
-    printf(entry->file ? " File" : "");
-    puts("");
-    printf("Create: ");
-    printDatetime(entry->createdAt);
-    printf("Modify: ");
-    printDatetime(entry->modifiedAt);
-    printf("Access: ");
-    printDatetime(entry->accessedAt);
-    printf("Size: %dB\n", entry->size);
-}
-
-// ファイルの内容をすべて表示する
-void printData(Entry *entry)
-{
-    if (!entry->file)
+    else
     {
-        printf("Not file: %ls\n", entry->name);
-        return;
+        printf("Error: %d\n", result);
     }
 
-    File *file;
-    Result result = openFile(&file, entry);
-    if (result)
+    free(paths);
+    free(buffer);
+    return result;
+}
+/**
+ * コマンドの引数を10進数の32ビットの符号なし整数として解釈する
+ * 解釈できたら0、それ以外の場合は0以外を返す
+ */
+Result parseCount(u32 *valuePointer, const char *string)
+{
+    // strtoulは負の値や空白で始まる文字列も受け付けるので、数字で始まることを先に確かめる
+    if (string[0] < '0' || string[0] > '9')
     {
-        printf("Error: %d\n", result);
+        return FAT_ERROR_INVALID_ARGUMENT;
     }
 
-    u8 bytes[201];
-    while (TRUE)
+    char *end;
+    errno = 0;
+    unsigned long value = strtoul(string, &end, 10);
+    if (errno != 0 || *end != '\0' || value > 0xffffffff)
     {
-        u32 size = readFile(bytes, sizeof(bytes) - 1, file);
-        if (size <= 0)
-        {
-            break;
-        }
-
-        bytes[size] = '\0';
-        printf("%s", bytes);
+        return FAT_ERROR_INVALID_ARGUMENT;
     }
 
-    closeFile(file);
+    *valuePointer = value;
+    return 0;
 }
 #pragma endregion
 
@@ -1405,7 +8590,12 @@ int main(int argc, char *argv[])
 
     if (argc == 1)
     {
-        printf("Usage: %s IMAGE_FILE [...FILE]\n", argv[0]);
+        printf("Usage: %s IMAGE_FILE [--catalog] [--stats[=json]] [...FILE]\n", argv[0]);
+        printf("       %s IMAGE_FILE [--catalog] [--stats[=json]] --extract [PATH] DESTDIR\n", argv[0]);
+        printf("       %s IMAGE_FILE [--catalog] [--stats[=json]] --batch[=info] [LISTFILE]\n", argv[0]);
+        printf("       %s IMAGE_FILE [--stats[=json]] --df[=scan]\n", argv[0]);
+        printf("       %s IMAGE_FILE [--stats[=json]] --check\n", argv[0]);
+        printf("       %s IMAGE_FILE [--stats[=json]] --recover [DESTDIR]\n", argv[0]);
         return 1;
     }
     else
@@ -1413,23 +8603,112 @@ int main(int argc, char *argv[])
         imageFilename = argv[1];
     }
 
+    // オプションを解釈する
+    ImageOptions options;
+    getDefaultImageOptions(&options);
+    StatsFormat statsFormat = STATS_NONE;
+
+    s32 argumentIndex = 2;
+    for (; argumentIndex < argc; ++argumentIndex)
+    {
+        if (strcmp(argv[argumentIndex], "--catalog") == 0)
+        {
+            options.buildCatalog = TRUE;
+        }
+        else if (strcmp(argv[argumentIndex], "--stats") == 0)
+        {
+            statsFormat = STATS_TEXT;
+        }
+        else if (strcmp(argv[argumentIndex], "--stats=json") == 0)
+        {
+            statsFormat = STATS_JSON;
+        }
+        else
+        {
+            break;
+        }
+    }
+
     Image *image;
-    Result result = openImage(&image, imageFilename);
+    Result result = openImageWithOptions(&image, imageFilename, &options);
     if (result)
     {
         return result;
     }
 
-    if (argc > 2)
+    // FSInfoの記録が使えれば記録から、--df=scanの場合や使えない場合はFATを走査して求める
+    if (argumentIndex < argc && (strcmp(argv[argumentIndex], "--df") == 0 || strcmp(argv[argumentIndex], "--df=scan") == 0))
+    {
+        result = printVolumeUsage(image, strcmp(argv[argumentIndex], "--df") == 0);
+        reportStats(image, statsFormat);
+        closeImage(image);
+        return result;
+    }
+
+    // 問題が見つかった場合は0以外で終了する
+    if (argumentIndex < argc && strcmp(argv[argumentIndex], "--check") == 0)
+    {
+        result = printCheck(image);
+        reportStats(image, statsFormat);
+        closeImage(image);
+        return result;
+    }
+
+    // 一覧のファイルが指定されていなければ、標準入力から読み込む
+    if (argumentIndex < argc && (strcmp(argv[argumentIndex], "--batch") == 0 || strcmp(argv[argumentIndex], "--batch=info") == 0))
+    {
+        const char *listFilename = argumentIndex + 1 < argc ? argv[argumentIndex + 1] : "-";
+        result = printBatch(image, listFilename, strcmp(argv[argumentIndex], "--batch") == 0);
+        reportStats(image, statsFormat);
+        closeImage(image);
+        return result;
+    }
+
+    // ディレクトリが指定されていれば、見つかったファイルを書き出す
+    if (argumentIndex < argc && strcmp(argv[argumentIndex], "--recover") == 0)
+    {
+        result = printRecovery(image, argumentIndex + 1 < argc ? argv[argumentIndex + 1] : NULL);
+        reportStats(image, statsFormat);
+        closeImage(image);
+        return result;
+    }
+
+    if (argumentIndex < argc && strcmp(argv[argumentIndex], "--extract") == 0)
     {
-        wchar_t *targetFilename;
+        s32 extractArgumentCount = argc - argumentIndex - 1;
+        if (extractArgumentCount < 1)
+        {
+            printf("Usage: %s IMAGE_FILE [--catalog] [--stats[=json]] --extract [PATH] DESTDIR\n", argv[0]);
+            closeImage(image);
+            return 1;
+        }
+
+        // 最後の引数を展開先とする
+        const char *targetPath = extractArgumentCount > 1 ? argv[argumentIndex + 1] : "/";
 
-        for (u8 i = 2; i < argc; i++)
+        Entry *entry;
+        result = openEntry(&entry, image, targetPath);
+        if (result == 0)
+        {
+            result = printExtract(entry, argv[argc - 1]);
+            closeEntry(entry);
+        }
+        else
         {
-            toWide(&targetFilename, argv[i]);
+            printf("Error: %d\n", result);
+        }
+
+        reportStats(image, statsFormat);
+        closeImage(image);
+        return result;
+    }
 
+    if (argumentIndex < argc)
+    {
+        for (s32 i = argumentIndex; i < argc; i++)
+        {
             Entry *entry;
-            result = openEntry(&entry, image, targetFilename);
+            result = openEntry(&entry, image, argv[i]);
             if (result == 0)
             {
                 printInfo(entry);
@@ -1440,13 +8719,13 @@ int main(int argc, char *argv[])
             }
         }
 
-        free(targetFilename);
+        reportStats(image, statsFormat);
         closeImage(image);
         return result;
     }
 
     Entry *currentDirectory;
-    result = openEntry(&currentDirectory, image, L"/");
+    result = openEntry(&currentDirectory, image, "/");
     if (result)
     {
         closeImage(image);
@@ -1473,6 +8752,32 @@ int main(int argc, char *argv[])
             param = "";
         }
 
+        // 範囲を指定する追加の引数を取り出す
+        char *offsetParam = strtok(NULL, " ");
+        char *lengthParam = strtok(NULL, " ");
+
+        // extractは最後の引数を展開先とする
+        char *destination = NULL;
+        if (command != NULL && strcmp(command, "extract") == 0)
+        {
+            if (offsetParam == NULL)
+            {
+                destination = param;
+                param = "";
+            }
+            else
+            {
+                destination = offsetParam;
+            }
+        }
+
+        // recoverの引数は書き出し先とする
+        if (command != NULL && strcmp(command, "recover") == 0)
+        {
+            destination = param[0] != '\0' ? param : NULL;
+            param = "";
+        }
+
         // 引数が指すエントリを取得する
         Entry *paramEntry;
         result = getEntry(&paramEntry, currentDirectory, param);
@@ -1503,7 +8808,60 @@ int main(int argc, char *argv[])
         }
         else if (strcmp(command, "cat") == 0)
         {
-            printData(paramEntry);
+            u32 offset = 0;
+            u32 length = paramEntry->size;
+            if (offsetParam == NULL)
+            {
+                printData(paramEntry);
+            }
+            else if (parseCount(&offset, offsetParam))
+            {
+                printf("Error: invalid number: %s\n", offsetParam);
+            }
+            else if (lengthParam != NULL && parseCount(&length, lengthParam))
+            {
+                printf("Error: invalid number: %s\n", lengthParam);
+            }
+            else
+            {
+                printDataRange(paramEntry, offset, length);
+            }
+        }
+        else if (strcmp(command, "head") == 0 || strcmp(command, "tail") == 0)
+        {
+            u32 length = DEFAULT_PEEK_SIZE;
+            if (offsetParam != NULL && parseCount(&length, offsetParam))
+            {
+                printf("Error: invalid number: %s\n", offsetParam);
+            }
+            else if (strcmp(command, "head") == 0)
+            {
+                printDataRange(paramEntry, 0, length);
+            }
+            else
+            {
+                printDataTail(paramEntry, length);
+            }
+        }
+        else if (strcmp(command, "extract") == 0)
+        {
+            printExtract(paramEntry, destination);
+        }
+        else if (strcmp(command, "df") == 0)
+        {
+            printVolumeUsage(image, FALSE);
+        }
+        else if (strcmp(command, "check") == 0)
+        {
+            printCheck(image);
+        }
+        else if (strcmp(command, "recover") == 0)
+        {
+            printRecovery(image, destination);
+        }
+        else if (strcmp(command, "stats") == 0)
+        {
+            printStats(stdout, image);
         }
         else if (strcmp(command, "help") == 0)
         {
@@ -1519,6 +8877,8 @@ int main(int argc, char *argv[])
     }
 
     closeEntry(currentDirectory);
+    reportStats(image, statsFormat);
     closeImage(image);
     return result;
 }
+#endif
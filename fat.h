@@ -0,0 +1,154 @@
+/**
+ * FAT12/FAT16/FAT32のイメージファイルを読み込むライブラリの公開ヘッダ
+ * 関数は標準出力に何も表示せず、結果をエラーコードで返す
+ * 型と関数はFat、fat_で始まる名前だけを公開する
+ * 1つのFATイメージを複数のスレッドから使う場合は、エントリとポインタをスレッドごとに開く
+ */
+#ifndef FAT_H
+#define FAT_H
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// 共有ライブラリから公開する関数に付ける属性
+#if defined(_WIN32) && defined(FAT_SHARED)
+#ifdef FAT_BUILDING
+#define FAT_API __declspec(dllexport)
+#else
+#define FAT_API __declspec(dllimport)
+#endif
+#elif defined(__GNUC__)
+#define FAT_API __attribute__((visibility("default")))
+#else
+#define FAT_API
+#endif
+
+// ライブラリのバージョン
+#define FAT_VERSION_MAJOR 1
+#define FAT_VERSION_MINOR 0
+
+// エントリの属性ビット
+#define FAT_READ_ONLY 0x01
+#define FAT_HIDDEN 0x02
+#define FAT_SYSTEM 0x04
+#define FAT_VOLUME_ID 0x08
+#define FAT_DIRECTORY 0x10
+#define FAT_ARCHIVE 0x20
+
+// ブール値
+typedef int FatBoolean;
+
+// 処理の結果、0ならば成功、それ以外はFatResultCodeのいずれか
+typedef int FatResult;
+
+// 処理の結果を表すエラーコード
+typedef enum __FatResultCode
+{
+    // 成功した
+    FAT_OK = 0,
+
+    // メモリを確保できなかった
+    FAT_ERROR_NO_MEMORY = 1,
+
+    // FATイメージのファイルを開けなかったか、読み込めなかった
+    FAT_ERROR_IO = 2,
+
+    // FATイメージのブートセクタやクラスタのチェーンが壊れている
+    FAT_ERROR_INVALID_IMAGE = 3,
+
+    // ディレクトリではないエントリの子エントリを求めた
+    FAT_ERROR_NOT_DIRECTORY = 4,
+
+    // ファイルではないエントリのポインタを開こうとした
+    FAT_ERROR_NOT_FILE = 5,
+
+    // 引数が範囲外である
+    FAT_ERROR_INVALID_ARGUMENT = 6,
+
+    // 指定されたパスのエントリが見つからなかった
+    FAT_ERROR_NOT_FOUND = 127,
+} FatResultCode;
+
+// FATイメージ
+typedef struct __Image FatImage;
+
+// FATイメージに含まれるエントリ
+typedef struct __Entry FatEntry;
+
+// ファイルのエントリのポインタ
+typedef struct __File FatFile;
+
+/**
+ * FATイメージを指定されたパスから既定のオプションで開く
+ * 成功したら0、それ以外の場合はエラーコードを返す
+ */
+FAT_API FatResult fat_openImage(FatImage **imagePointer, const char *path);
+
+/**
+ * FATイメージを閉じ、開いているエントリとポインタもすべて閉じる
+ * 成功したら0、それ以外の場合はエラーコードを返す
+ */
+FAT_API FatResult fat_closeImage(FatImage *image);
+
+/**
+ * 指定されたFATイメージ、パス（UTF-8、区切り文字は/）のエントリを開く
+ * 成功したら0、それ以外の場合はエラーコードを返す
+ */
+FAT_API FatResult fat_openEntry(FatEntry **entryPointer, FatImage *image, const char *path);
+
+/**
+ * 指定されたエントリからの相対パスのエントリを開く
+ * 成功したら0、それ以外の場合はエラーコードを返す
+ */
+FAT_API FatResult fat_getDescendantEntry(FatEntry **descendantPointer, const FatEntry *parent, const char *path);
+
+// エントリを閉じ、エントリのポインタもすべて閉じる
+FAT_API void fat_closeEntry(FatEntry *entry);
+
+// エントリの名前（UTF-8）を返す、名前はエントリを閉じるまで有効
+FAT_API const char *fat_getEntryName(const FatEntry *entry);
+
+// エントリのバイト数を返す
+FAT_API unsigned int fat_getEntrySize(const FatEntry *entry);
+
+// エントリが指定された属性ビットを持つかどうかを返す
+FAT_API FatBoolean fat_hasAttribute(const FatEntry *entry, unsigned char attribute);
+
+/**
+ * 指定されたディレクトリのエントリの子エントリをすべて開く
+ * 子エントリの数を返し、開けなかった場合はエラーコードを負にした値を返す
+ * 開いた子エントリと配列は、fat_freeChildrenで閉じる
+ */
+FAT_API int fat_getChildren(FatEntry **childrenPointer[], const FatEntry *parent);
+
+// fat_getChildrenで開いた子エントリをすべて閉じ、配列を解放する
+FAT_API void fat_freeChildren(FatEntry *children[], int count);
+
+/**
+ * 指定されたファイルのエントリのポインタを開く
+ * 成功したら0、それ以外の場合はエラーコードを返す
+ */
+FAT_API FatResult fat_openFile(FatFile **filePointer, FatEntry *entry);
+
+// ポインタを閉じる
+FAT_API void fat_closeFile(FatFile *file);
+
+/**
+ * 指定されたポインタから、指定された長さのバイト列を読み込む
+ * 実際に読み込まれたバイト列の長さを返し、ファイルの終わりでは0を返す
+ */
+FAT_API unsigned int fat_readFile(unsigned char *bytes, unsigned int size, FatFile *file);
+
+/**
+ * ポインタの位置を、基準となる位置(SEEK_SET、SEEK_CUR、SEEK_END)からの相対位置に移動させる
+ * 成功したら0、それ以外の場合はエラーコードを返す
+ */
+FAT_API FatResult fat_seekFile(FatFile *file, long long offset, int whence);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif